@@ -0,0 +1,257 @@
+#include "i8080/batch.h"
+#include "i8080/loader.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ARENA_ALIGNMENT 64  // cache line, workers never share one
+
+// bump allocator, sized up front so a whole batch is a single allocation
+typedef struct {
+  uint8_t* base;
+  size_t used;
+} arena_t;
+
+static size_t arena_round(const size_t size) {
+  return (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+}
+
+static void* arena_alloc(arena_t* arena, const size_t size) {
+  void* memory = &arena->base[arena->used];
+  arena->used += arena_round(size);
+
+  return memory;
+}
+
+// rom file, mapped once no matter how many jobs use it. every worker maps
+// the same image copy-on-write, so there's one copy of it in memory
+typedef struct {
+  const char* name;
+  uint16_t entry;
+  i8080_image_t* image;  // NULL if the file couldn't be read
+} rom_t;
+
+// deque of job indices, the owner takes from the back and thieves from the
+// front. jobs are all queued before the workers start, none are added later
+typedef struct {
+  pthread_mutex_t lock;
+  int* jobs;
+  int front, back;
+} job_queue_t;
+
+struct batch;
+
+typedef struct {
+  i8080_t state;  // reused for every job the worker runs
+  uint8_t* memory;
+  job_queue_t queue;
+  pthread_t thread;
+  bool started;
+  int index;
+  struct batch* batch;
+} worker_t;
+
+typedef struct batch {
+  const i8080_job_t* jobs;
+  i8080_job_result_t* results;
+  const rom_t* roms;
+  const int* job_roms;  // index into roms for every job
+  worker_t* workers;
+  int worker_count;
+} batch_t;
+
+static int queue_pop_back(job_queue_t* queue) {
+  int job = -1;
+
+  pthread_mutex_lock(&queue->lock);
+  if (queue->front < queue->back)
+    job = queue->jobs[--queue->back];
+  pthread_mutex_unlock(&queue->lock);
+
+  return job;
+}
+
+static int queue_pop_front(job_queue_t* queue) {
+  int job = -1;
+
+  pthread_mutex_lock(&queue->lock);
+  if (queue->front < queue->back)
+    job = queue->jobs[queue->front++];
+  pthread_mutex_unlock(&queue->lock);
+
+  return job;
+}
+
+// next job of the worker's own queue, stolen from the others once it's empty
+static int take_job(batch_t* batch, worker_t* worker) {
+  int job = queue_pop_back(&worker->queue);
+
+  for (int i = 1; job < 0 && i < batch->worker_count; i++) {
+    worker_t* victim =
+        &batch->workers[(worker->index + i) % batch->worker_count];
+    job = queue_pop_front(&victim->queue);
+  }
+
+  return job;
+}
+
+static void run_job(batch_t* batch, worker_t* worker, const int index) {
+  const i8080_job_t* job = &batch->jobs[index];
+  const rom_t* rom = &batch->roms[batch->job_roms[index]];
+  i8080_job_result_t* result = &batch->results[index];
+  i8080_t* state = &worker->state;
+
+  *result = (i8080_job_result_t){0, 0, job->entry, rom->image != NULL, false};
+  if (!rom->image)
+    return;
+
+  init_i8080(state);
+  i8080_attach_memory(state, worker->memory);
+
+  memset(worker->memory, 0, I8080_MAX_MEMORY);
+  i8080_image_load(state, rom->image);
+  if (job->entry > 5)
+    worker->memory[5] = 0xc9;  // bdos entry, RET
+  state->pc = job->entry;
+
+  // a rom starting at 0x0000 can't end by jumping there
+  const i8080_run_result_t run =
+      job->entry ? i8080_run_until(state, 0x0000, job->max_cycles)
+                 : i8080_run(state, job->max_cycles);
+
+  result->cycles = run.cycles;
+  result->instructions = run.instructions;
+  result->pc = state->pc;
+  result->completed = (job->entry && state->pc == 0x0000) || state->halted;
+}
+
+static void* worker_main(void* context) {
+  worker_t* worker = context;
+  int job;
+
+  while ((job = take_job(worker->batch, worker)) >= 0)
+    run_job(worker->batch, worker, job);
+
+  return NULL;
+}
+
+// opens every distinct rom of the batch, a rom loaded at different entries
+// is a different image
+static int open_roms(const i8080_job_t* jobs,
+                     const int count,
+                     rom_t* roms,
+                     int* job_roms) {
+  int rom_count = 0;
+
+  for (int i = 0; i < count; i++) {
+    int rom = 0;
+    while (rom < rom_count && (strcmp(roms[rom].name, jobs[i].rom) != 0 ||
+                               roms[rom].entry != jobs[i].entry))
+      rom++;
+
+    if (rom == rom_count) {
+      roms[rom] = (rom_t){
+          jobs[i].rom, jobs[i].entry,
+          i8080_image_open(jobs[i].rom, I8080_IMAGE_BINARY, jobs[i].entry)};
+      rom_count++;
+    }
+
+    job_roms[i] = rom;
+  }
+
+  return rom_count;
+}
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+bool i8080_batch_run(const i8080_job_t* jobs,
+                     const int count,
+                     int threads,
+                     i8080_job_result_t* results,
+                     i8080_batch_stats_t* stats) {
+  *stats = (i8080_batch_stats_t){0, 0, 0.0, 0, 0};
+  if (count <= 0)
+    return true;
+
+  if (threads <= 0)
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads > count)
+    threads = count;
+  if (threads < 1)
+    threads = 1;
+
+  // workers, their memory and queues, then the roms and which job uses which.
+  // the images themselves are mapped by the loader
+  const size_t size = arena_round(threads * sizeof(worker_t)) +
+                      threads * arena_round(I8080_MAX_MEMORY) +
+                      arena_round(count * sizeof(int)) +
+                      arena_round(count * sizeof(rom_t)) +
+                      arena_round(count * sizeof(int));
+
+  arena_t arena = {malloc(size), 0};
+  if (!arena.base)
+    return false;
+
+  worker_t* workers = arena_alloc(&arena, threads * sizeof(worker_t));
+  int* queued = arena_alloc(&arena, count * sizeof(int));
+  rom_t* roms = arena_alloc(&arena, count * sizeof(rom_t));
+  int* job_roms = arena_alloc(&arena, count * sizeof(int));
+
+  const int rom_count = open_roms(jobs, count, roms, job_roms);
+
+  batch_t batch = {jobs, results, roms, job_roms, workers, threads};
+
+  // contiguous shares to start with, stealing evens out uneven jobs
+  for (int i = 0; i < count; i++)
+    queued[i] = i;
+  for (int i = 0; i < threads; i++) {
+    worker_t* worker = &workers[i];
+
+    worker->memory = arena_alloc(&arena, I8080_MAX_MEMORY);
+    worker->queue.jobs = queued;
+    worker->queue.front = (long)count * i / threads;
+    worker->queue.back = (long)count * (i + 1) / threads;
+    pthread_mutex_init(&worker->queue.lock, NULL);
+    worker->started = false;
+    worker->index = i;
+    worker->batch = &batch;
+  }
+
+  const double start = now_seconds();
+
+  // the calling thread is worker 0. if a thread can't be started its jobs are
+  // stolen by the others
+  for (int i = 1; i < threads; i++) {
+    workers[i].started =
+        pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) ==
+        0;
+  }
+  worker_main(&workers[0]);
+  for (int i = 1; i < threads; i++) {
+    if (workers[i].started)
+      pthread_join(workers[i].thread, NULL);
+  }
+
+  *stats = (i8080_batch_stats_t){0, 0, now_seconds() - start, threads, 0};
+  for (int i = 0; i < count; i++) {
+    stats->cycles += results[i].cycles;
+    stats->instructions += results[i].instructions;
+    stats->failed += !results[i].loaded;
+  }
+
+  for (int i = 0; i < threads; i++)
+    pthread_mutex_destroy(&workers[i].queue.lock);
+  for (int i = 0; i < rom_count; i++)
+    i8080_image_close(roms[i].image);
+  free(arena.base);
+
+  return true;
+}
@@ -0,0 +1,156 @@
+#include "i8080/batch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DEFAULT_ENTRY 0x100  // cp/m transient program area
+#define DEFAULT_MAX_CYCLES 100000000000ULL
+
+static void usage(const char* name) {
+  fprintf(stderr,
+          "usage: %s [-j threads] [-v] jobfile\n"
+          "jobfile has one job per line: rom [entry] [max_cycles], entry in\n"
+          "hex (default 100), '#' starts a comment. -v lists every job\n",
+          name);
+}
+
+// reads the whole job file, rom names point into the returned buffer
+static char* read_jobs(const char* file_name,
+                       i8080_job_t** jobs,
+                       int* count) {
+  FILE* file = fopen(file_name, "rb");
+  if (!file)
+    return NULL;
+
+  fseek(file, 0, SEEK_END);
+  const long size = ftell(file);
+  rewind(file);
+
+  char* text = malloc(size + 1);
+  if (!text || fread(text, 1, size, file) != (size_t)size) {
+    free(text);
+    fclose(file);
+    return NULL;
+  }
+  text[size] = '\0';
+  fclose(file);
+
+  int capacity = 0;
+  *jobs = NULL;
+  *count = 0;
+
+  for (char* line = strtok(text, "\n"); line; line = strtok(NULL, "\n")) {
+    char* comment = strchr(line, '#');
+    if (comment)
+      *comment = '\0';
+
+    char rom[1024];
+    unsigned int entry = DEFAULT_ENTRY;
+    unsigned long long max_cycles = DEFAULT_MAX_CYCLES;
+    if (sscanf(line, " %1023s %x %llu", rom, &entry, &max_cycles) < 1)
+      continue;  // blank line
+
+    if (*count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      i8080_job_t* grown = realloc(*jobs, capacity * sizeof(i8080_job_t));
+      if (!grown) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+      }
+      *jobs = grown;
+    }
+
+    // terminate the name in place, it stays valid as long as text
+    char* name = line + strspn(line, " \t");
+    name[strcspn(name, " \t\r")] = '\0';
+
+    (*jobs)[(*count)++] =
+        (i8080_job_t){name, entry & 0xffff, (uint64_t)max_cycles};
+  }
+
+  return text;
+}
+
+// runs a job list across all cpus and prints aggregate throughput as json
+int main(int argc, char** argv) {
+  int threads = 0;
+  bool verbose = false;
+  int option;
+
+  while ((option = getopt(argc, argv, "j:v")) != -1) {
+    switch (option) {
+      case 'j':
+        threads = atoi(optarg);
+        break;
+      case 'v':
+        verbose = true;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if (optind != argc - 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  i8080_job_t* jobs;
+  int count;
+  char* text = read_jobs(argv[optind], &jobs, &count);
+  if (!text) {
+    fprintf(stderr, "Could not read file: %s\n", argv[optind]);
+    return 1;
+  }
+
+  i8080_job_result_t* results = malloc(count * sizeof(i8080_job_result_t));
+  if (!results && count) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+
+  i8080_batch_stats_t stats;
+  if (!i8080_batch_run(jobs, count, threads, results, &stats)) {
+    fprintf(stderr, "Could not set up the batch\n");
+    return 1;
+  }
+
+  int completed = 0;
+  for (int i = 0; i < count; i++)
+    completed += results[i].completed;
+
+  printf("{\n");
+  printf("  \"jobs\": %d, \"threads\": %d, \"completed\": %d, ", count,
+         stats.threads, completed);
+  printf("\"failed\": %d,\n", stats.failed);
+  printf("  \"instructions\": %llu, \"cycles\": %llu, \"seconds\": %.6f,\n",
+         (unsigned long long)stats.instructions,
+         (unsigned long long)stats.cycles, stats.seconds);
+  printf("  \"mips\": %.3f, \"emulated_mhz\": %.3f",
+         stats.instructions / stats.seconds / 1e6,
+         stats.cycles / stats.seconds / 1e6);
+
+  if (verbose) {
+    printf(",\n  \"results\": [\n");
+    for (int i = 0; i < count; i++) {
+      printf("    {\"rom\": \"%s\", \"entry\": %u, \"loaded\": %s, ",
+             jobs[i].rom, jobs[i].entry, results[i].loaded ? "true" : "false");
+      printf("\"completed\": %s, \"pc\": %u, ",
+             results[i].completed ? "true" : "false", results[i].pc);
+      printf("\"instructions\": %llu, \"cycles\": %llu}%s\n",
+             (unsigned long long)results[i].instructions,
+             (unsigned long long)results[i].cycles,
+             i + 1 < count ? "," : "");
+    }
+    printf("  ]");
+  }
+  printf("\n}\n");
+
+  free(results);
+  free(jobs);
+  free(text);
+
+  return stats.failed ? 1 : 0;
+}
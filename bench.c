@@ -0,0 +1,237 @@
+#include "i8080/i8080.h"
+#include "i8080/lockstep.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef BENCH_CFLAGS
+#define BENCH_CFLAGS ""
+#endif
+
+#define BENCH_MAX_CYCLES \
+  100000000000ULL  // safety net, 8080EXM.COM needs ~2.4e10 cycles
+
+#define I8080_CLOCK_HZ 2000000.0  // real 8080 at 2 MHz
+
+#define BENCH_MAX_FUSIONS 16  // superinstructions reported per rom
+
+#define BENCH_LOCKSTEP_ROM "tests/CPUTEST.COM"  // same rom in every lane
+
+static const char* const ROMS[] = {"tests/TST8080.COM", "tests/CPUTEST.COM",
+                                   "tests/8080PRE.COM", "tests/8080EXM.COM"};
+
+typedef struct {
+  uint64_t instructions;
+  uint64_t cycles;
+  double seconds;
+  bool completed;  // rom jumped back to 0x0000
+  uint64_t fusions[BENCH_MAX_FUSIONS];  // runs of each superinstruction
+} bench_result_t;
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// loads a rom at 0x100 with the same setup as run_tests, bdos call at 5 just
+// returns so nothing is printed
+static void load_testrom(i8080_t* state, const char* file_name) {
+  FILE* file = fopen(file_name, "rb");
+  if (!file) {
+    fprintf(stderr, "Could not read file: %s\n", file_name);
+    exit(1);
+  }
+
+  uint8_t* memory = state->external_memory;
+  i8080_jit_disable(state);
+  i8080_block_cache_disable(state);
+  init_i8080(state);  // fresh registers and cycle count for every run
+  i8080_attach_memory(state, memory);
+
+  memset(memory, 0, I8080_MAX_MEMORY);
+  fread(&memory[0x100], 1, I8080_MAX_MEMORY - 0x100, file);
+  fclose(file);
+
+  state->external_memory[368] = 0x7;
+  state->external_memory[5] = 0xc9;
+  state->pc = 0x100;
+
+  // no-ops unless built with I8080_JIT or I8080_BLOCK_CACHE
+  i8080_jit_enable(state);
+  i8080_block_cache_enable(state);
+}
+
+static bench_result_t bench_testrom(i8080_t* state,
+                                    const char* file_name,
+                                    const int iterations) {
+  bench_result_t total = {0, 0, 0.0, true, {0}};
+
+  for (int i = 0; i < iterations; i++) {
+    load_testrom(state, file_name);
+
+    const double start = now_seconds();
+    const i8080_run_result_t run =
+        i8080_run_until(state, 0x0000, BENCH_MAX_CYCLES);
+    total.seconds += now_seconds() - start;
+
+    total.instructions += run.instructions;
+    total.cycles += run.cycles;
+    total.completed = total.completed && state->pc == 0x0000;
+
+    uint64_t executed;
+    for (int j = 0; j < BENCH_MAX_FUSIONS &&
+                    i8080_block_cache_fusion(state, j, &executed);
+         j++)
+      total.fusions[j] += executed;
+  }
+
+  return total;
+}
+
+static void print_result(const i8080_t* state,
+                         const char* name,
+                         const bench_result_t* result) {
+  const double ips = result->instructions / result->seconds;
+  const double cps = result->cycles / result->seconds;
+
+  printf("    {\"name\": \"%s\", \"completed\": %s, ", name,
+         result->completed ? "true" : "false");
+  printf("\"instructions\": %llu, \"cycles\": %llu, \"seconds\": %.6f, ",
+         (unsigned long long)result->instructions,
+         (unsigned long long)result->cycles, result->seconds);
+  printf("\"instructions_per_sec\": %.0f, \"cycles_per_sec\": %.0f, ", ips,
+         cps);
+  printf("\"mips\": %.3f, \"emulated_mhz\": %.3f, ", ips / 1e6, cps / 1e6);
+  printf("\"ns_per_instruction\": %.3f, \"ratio_to_2mhz\": %.3f, ",
+         1e9 / ips, cps / I8080_CLOCK_HZ);
+
+  // hit rate is the share of instructions that ran inside the superinstruction
+  printf("\"fusions\": [");
+  uint64_t executed;
+  for (int i = 0; i < BENCH_MAX_FUSIONS; i++) {
+    const char* pair = i8080_block_cache_fusion(state, i, &executed);
+    if (!pair)
+      break;
+
+    printf("%s{\"pair\": \"%s\", \"executed\": %llu, \"hit_rate\": %.4f}",
+           i ? ", " : "", pair, (unsigned long long)result->fusions[i],
+           2.0 * result->fusions[i] / result->instructions);
+  }
+  printf("]}");
+}
+
+// runs a copy of a rom in every lane of the lockstep engine for as many steps
+// as one copy took on its own
+static void bench_lockstep(const char* file_name, const uint64_t steps) {
+  static i8080_t machines[I8080_LANES];
+  i8080_t* lanes[I8080_LANES];
+
+  for (int i = 0; i < I8080_LANES; i++) {
+    init_i8080(&machines[i]);
+    i8080_attach_memory(&machines[i], malloc(I8080_MAX_MEMORY));
+    load_testrom(&machines[i], file_name);
+    i8080_jit_disable(&machines[i]);  // lockstep lanes only use i8080_step
+    i8080_block_cache_disable(&machines[i]);
+    lanes[i] = &machines[i];
+  }
+
+  i8080_lockstep_t lockstep;
+  i8080_lockstep_init(&lockstep, lanes, I8080_LANES);
+
+  const double start = now_seconds();
+  i8080_lockstep_run(&lockstep, steps);
+  const double seconds = now_seconds() - start;
+
+  const uint64_t instructions =
+      lockstep.vector_instructions + lockstep.scalar_instructions;
+  printf("  \"lockstep\": {\"name\": \"%s\", \"lanes\": %d, ", file_name,
+         I8080_LANES);
+  printf("\"instructions\": %llu, \"seconds\": %.6f, \"mips\": %.3f, ",
+         (unsigned long long)instructions, seconds,
+         instructions / seconds / 1e6);
+  printf("\"vector_share\": %.4f, \"average_width\": %.2f},\n",
+         (double)lockstep.vector_instructions / instructions,
+         lockstep.vector_steps
+             ? (double)lockstep.vector_instructions / lockstep.vector_steps
+             : 0.0);
+
+  for (int i = 0; i < I8080_LANES; i++)
+    free(machines[i].external_memory);
+}
+
+// runs every test rom in tests/ with console output suppressed and prints
+// throughput as json. usage: bench [iterations]
+int main(int argc, char** argv) {
+  const int iterations = argc > 1 ? atoi(argv[1]) : 1;
+  if (iterations < 1) {
+    fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+    return 1;
+  }
+
+  i8080_t state;
+  init_i8080(&state);
+  i8080_attach_memory(&state, malloc(I8080_MAX_MEMORY));
+
+  bench_result_t total = {0, 0, 0.0, true, {0}};
+  uint64_t lockstep_steps = 0;
+
+  printf("{\n");
+#ifdef I8080_DISPATCH_TABLE
+  printf("  \"dispatch\": \"table\",\n");
+#else
+  printf("  \"dispatch\": \"switch\",\n");
+#endif
+#ifdef I8080_LAZY_FLAGS
+  printf("  \"flag_eval\": \"lazy\",\n");
+#else
+  printf("  \"flag_eval\": \"eager\",\n");
+#endif
+#ifdef I8080_JIT
+  printf("  \"jit\": true,\n");
+#else
+  printf("  \"jit\": false,\n");
+#endif
+#ifdef I8080_BLOCK_CACHE
+  printf("  \"block_cache\": true,\n");
+#else
+  printf("  \"block_cache\": false,\n");
+#endif
+  printf("  \"compiler\": \"%s\",\n", __VERSION__);
+  printf("  \"cflags\": \"%s\",\n", BENCH_CFLAGS);
+  printf("  \"iterations\": %d,\n", iterations);
+  printf("  \"roms\": [\n");
+
+  const int rom_count = sizeof(ROMS) / sizeof(ROMS[0]);
+  for (int i = 0; i < rom_count; i++) {
+    const bench_result_t result = bench_testrom(&state, ROMS[i], iterations);
+
+    total.instructions += result.instructions;
+    total.cycles += result.cycles;
+    total.seconds += result.seconds;
+    total.completed = total.completed && result.completed;
+    for (int j = 0; j < BENCH_MAX_FUSIONS; j++)
+      total.fusions[j] += result.fusions[j];
+
+    if (strcmp(ROMS[i], BENCH_LOCKSTEP_ROM) == 0)
+      lockstep_steps = result.instructions / iterations;
+
+    print_result(&state, ROMS[i], &result);
+    printf(i + 1 < rom_count ? ",\n" : "\n");
+  }
+
+  printf("  ],\n");
+  bench_lockstep(BENCH_LOCKSTEP_ROM, lockstep_steps);
+  printf("  \"total\":\n");
+  print_result(&state, "total", &total);
+  printf("\n}\n");
+
+  i8080_jit_disable(&state);
+  i8080_block_cache_disable(&state);
+  free(state.external_memory);
+
+  return total.completed ? 0 : 1;
+}
@@ -0,0 +1,762 @@
+#include "i8080/cpm.h"
+
+#include <ctype.h>
+#include <limits.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#define RECORD_SIZE 128     // cp/m reads and writes files in records
+#define EXTENT_RECORDS 128  // records per extent (16 KiB)
+#define EOF_BYTE 0x1a       // ^Z, pads the last record of text files
+
+// bios jump table entries, in order
+enum {
+  BIOS_BOOT,
+  BIOS_WBOOT,
+  BIOS_CONST,
+  BIOS_CONIN,
+  BIOS_CONOUT,
+  BIOS_LIST,
+  BIOS_PUNCH,
+  BIOS_READER,
+  BIOS_HOME,
+  BIOS_SELDSK,
+  BIOS_SETTRK,
+  BIOS_SETSEC,
+  BIOS_SETDMA,
+  BIOS_READ,
+  BIOS_WRITE,
+  BIOS_LISTST,
+  BIOS_SECTRAN,
+  BIOS_ENTRIES
+};
+
+// fcb fields
+#define FCB_NAME 1
+#define FCB_EX 12  // extent, low 5 bits of the record number / 128
+#define FCB_S2 14  // module, extent / 32
+#define FCB_RC 15  // records used in the current extent
+#define FCB_D0 16  // first byte of the allocation map, holds our file slot
+#define FCB_CR 32  // current record within the extent
+#define FCB_R0 33  // random record number, r0 to r2
+
+// the bytes of a result are returned in a and l, words in hl, b and h mirror
+// a and l as with the real bdos
+static void set_result(i8080_t* state, const uint16_t value) {
+  state->l = state->a = value & 0xff;
+  state->h = state->b = value >> 8;
+}
+
+static uint16_t de(const i8080_t* state) {
+  return (state->d << 8) | state->e;
+}
+
+void i8080_cpm_flush(i8080_cpm_t* cpm) {
+  if (cpm->buffered) {
+    fwrite(cpm->buffer, 1, cpm->buffered, cpm->output);
+    fflush(cpm->output);
+    cpm->buffered = 0;
+  }
+}
+
+static void console_out(i8080_cpm_t* cpm, const uint8_t byte) {
+  if (cpm->buffered == I8080_CPM_BUFFER)
+    i8080_cpm_flush(cpm);
+  cpm->buffer[cpm->buffered++] = byte;
+}
+
+// whether console_in would return right away, end of input counts as ready
+static bool console_ready(i8080_cpm_t* cpm) {
+  struct pollfd fd = {fileno(cpm->input), POLLIN, 0};
+
+  return poll(&fd, 1, 0) > 0;
+}
+
+// the host terminal echoes, the program's prompt goes out first
+static uint8_t console_in(i8080_cpm_t* cpm) {
+  i8080_cpm_flush(cpm);
+
+  const int c = getc(cpm->input);
+  if (c == EOF)
+    return EOF_BYTE;
+
+  return c == '\n' ? '\r' : c;
+}
+
+// reads a line into the buffer at address: size, length, then the characters
+static void read_line(i8080_cpm_t* cpm, const uint16_t address) {
+  i8080_t* state = cpm->state;
+  const uint8_t size = i8080_read_byte(state, address);
+  uint8_t length = 0;
+
+  i8080_cpm_flush(cpm);
+  while (length < size) {
+    const int c = getc(cpm->input);
+    if (c == EOF || c == '\n')
+      break;
+    if (c != '\r')
+      i8080_write_byte(state, address + 2 + length++, c);
+  }
+
+  i8080_write_byte(state, address + 1, length);
+}
+
+// the program is done, the run returns after the trap
+static void exit_program(i8080_cpm_t* cpm) {
+  cpm->exited = true;
+  i8080_stop(cpm->state);
+}
+
+// 8.3 file name as laid out in an fcb, upper case and padded with spaces.
+// false for names that don't fit
+static bool fcb_from_host(const char* host, uint8_t* name) {
+  const char* dot = strchr(host, '.');
+  const size_t length = dot ? (size_t)(dot - host) : strlen(host);
+  const char* extension = dot ? dot + 1 : "";
+
+  if (!length || length > 8 || strlen(extension) > 3 || strchr(extension, '.'))
+    return false;
+
+  memset(name, ' ', 11);
+  for (size_t i = 0; i < length; i++)
+    name[i] = toupper((unsigned char)host[i]);
+  for (size_t i = 0; extension[i]; i++)
+    name[8 + i] = toupper((unsigned char)extension[i]);
+
+  return true;
+}
+
+static void fcb_name(i8080_t* state, const uint16_t fcb, uint8_t* name) {
+  for (int i = 0; i < 11; i++)
+    name[i] = toupper(i8080_read_byte(state, fcb + FCB_NAME + i) & 0x7f);
+}
+
+static bool name_matches(const uint8_t* pattern, const uint8_t* name) {
+  for (int i = 0; i < 11; i++) {
+    if (pattern[i] != '?' && pattern[i] != name[i])
+      return false;
+  }
+
+  return true;
+}
+
+// host path of a file in the directory, lower case for new files
+static void host_path(const i8080_cpm_t* cpm,
+                      const uint8_t* name,
+                      char* path) {
+  char host[13];
+  int length = 0;
+
+  for (int i = 0; i < 11; i++) {
+    if (i == 8 && name[8] != ' ')
+      host[length++] = '.';
+    if (name[i] != ' ')
+      host[length++] = tolower(name[i]);
+  }
+  host[length] = '\0';
+
+  snprintf(path, PATH_MAX, "%s/%s", cpm->directory, host);
+}
+
+// host file matching pattern, starting after the entries dir already read.
+// false once there are none left
+static bool next_match(i8080_cpm_t* cpm,
+                       DIR* dir,
+                       const uint8_t* pattern,
+                       uint8_t* name,
+                       char* path) {
+  struct dirent* entry;
+
+  while ((entry = readdir(dir))) {
+    if (fcb_from_host(entry->d_name, name) && name_matches(pattern, name)) {
+      snprintf(path, PATH_MAX, "%s/%s", cpm->directory, entry->d_name);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// the existing file of an fcb name, whatever its case on the host
+static bool find_file(i8080_cpm_t* cpm, const uint8_t* name, char* path) {
+  DIR* dir = opendir(cpm->directory);
+  if (!dir)
+    return false;
+
+  uint8_t found[11];
+  const bool ok = next_match(cpm, dir, name, found, path);
+  closedir(dir);
+
+  return ok;
+}
+
+static long file_records(FILE* file) {
+  const long position = ftell(file);
+
+  fseek(file, 0, SEEK_END);
+  const long size = ftell(file);
+  fseek(file, position, SEEK_SET);
+
+  return (size + RECORD_SIZE - 1) / RECORD_SIZE;
+}
+
+static uint32_t fcb_record(i8080_t* state, const uint16_t fcb) {
+  const uint32_t extent = (i8080_read_byte(state, fcb + FCB_S2) & 0x3f) * 32 +
+                          (i8080_read_byte(state, fcb + FCB_EX) & 0x1f);
+
+  return extent * EXTENT_RECORDS + i8080_read_byte(state, fcb + FCB_CR);
+}
+
+// moves the sequential position to record, rc follows the file's size
+static void fcb_set_record(i8080_t* state,
+                           const uint16_t fcb,
+                           FILE* file,
+                           const uint32_t record) {
+  const uint32_t extent = record / EXTENT_RECORDS;
+  long left = file_records(file) - (long)extent * EXTENT_RECORDS;
+  left = left < 0 ? 0 : left > EXTENT_RECORDS ? EXTENT_RECORDS : left;
+
+  i8080_write_byte(state, fcb + FCB_CR, record % EXTENT_RECORDS);
+  i8080_write_byte(state, fcb + FCB_EX, extent % 32);
+  i8080_write_byte(state, fcb + FCB_S2, extent / 32);
+  i8080_write_byte(state, fcb + FCB_RC, left);
+}
+
+static uint32_t fcb_random(i8080_t* state, const uint16_t fcb) {
+  return i8080_read_byte(state, fcb + FCB_R0) |
+         i8080_read_byte(state, fcb + FCB_R0 + 1) << 8 |
+         i8080_read_byte(state, fcb + FCB_R0 + 2) << 16;
+}
+
+static void fcb_set_random(i8080_t* state,
+                           const uint16_t fcb,
+                           const uint32_t record) {
+  for (int i = 0; i < 3; i++)
+    i8080_write_byte(state, fcb + FCB_R0 + i, record >> (i * 8));
+}
+
+// keeps an opened host file in a free slot, whose number goes into the fcb's
+// allocation map. cp/m leaves that to the bdos, programs don't touch it
+static FILE* keep_file(i8080_cpm_t* cpm,
+                       const uint16_t fcb,
+                       const uint8_t* name,
+                       FILE* file) {
+  int slot = 0;
+  while (slot < I8080_CPM_MAX_FILES && cpm->files[slot].file)
+    slot++;
+
+  if (slot == I8080_CPM_MAX_FILES) {
+    fclose(file);
+    return NULL;
+  }
+
+  cpm->files[slot].file = file;
+  memcpy(cpm->files[slot].name, name, 11);
+  i8080_write_byte(cpm->state, fcb + FCB_D0, slot + 1);
+
+  return file;
+}
+
+// slot of the file opened with fcb, -1 if it isn't open
+static int fcb_slot(i8080_cpm_t* cpm, const uint16_t fcb) {
+  const int slot = i8080_read_byte(cpm->state, fcb + FCB_D0) - 1;
+  uint8_t name[11];
+
+  fcb_name(cpm->state, fcb, name);
+  if (slot < 0 || slot >= I8080_CPM_MAX_FILES || !cpm->files[slot].file ||
+      memcmp(cpm->files[slot].name, name, 11) != 0)
+    return -1;
+
+  return slot;
+}
+
+// host file of an opened fcb. one the program closed already is opened again,
+// some programs read files they never opened through a copied fcb
+static FILE* fcb_file(i8080_cpm_t* cpm, const uint16_t fcb) {
+  const int slot = fcb_slot(cpm, fcb);
+  if (slot >= 0)
+    return cpm->files[slot].file;
+
+  uint8_t name[11];
+  char path[PATH_MAX];
+  fcb_name(cpm->state, fcb, name);
+  if (!find_file(cpm, name, path))
+    return NULL;
+
+  FILE* file = fopen(path, "r+b");
+  if (!file)
+    file = fopen(path, "rb");
+
+  return file ? keep_file(cpm, fcb, name, file) : NULL;
+}
+
+static void close_slot(i8080_cpm_t* cpm, const int slot) {
+  fclose(cpm->files[slot].file);
+  cpm->files[slot].file = NULL;
+}
+
+// directory entry of name at the dma address, for search first / next
+static void directory_entry(i8080_cpm_t* cpm,
+                            const uint8_t* name,
+                            const char* path) {
+  i8080_t* state = cpm->state;
+  long records = 0;
+
+  FILE* file = fopen(path, "rb");
+  if (file) {
+    records = file_records(file);
+    fclose(file);
+  }
+
+  // a single entry, the rest of the record is unused (0xe5)
+  for (int i = 0; i < RECORD_SIZE; i++)
+    i8080_write_byte(state, cpm->dma + i, i < 32 ? 0 : 0xe5);
+  i8080_write_byte(state, cpm->dma, cpm->user);
+  for (int i = 0; i < 11; i++)
+    i8080_write_byte(state, cpm->dma + FCB_NAME + i, name[i]);
+  i8080_write_byte(state, cpm->dma + FCB_RC,
+                   records > EXTENT_RECORDS ? EXTENT_RECORDS : records);
+}
+
+static uint8_t search_next(i8080_cpm_t* cpm) {
+  uint8_t name[11];
+  char path[PATH_MAX];
+
+  if (!cpm->search)
+    return 0xff;
+
+  if (!next_match(cpm, cpm->search, cpm->search_pattern, name, path)) {
+    closedir(cpm->search);
+    cpm->search = NULL;
+    return 0xff;
+  }
+
+  directory_entry(cpm, name, path);
+
+  return 0;
+}
+
+static uint8_t search_first(i8080_cpm_t* cpm, const uint16_t fcb) {
+  if (cpm->search)
+    closedir(cpm->search);
+
+  fcb_name(cpm->state, fcb, cpm->search_pattern);
+  if (i8080_read_byte(cpm->state, fcb) == '?')
+    memset(cpm->search_pattern, '?', 11);  // every entry
+  cpm->search = opendir(cpm->directory);
+
+  return search_next(cpm);
+}
+
+static uint8_t open_file(i8080_cpm_t* cpm, const uint16_t fcb) {
+  i8080_t* state = cpm->state;
+
+  const int slot = fcb_slot(cpm, fcb);
+  if (slot >= 0)
+    close_slot(cpm, slot);  // opened again, starts over
+
+  i8080_write_byte(state, fcb + FCB_D0, 0);
+  FILE* file = fcb_file(cpm, fcb);
+  if (!file)
+    return 0xff;
+
+  i8080_write_byte(state, fcb + FCB_S2, 0);
+  fcb_set_record(state, fcb, file,
+                 (i8080_read_byte(state, fcb + FCB_EX) & 0x1f) *
+                     EXTENT_RECORDS);
+
+  return 0;
+}
+
+static uint8_t close_file(i8080_cpm_t* cpm, const uint16_t fcb) {
+  const int slot = fcb_slot(cpm, fcb);
+
+  if (slot >= 0)
+    close_slot(cpm, slot);
+
+  return 0;
+}
+
+static uint8_t make_file(i8080_cpm_t* cpm, const uint16_t fcb) {
+  i8080_t* state = cpm->state;
+  uint8_t name[11];
+  char path[PATH_MAX];
+
+  fcb_name(state, fcb, name);
+  if (!find_file(cpm, name, path))
+    host_path(cpm, name, path);
+
+  FILE* file = fopen(path, "w+b");
+  if (!file || !keep_file(cpm, fcb, name, file))
+    return 0xff;
+
+  i8080_write_byte(state, fcb + FCB_S2, 0);
+  i8080_write_byte(state, fcb + FCB_RC, 0);
+
+  return 0;
+}
+
+static uint8_t delete_files(i8080_cpm_t* cpm, const uint16_t fcb) {
+  uint8_t pattern[11], name[11];
+  char path[PATH_MAX];
+  uint8_t result = 0xff;
+
+  DIR* dir = opendir(cpm->directory);
+  if (!dir)
+    return 0xff;
+
+  fcb_name(cpm->state, fcb, pattern);
+  while (next_match(cpm, dir, pattern, name, path)) {
+    for (int i = 0; i < I8080_CPM_MAX_FILES; i++) {
+      if (cpm->files[i].file && memcmp(cpm->files[i].name, name, 11) == 0)
+        close_slot(cpm, i);
+    }
+    if (unlink(path) == 0)
+      result = 0;
+  }
+  closedir(dir);
+
+  return result;
+}
+
+// the new name is in the second half of the fcb
+static uint8_t rename_file(i8080_cpm_t* cpm, const uint16_t fcb) {
+  uint8_t name[11];
+  char from[PATH_MAX], to[PATH_MAX];
+
+  fcb_name(cpm->state, fcb, name);
+  if (!find_file(cpm, name, from))
+    return 0xff;
+
+  fcb_name(cpm->state, fcb + 16, name);
+  host_path(cpm, name, to);
+
+  return rename(from, to) == 0 ? 0 : 0xff;
+}
+
+// reads record at the dma address, padded with ^Z past the end of the file
+static uint8_t read_record(i8080_cpm_t* cpm,
+                           FILE* file,
+                           const uint32_t record) {
+  uint8_t bytes[RECORD_SIZE];
+
+  if (fseek(file, (long)record * RECORD_SIZE, SEEK_SET) != 0)
+    return 1;
+
+  const size_t count = fread(bytes, 1, RECORD_SIZE, file);
+  if (!count)
+    return 1;  // end of file
+  memset(&bytes[count], EOF_BYTE, RECORD_SIZE - count);
+
+  for (int i = 0; i < RECORD_SIZE; i++)
+    i8080_write_byte(cpm->state, cpm->dma + i, bytes[i]);
+
+  return 0;
+}
+
+// writes the record at the dma address, a gap before it reads back as zeros
+static uint8_t write_record(i8080_cpm_t* cpm,
+                            FILE* file,
+                            const uint32_t record) {
+  uint8_t bytes[RECORD_SIZE];
+
+  for (int i = 0; i < RECORD_SIZE; i++)
+    bytes[i] = i8080_read_byte(cpm->state, cpm->dma + i);
+
+  if (fseek(file, (long)record * RECORD_SIZE, SEEK_SET) != 0 ||
+      fwrite(bytes, 1, RECORD_SIZE, file) != RECORD_SIZE)
+    return 2;  // disk full
+
+  return 0;
+}
+
+// sequential access reads or writes the current record and moves past it
+static uint8_t sequential(i8080_cpm_t* cpm, const uint16_t fcb, bool write) {
+  FILE* file = fcb_file(cpm, fcb);
+  if (!file)
+    return write ? 2 : 1;
+
+  const uint32_t record = fcb_record(cpm->state, fcb);
+  const uint8_t result = write ? write_record(cpm, file, record)
+                               : read_record(cpm, file, record);
+  if (!result)
+    fcb_set_record(cpm->state, fcb, file, record + 1);
+
+  return result;
+}
+
+// random access goes to the r0-r2 record, which becomes the current record
+static uint8_t random_access(i8080_cpm_t* cpm, const uint16_t fcb, bool write) {
+  const uint32_t record = fcb_random(cpm->state, fcb);
+  if (record > 0xffff)
+    return 6;  // past the largest file
+
+  FILE* file = fcb_file(cpm, fcb);
+  if (!file)
+    return write ? 2 : 1;
+
+  const uint8_t result = write ? write_record(cpm, file, record)
+                               : read_record(cpm, file, record);
+  fcb_set_record(cpm->state, fcb, file, record);
+
+  return result;
+}
+
+static void file_size(i8080_cpm_t* cpm, const uint16_t fcb) {
+  FILE* file = fcb_file(cpm, fcb);
+
+  fcb_set_random(cpm->state, fcb, file ? file_records(file) : 0);
+}
+
+static void bdos(i8080_cpm_t* cpm) {
+  i8080_t* state = cpm->state;
+  const uint16_t fcb = de(state);
+
+  switch (state->c) {
+    case 0:  // system reset
+      exit_program(cpm);
+      break;
+    case 1:  // console input
+      set_result(state, console_in(cpm));
+      break;
+    case 2:  // console output
+      console_out(cpm, state->e);
+      break;
+    case 3:  // reader input
+      set_result(state, EOF_BYTE);
+      break;
+    case 4:  // punch and list output go nowhere
+    case 5:
+      break;
+    case 6:  // direct console i/o
+      if (state->e == 0xff)
+        set_result(state, console_ready(cpm) ? console_in(cpm) : 0);
+      else if (state->e == 0xfe)
+        set_result(state, console_ready(cpm) ? 0xff : 0);
+      else
+        console_out(cpm, state->e);
+      break;
+    case 7:  // get iobyte
+      set_result(state, i8080_read_byte(state, 3));
+      break;
+    case 8:  // set iobyte
+      i8080_write_byte(state, 3, state->e);
+      break;
+    case 9:  // print string up to '$'
+      for (uint16_t i = de(state), n = 0; n < UINT16_MAX; i++, n++) {
+        const uint8_t byte = i8080_read_byte(state, i);
+        if (byte == '$')
+          break;
+        console_out(cpm, byte);
+      }
+      break;
+    case 10:  // read console buffer
+      read_line(cpm, de(state));
+      break;
+    case 11:  // console status
+      set_result(state, console_ready(cpm) ? 0xff : 0);
+      break;
+    case 12:  // version, cp/m 2.2
+      set_result(state, 0x0022);
+      break;
+    case 13:  // reset disk system
+      cpm->dma = I8080_CPM_DMA;
+      cpm->drive = 0;
+      set_result(state, 0);
+      break;
+    case 14:  // select disk
+      cpm->drive = state->e & 0x0f;
+      set_result(state, 0);
+      break;
+    case 15:
+      set_result(state, open_file(cpm, fcb));
+      break;
+    case 16:
+      set_result(state, close_file(cpm, fcb));
+      break;
+    case 17:
+      set_result(state, search_first(cpm, fcb));
+      break;
+    case 18:
+      set_result(state, search_next(cpm));
+      break;
+    case 19:
+      set_result(state, delete_files(cpm, fcb));
+      break;
+    case 20:
+      set_result(state, sequential(cpm, fcb, false));
+      break;
+    case 21:
+      set_result(state, sequential(cpm, fcb, true));
+      break;
+    case 22:
+      set_result(state, make_file(cpm, fcb));
+      break;
+    case 23:
+      set_result(state, rename_file(cpm, fcb));
+      break;
+    case 24:  // login vector, every drive is the same directory
+      set_result(state, 1 << cpm->drive);
+      break;
+    case 25:  // current disk
+      set_result(state, cpm->drive);
+      break;
+    case 26:  // set dma address
+      cpm->dma = de(state);
+      break;
+    case 32:  // get / set user code
+      if (state->e == 0xff)
+        set_result(state, cpm->user);
+      else
+        cpm->user = state->e & 0x0f;
+      break;
+    case 33:
+      set_result(state, random_access(cpm, fcb, false));
+      break;
+    case 34:  // write random, with zero fill
+    case 40:
+      set_result(state, random_access(cpm, fcb, true));
+      break;
+    case 35:
+      file_size(cpm, fcb);
+      break;
+    case 36:  // set random record
+      fcb_set_random(state, fcb, fcb_record(state, fcb));
+      break;
+    default:  // allocation, protection and attributes, no disk behind them
+      set_result(state, 0);
+      break;
+  }
+}
+
+static void bios(i8080_cpm_t* cpm, const int entry) {
+  i8080_t* state = cpm->state;
+
+  switch (entry) {
+    case BIOS_BOOT:
+    case BIOS_WBOOT:
+      exit_program(cpm);
+      break;
+    case BIOS_CONST:
+      state->a = console_ready(cpm) ? 0xff : 0;
+      break;
+    case BIOS_CONIN:
+      state->a = console_in(cpm) & 0x7f;
+      break;
+    case BIOS_CONOUT:
+      console_out(cpm, state->c);
+      break;
+    case BIOS_READER:
+      state->a = EOF_BYTE;
+      break;
+    case BIOS_SELDSK:  // no disk parameter header, sectors aren't emulated
+      state->h = state->l = 0;
+      break;
+    case BIOS_READ:
+    case BIOS_WRITE:
+      state->a = 1;
+      break;
+    case BIOS_LISTST:
+      state->a = 0xff;
+      break;
+    case BIOS_SECTRAN:
+      state->h = state->b;
+      state->l = state->c;
+      break;
+  }
+}
+
+// OUT I8080_CPM_PORT, pc is still at the instruction. outs anywhere else are
+// the program's own and go nowhere
+static void trap(void* context, const uint8_t port, const uint8_t byte) {
+  i8080_cpm_t* cpm = context;
+  const uint16_t pc = cpm->state->pc;
+  (void)port;
+  (void)byte;
+
+  if (pc == I8080_CPM_BDOS)
+    bdos(cpm);
+  else if (pc >= I8080_CPM_BIOS && pc < I8080_CPM_BIOS + BIOS_ENTRIES * 3 &&
+           (pc - I8080_CPM_BIOS) % 3 == 0)
+    bios(cpm, (pc - I8080_CPM_BIOS) / 3);
+}
+
+// OUT I8080_CPM_PORT; RET
+static void write_entry(i8080_t* state, const uint16_t address) {
+  i8080_write_byte(state, address, 0xd3);
+  i8080_write_byte(state, address + 1, I8080_CPM_PORT);
+  i8080_write_byte(state, address + 2, 0xc9);
+}
+
+// JMP address
+static void write_jump(i8080_t* state,
+                       const uint16_t at,
+                       const uint16_t address) {
+  i8080_write_byte(state, at, 0xc3);
+  i8080_write_byte(state, at + 1, address & 0xff);
+  i8080_write_byte(state, at + 2, address >> 8);
+}
+
+void i8080_cpm_init(i8080_cpm_t* cpm,
+                    i8080_t* state,
+                    const char* directory,
+                    FILE* input,
+                    FILE* output) {
+  memset(cpm, 0, sizeof(*cpm));
+  cpm->state = state;
+  cpm->directory = directory;
+  cpm->input = input;
+  cpm->output = output;
+  cpm->dma = I8080_CPM_DMA;
+
+  // console_ready polls the descriptor, bytes buffered in input would be
+  // missed by it
+  setvbuf(input, NULL, _IONBF, 0);
+
+  i8080_map_port(state, I8080_CPM_PORT,
+                 (i8080_port_handler_t){NULL, trap, cpm});
+
+  write_jump(state, 0x0000, I8080_CPM_BIOS + BIOS_WBOOT * 3);
+  i8080_write_byte(state, 0x0003, 0);  // iobyte
+  i8080_write_byte(state, 0x0004, 0);  // drive a, user 0
+  write_jump(state, 0x0005, I8080_CPM_BDOS);
+
+  write_entry(state, I8080_CPM_BDOS);
+  for (int i = 0; i < BIOS_ENTRIES; i++)
+    write_entry(state, I8080_CPM_BIOS + i * 3);
+
+  // default fcbs with blank names, empty command tail
+  for (int i = 0; i < 2; i++) {
+    i8080_write_byte(state, 0x5c + i * 16, 0);
+    for (int j = 0; j < 11; j++)
+      i8080_write_byte(state, 0x5c + i * 16 + FCB_NAME + j, ' ');
+  }
+  i8080_write_byte(state, I8080_CPM_DMA, 0);
+  i8080_write_byte(state, I8080_CPM_DMA + 1, 0);
+
+  state->sp = I8080_CPM_BDOS - 2;
+  i8080_write_byte(state, state->sp, 0);
+  i8080_write_byte(state, state->sp + 1, 0);
+}
+
+void i8080_cpm_close(i8080_cpm_t* cpm) {
+  i8080_cpm_flush(cpm);
+
+  for (int i = 0; i < I8080_CPM_MAX_FILES; i++) {
+    if (cpm->files[i].file)
+      close_slot(cpm, i);
+  }
+  if (cpm->search) {
+    closedir(cpm->search);
+    cpm->search = NULL;
+  }
+}
+
+i8080_run_result_t i8080_cpm_run(i8080_cpm_t* cpm, const uint64_t max_cycles) {
+  const i8080_run_result_t run = i8080_run(cpm->state, max_cycles);
+
+  i8080_cpm_flush(cpm);
+
+  return run;
+}
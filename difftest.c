@@ -0,0 +1,565 @@
+#include "i8080/i8080.h"
+#include "i8080/lockstep.h"
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// the reference engine: i8080.c built plain (switch dispatch, eager flags, no
+// jit or block cache) with its symbols renamed, see the makefile. i8080_t is
+// laid out the same whatever the engine, so both run on it
+void ref_init_i8080(i8080_t* state);
+void ref_i8080_step(i8080_t* state);
+bool ref_i8080_alloc_memory(i8080_t* state);
+void ref_i8080_free_memory(i8080_t* state);
+bool ref_i8080_check_hooks(i8080_t* state, i8080_check_hooks_t* hooks);
+
+#define PROGRAMS 2000
+#define PROGRAM_INSTRUCTIONS 20000  // per random program
+#define LOCKSTEP_CHECK 32  // steps of the lockstep engine between checks
+#define RUN_CYCLES 1000000  // per candidate run, blocks are checked as they end
+// per candidate run without blocks, at most HISTORY instructions. runs return
+// with cb written, single steps would never leave lazy flags pending
+#define WINDOW_CYCLES 64
+#define BDOS_ENTRY 0xfe00       // of the roms
+#define HISTORY 16               // reference instructions shown at divergence
+#define MEMORY_REPORT 8          // differing writes or bytes shown
+
+static const char* const ROMS[] = {"tests/TST8080.COM", "tests/CPUTEST.COM",
+                                   "tests/8080PRE.COM", "tests/8080EXM.COM"};
+
+typedef struct {
+  uint16_t pc;
+  uint8_t bytes[3];
+} history_entry_t;
+
+typedef struct {
+  i8080_t ref;   // stepped one instruction at a time by i8080_step
+  i8080_t cand;  // the engine this was built with, run check_cycles at a time
+  i8080_check_hooks_t hooks;  // checks the candidate as it leaves blocks
+  i8080_check_hooks_t ref_hooks;  // the reference's writes
+  uint64_t check_cycles;
+  uint64_t max_instructions;
+  bool console;  // bdos output of the roms
+
+  const char* name;  // of the rom or program being run
+  bool diverged;
+
+  history_entry_t history[HISTORY];  // ring of the last reference instructions
+  uint64_t history_count;
+  uint64_t checked;  // instructions at the last check that matched
+} difftest_t;
+
+static difftest_t difftest;
+static difftest_t lanes[I8080_LANES];  // of the lockstep engine
+
+static void usage(const char* name) {
+  fprintf(stderr,
+          "usage: %s [-n instructions] [-r programs] [-s seed] [-v] [rom...]\n"
+          "runs the reference engine and the one built in lockstep on the roms "
+          "(default\nthe test roms) and on random programs, comparing state "
+          "and writes after every\n%d cycles, or every block with the jit "
+          "or block cache. the roms run to the end\nunless -n stops them "
+          "sooner, 8080EXM.COM takes ~3e9 instructions. the\nlockstep "
+          "engine runs the random programs too, in lanes with registers of "
+          "their\nown\n",
+          name, WINDOW_CYCLES);
+}
+
+static uint64_t next_random(uint64_t* seed) {
+  // xorshift64*
+  *seed ^= *seed >> 12;
+  *seed ^= *seed << 25;
+  *seed ^= *seed >> 27;
+
+  return *seed * 0x2545f4914f6cdd1dULL;
+}
+
+// the same cpu state in both machines, their memory is set by the caller.
+// translations of the candidate start over
+static void reset(difftest_t* t, const i8080_t* cpu) {
+  i8080_jit_disable(&t->cand);
+  i8080_block_cache_disable(&t->cand);
+
+  memcpy(&t->ref, cpu, offsetof(i8080_t, external_memory));
+  memcpy(&t->cand, cpu, offsetof(i8080_t, external_memory));
+  t->ref_hooks.write_count = 0;
+  t->hooks.write_count = 0;
+
+  // no-ops unless built with I8080_JIT or I8080_BLOCK_CACHE
+  i8080_jit_enable(&t->cand);
+  i8080_block_cache_enable(&t->cand);
+
+  t->history_count = 0;
+  t->checked = 0;
+  t->diverged = false;
+}
+
+static void print_history(const difftest_t* t) {
+  const uint64_t first =
+      t->history_count > HISTORY ? t->history_count - HISTORY : 0;
+
+  for (uint64_t i = first; i < t->history_count; i++) {
+    const history_entry_t* entry = &t->history[i % HISTORY];
+    char line[I8080_DISASSEMBLY_LINE];
+    i8080_disassemble_line(entry->bytes, entry->pc, line);
+    printf("  %c %s\n", i < t->checked ? ' ' : '>', line);
+  }
+}
+
+// the i-th write of a log as address=byte, "-" past its end
+static void format_write(char text[8],
+                         const i8080_check_hooks_t* hooks,
+                         const uint32_t i) {
+  if (i >= hooks->write_count)
+    snprintf(text, 8, "-");
+  else
+    snprintf(text, 8, "%04x=%02x", hooks->writes[i].address,
+             hooks->writes[i].byte);
+}
+
+// true if both machines are in the same state and made the same writes since
+// the last check, otherwise reports how they differ along with the
+// reference's last instructions
+static bool same(difftest_t* t) {
+  const i8080_t* ref = &t->ref;
+  const i8080_t* cand = &t->cand;
+  // a halted run idles out its budget, i8080_step doesn't
+  const bool idle = ref->halted && cand->halted;
+  bool same = true;
+
+  char report[1024];
+  int length = 0;
+#define COMPARE(field, format)                                                \
+  if (ref->field != cand->field) {                                            \
+    same = false;                                                             \
+    length += snprintf(report + length, sizeof(report) - length,              \
+                       "  %-12s reference " format "  candidate " format "\n", \
+                       #field, ref->field, cand->field);                      \
+  }
+  COMPARE(a, "%02x")
+  COMPARE(b, "%02x")
+  COMPARE(c, "%02x")
+  COMPARE(d, "%02x")
+  COMPARE(e, "%02x")
+  COMPARE(h, "%02x")
+  COMPARE(l, "%02x")
+  COMPARE(pc, "%04x")
+  COMPARE(sp, "%04x")
+  COMPARE(cb.byte, "%02x")
+  COMPARE(ie, "%d")
+  COMPARE(ei_delay, "%d")
+  COMPARE(halted, "%d")
+  COMPARE(irq_pending, "%d")
+  COMPARE(irq_vector, "%04x")
+  COMPARE(instructions, "%" PRIu64)
+  if (!idle)
+    COMPARE(cycles, "%" PRIu64)
+#undef COMPARE
+
+  // the write logs, from the first entry that differs
+  const i8080_check_hooks_t* expected = &t->ref_hooks;
+  const i8080_check_hooks_t* actual = &t->hooks;
+  const uint32_t count = expected->write_count > actual->write_count
+                             ? expected->write_count
+                             : actual->write_count;
+  uint32_t first = 0;
+  while (first < expected->write_count && first < actual->write_count &&
+         first < I8080_CHECK_WRITES &&
+         expected->writes[first].address == actual->writes[first].address &&
+         expected->writes[first].byte == actual->writes[first].byte)
+    first++;
+
+  if (count > I8080_CHECK_WRITES) {
+    same = false;
+    length += snprintf(report + length, sizeof(report) - length,
+                       "  write log    more than %d writes between checks\n",
+                       I8080_CHECK_WRITES);
+  } else if (first < count) {
+    same = false;
+    for (uint32_t i = first; i < count && i < first + MEMORY_REPORT; i++) {
+      char reference[8], candidate[8];
+      format_write(reference, expected, i);
+      format_write(candidate, actual, i);
+      length += snprintf(report + length, sizeof(report) - length,
+                         "  write %-6u reference %-7s  candidate %s\n", i,
+                         reference, candidate);
+    }
+  }
+
+  if (same) {
+    t->ref_hooks.write_count = 0;
+    t->hooks.write_count = 0;
+    t->checked = ref->instructions;
+    return true;
+  }
+
+  printf("%s: diverged within instructions %llu-%llu\n", t->name,
+         (unsigned long long)t->checked + 1,
+         (unsigned long long)ref->instructions);
+  print_history(t);
+  printf("%s", report);
+
+  return false;
+}
+
+// all of memory, for writes that went around the log. reports the first bytes
+// that differ
+static bool same_memory(const difftest_t* t) {
+  int differing = 0;
+
+  for (int address = 0; address < I8080_MAX_MEMORY; address++) {
+    const uint8_t expected = t->ref.external_memory[address];
+    const uint8_t actual = t->cand.external_memory[address];
+
+    if (expected != actual && differing++ < MEMORY_REPORT) {
+      if (differing == 1)
+        printf("%s: memory differs at the end\n", t->name);
+      printf("  memory %04x  reference %02x  candidate %02x\n", address,
+             expected, actual);
+    }
+  }
+  if (differing > MEMORY_REPORT)
+    printf("  memory       %d more bytes differ\n", differing - MEMORY_REPORT);
+
+  return !differing;
+}
+
+static void remember(difftest_t* t) {
+  history_entry_t* entry = &t->history[t->history_count++ % HISTORY];
+  entry->pc = t->ref.pc;
+  for (int i = 0; i < 3; i++)
+    entry->bytes[i] = t->ref.external_memory[(uint16_t)(t->ref.pc + i)];
+}
+
+// the test roms' bdos calls just return, this prints what they asked for
+static void bdos(const difftest_t* t) {
+  const i8080_t* state = &t->ref;
+
+  if (!t->console || state->pc != 0x0005)
+    return;
+
+  if (state->c == 2) {
+    putchar(state->e);
+  } else if (state->c == 9) {
+    for (uint16_t address = state->d << 8 | state->e;
+         state->external_memory[address] != '$'; address++)
+      putchar(state->external_memory[address]);
+  }
+}
+
+// steps the reference up to the candidate, then compares them
+static bool check(difftest_t* t) {
+  i8080_t* ref = &t->ref;
+
+  while (ref->instructions < t->cand.instructions && !ref->halted) {
+    bdos(t);
+    remember(t);
+    ref_i8080_step(ref);
+  }
+
+  return same(t);
+}
+
+// the candidate left a block, see i8080_check_hooks. a divergence or the end of
+// the instructions to run stops it
+static void block_exit(i8080_t* state, void* context) {
+  difftest_t* t = context;
+
+  if (!check(t))
+    t->diverged = true;
+  if (t->diverged || t->ref.instructions >= t->max_instructions)
+    i8080_stop(state);
+}
+
+// runs until the reference halts or has run max_instructions, returns false at
+// the first divergence
+static bool run_lockstep(difftest_t* t, const char* name) {
+  const i8080_t* ref = &t->ref;
+  t->name = name;
+
+  do {
+    i8080_run(&t->cand, t->check_cycles);
+    if (t->diverged || !check(t))
+      return false;
+  } while (!ref->halted && ref->instructions < t->max_instructions);
+
+  return same_memory(t);
+}
+
+// loads a rom at 0x100 under a bdos that only prints, a jump back to 0 halts
+static bool diff_testrom(difftest_t* t, const char* file_name) {
+  FILE* file = fopen(file_name, "rb");
+  if (!file) {
+    fprintf(stderr, "Could not read file: %s\n", file_name);
+    return false;
+  }
+
+  uint8_t* memory = t->ref.external_memory;
+  memset(memory, 0, I8080_MAX_MEMORY);
+  fread(&memory[0x100], 1, I8080_MAX_MEMORY - 0x100, file);
+  fclose(file);
+
+  // top of memory at 6 as under cp/m, which is where the bdos is
+  memory[0x0000] = 0x76;  // HLT
+  memory[0x0005] = 0xc3;  // JMP BDOS_ENTRY
+  memory[0x0006] = BDOS_ENTRY & 0xff;
+  memory[0x0007] = BDOS_ENTRY >> 8;
+  memory[BDOS_ENTRY] = 0xc9;  // RET
+  memcpy(t->cand.external_memory, memory, I8080_MAX_MEMORY);
+
+  i8080_t cpu;
+  init_i8080(&cpu);
+  cpu.pc = 0x100;
+  reset(t, &cpu);
+
+  const bool matched = run_lockstep(t, file_name);
+  if (t->console)
+    putchar('\n');
+  if (matched)
+    printf("%s: %llu instructions match%s\n", file_name,
+           (unsigned long long)t->ref.instructions,
+           t->ref.halted ? "" : " (stopped)");
+
+  return matched;
+}
+
+// true for the instructions that don't go on with the next one: jumps, calls,
+// returns, restarts and HLT, including the undocumented aliases
+static bool transfers_control(const uint8_t opcode) {
+  switch (opcode) {
+    case 0x76:
+    case 0xc3:
+    case 0xcb:
+    case 0xc9:
+    case 0xd9:
+    case 0xcd:
+    case 0xdd:
+    case 0xed:
+    case 0xfd:
+    case 0xe9:
+      return true;
+    default:
+      // conditional returns, jumps and calls, restarts
+      return opcode >= 0xc0 && ((opcode & 7) == 0 || (opcode & 7) == 2 ||
+                                (opcode & 7) == 4 || (opcode & 7) == 7);
+  }
+}
+
+// random memory and registers. half of the programs just start somewhere in
+// it, the others get a loop of straight-line instructions so that the jit and
+// block cache have hot code to translate, which the program may overwrite
+static void random_program(difftest_t* t, uint64_t seed) {
+  seed = seed * 2 + 1;  // xorshift never leaves 0
+  uint8_t* memory = t->ref.external_memory;
+  for (int i = 0; i < I8080_MAX_MEMORY; i++)
+    memory[i] = next_random(&seed);
+
+  i8080_t cpu;
+  init_i8080(&cpu);
+  cpu.a = next_random(&seed);
+  cpu.b = next_random(&seed);
+  cpu.c = next_random(&seed);
+  cpu.d = next_random(&seed);
+  cpu.e = next_random(&seed);
+  cpu.h = next_random(&seed);
+  cpu.l = next_random(&seed);
+  cpu.sp = next_random(&seed);
+  cpu.pc = next_random(&seed);
+  cpu.cb.byte = (next_random(&seed) & 0xd5) | 0x02;
+
+  if (next_random(&seed) & 1) {
+    const int body = 8 + next_random(&seed) % 56;
+    uint16_t address = cpu.pc;
+
+    for (int i = 0; i < body;) {
+      uint8_t bytes[3] = {next_random(&seed), next_random(&seed),
+                          next_random(&seed)};
+      if (transfers_control(bytes[0]))
+        continue;
+
+      char line[I8080_DISASSEMBLY_LINE];
+      const uint8_t size = i8080_disassemble_line(bytes, address, line);
+      for (int j = 0; j < size; j++)
+        memory[address++] = bytes[j];
+      i += size;
+    }
+
+    memory[address] = 0xc3;  // JMP back to the start
+    memory[(uint16_t)(address + 1)] = cpu.pc & 0xff;
+    memory[(uint16_t)(address + 2)] = cpu.pc >> 8;
+  }
+
+  memcpy(t->cand.external_memory, memory, I8080_MAX_MEMORY);
+  reset(t, &cpu);
+}
+
+static void lane_registers(i8080_t* state, uint64_t seed) {
+  seed = seed * 2 + 1;
+  state->a = next_random(&seed);
+  state->b = next_random(&seed);
+  state->c = next_random(&seed);
+  state->d = next_random(&seed);
+  state->e = next_random(&seed);
+  state->h = next_random(&seed);
+  state->l = next_random(&seed);
+}
+
+// the same program in every lane of the lockstep engine with registers of
+// their own, so that lanes run together and apart. each lane is checked
+// against a reference machine given as many steps on its own
+static bool diff_lockstep(const uint64_t seed) {
+  i8080_t* machines[I8080_LANES];
+  char names[I8080_LANES][64];
+
+  for (int i = 0; i < I8080_LANES; i++) {
+    difftest_t* t = &lanes[i];
+    random_program(t, seed);
+    i8080_jit_disable(&t->cand);  // lockstep lanes only use i8080_step
+    i8080_block_cache_disable(&t->cand);
+
+    if (i) {
+      lane_registers(&t->ref, seed << 8 | i);
+      lane_registers(&t->cand, seed << 8 | i);
+    }
+
+    snprintf(names[i], sizeof(names[i]), "lockstep program, seed %llu, lane %d",
+             (unsigned long long)seed, i);
+    t->name = names[i];
+    machines[i] = &t->cand;
+  }
+
+  i8080_lockstep_t lockstep;
+  i8080_lockstep_init(&lockstep, machines, I8080_LANES);
+
+  for (int steps = 0; steps < PROGRAM_INSTRUCTIONS; steps += LOCKSTEP_CHECK) {
+    i8080_lockstep_run(&lockstep, LOCKSTEP_CHECK);
+
+    for (int i = 0; i < I8080_LANES; i++) {
+      difftest_t* t = &lanes[i];
+      for (int j = 0; j < LOCKSTEP_CHECK; j++) {
+        remember(t);
+        ref_i8080_step(&t->ref);
+      }
+      if (!same(t))
+        return false;
+    }
+  }
+
+  for (int i = 0; i < I8080_LANES; i++) {
+    if (!same_memory(&lanes[i]))
+      return false;
+  }
+
+  return true;
+}
+
+static bool alloc_machines(difftest_t* t) {
+  ref_init_i8080(&t->ref);
+  init_i8080(&t->cand);
+
+  return ref_i8080_alloc_memory(&t->ref) && i8080_alloc_memory(&t->cand);
+}
+
+static bool attach_hooks(difftest_t* t) {
+  return i8080_check_hooks(&t->cand, &t->hooks) &&
+         ref_i8080_check_hooks(&t->ref, &t->ref_hooks);
+}
+
+static void free_machines(difftest_t* t) {
+  i8080_free_memory(&t->cand);
+  ref_i8080_free_memory(&t->ref);
+}
+
+int main(int argc, char** argv) {
+  difftest_t* t = &difftest;
+  uint64_t max_instructions = UINT64_MAX;  // the roms run to the end
+  long programs = PROGRAMS;
+  uint64_t seed = 1;
+
+  int option;
+  while ((option = getopt(argc, argv, "n:r:s:v")) != -1) {
+    switch (option) {
+      case 'n':
+        max_instructions = strtoull(optarg, NULL, 0);
+        break;
+      case 'r':
+        programs = atol(optarg);
+        break;
+      case 's':
+        seed = strtoull(optarg, NULL, 0);
+        break;
+      case 'v':
+        t->console = true;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  bool allocated = alloc_machines(t);
+  for (int i = 0; i < I8080_LANES; i++)
+    allocated = allocated && alloc_machines(&lanes[i]);
+  if (!allocated) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+
+  // short runs would keep the candidate from ever entering a block, the blocks
+  // are checked through the hook as they end
+  const bool blocks =
+      i8080_jit_enable(&t->cand) || i8080_block_cache_enable(&t->cand);
+  t->hooks.block_exit = block_exit;
+  t->hooks.context = t;
+  bool attached = attach_hooks(t);
+  for (int i = 0; i < I8080_LANES; i++)
+    attached = attached && attach_hooks(&lanes[i]);
+  if (!attached) {
+    fprintf(stderr, "Built without I8080_CHECK_HOOKS\n");
+    return 1;
+  }
+  t->check_cycles = blocks ? RUN_CYCLES : WINDOW_CYCLES;
+  if (blocks)
+    printf("candidate checked after every block\n");
+  else
+    printf("candidate checked after every %d cycles\n", WINDOW_CYCLES);
+
+  bool matched = true;
+  t->max_instructions = max_instructions;
+  if (optind < argc) {
+    for (int i = optind; matched && i < argc; i++)
+      matched = diff_testrom(t, argv[i]);
+  } else {
+    for (size_t i = 0; matched && i < sizeof(ROMS) / sizeof(ROMS[0]); i++)
+      matched = diff_testrom(t, ROMS[i]);
+  }
+
+  t->max_instructions = PROGRAM_INSTRUCTIONS;
+  for (long i = 0; matched && i < programs; i++) {
+    char name[64];
+    snprintf(name, sizeof(name), "random program, seed %llu",
+             (unsigned long long)(seed + i));
+    random_program(t, seed + i);
+    matched = run_lockstep(t, name);
+  }
+  if (matched)
+    printf("%ld random programs match\n", programs);
+
+  // as many lane instructions as the random programs ran
+  const long lockstep_programs = programs / I8080_LANES;
+  for (long i = 0; matched && i < lockstep_programs; i++)
+    matched = diff_lockstep(seed + i);
+  if (matched)
+    printf("%ld lockstep programs of %d lanes match\n", lockstep_programs,
+           I8080_LANES);
+
+  free_machines(t);
+  for (int i = 0; i < I8080_LANES; i++)
+    free_machines(&lanes[i]);
+
+  return matched ? 0 : 1;
+}
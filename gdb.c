@@ -0,0 +1,468 @@
+#include "i8080/gdb.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define GDB_PACKET_SIZE 4096  // largest packet either way, as told to gdb
+#define GDB_REGISTERS 6
+
+typedef struct {
+  i8080_t* state;
+  int connection;
+  i8080_gdb_stop_handler_t stopped;
+  void* context;
+
+  uint8_t input[512];  // received, not yet looked at
+  size_t input_used, input_length;
+
+  char packet[GDB_PACKET_SIZE + 1];  // request being served, terminated
+  char reply[GDB_PACKET_SIZE + 1];
+  char last_stop[32];  // stop reply of the last stop, for '?'
+} gdb_t;
+
+static const char HEX[] = "0123456789abcdef";
+
+// next byte from gdb, -1 once the connection is gone
+static int receive_byte(gdb_t* gdb) {
+  if (gdb->input_used == gdb->input_length) {
+    const ssize_t length =
+        recv(gdb->connection, gdb->input, sizeof(gdb->input), 0);
+    if (length <= 0)
+      return -1;
+
+    gdb->input_used = 0;
+    gdb->input_length = length;
+  }
+
+  return gdb->input[gdb->input_used++];
+}
+
+static bool send_all(gdb_t* gdb, const char* bytes, size_t count) {
+  while (count) {
+    const ssize_t sent = send(gdb->connection, bytes, count, MSG_NOSIGNAL);
+    if (sent <= 0)
+      return false;
+
+    bytes += sent;
+    count -= sent;
+  }
+
+  return true;
+}
+
+static int hex_digit(const char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+
+  return -1;
+}
+
+// reads the packet into gdb->packet and acknowledges it. ^C outside a packet
+// is taken as an empty packet. false once the connection is gone
+static bool receive_packet(gdb_t* gdb) {
+  for (;;) {
+    int c;
+    do {
+      c = receive_byte(gdb);
+      if (c == 0x03) {
+        gdb->packet[0] = '\0';
+        return true;
+      }
+    } while (c >= 0 && c != '$');
+    if (c < 0)
+      return false;
+
+    size_t length = 0;
+    uint8_t checksum = 0;
+    while ((c = receive_byte(gdb)) >= 0 && c != '#') {
+      if (length < GDB_PACKET_SIZE)
+        gdb->packet[length++] = c;
+      checksum += c;
+    }
+    gdb->packet[length] = '\0';
+
+    const int high = receive_byte(gdb);
+    const int low = receive_byte(gdb);
+    if (low < 0)
+      return false;
+
+    if (hex_digit(high) << 4 == (checksum & 0xf0) &&
+        hex_digit(low) == (checksum & 0x0f))
+      return send_all(gdb, "+", 1);
+    if (!send_all(gdb, "-", 1))
+      return false;
+  }
+}
+
+// sends data as a packet until gdb acknowledges it
+static bool send_packet(gdb_t* gdb, const char* data) {
+  const size_t length = strlen(data);
+  char frame[GDB_PACKET_SIZE + 5];
+  uint8_t checksum = 0;
+
+  for (size_t i = 0; i < length; i++)
+    checksum += data[i];
+  snprintf(frame, sizeof(frame), "$%s#%c%c", data, HEX[checksum >> 4],
+           HEX[checksum & 0x0f]);
+
+  for (;;) {
+    if (!send_all(gdb, frame, length + 4))
+      return false;
+
+    const int ack = receive_byte(gdb);
+    if (ack != '-')
+      return ack >= 0;
+  }
+}
+
+// parses hex digits at *text up to the first other character, advancing past
+// them
+static uint32_t parse_hex(const char** text) {
+  uint32_t value = 0;
+
+  while (hex_digit(**text) >= 0)
+    value = value << 4 | hex_digit(*(*text)++);
+
+  return value;
+}
+
+static void put_hex_byte(char* text, const uint8_t byte) {
+  text[0] = HEX[byte >> 4];
+  text[1] = HEX[byte & 0x0f];
+}
+
+static uint8_t parse_hex_byte(const char* text) {
+  return hex_digit(text[0]) << 4 | hex_digit(text[1]);
+}
+
+static uint16_t get_register(const i8080_t* state, const int number) {
+  switch (number) {
+    case 0:
+      return state->a << 8 | state->cb.byte;
+    case 1:
+      return state->b << 8 | state->c;
+    case 2:
+      return state->d << 8 | state->e;
+    case 3:
+      return state->h << 8 | state->l;
+    case 4:
+      return state->sp;
+    default:
+      return state->pc;
+  }
+}
+
+static void set_register(i8080_t* state,
+                         const int number,
+                         const uint16_t value) {
+  switch (number) {
+    case 0:
+      state->a = value >> 8;
+      state->cb.byte = value & 0xff;
+      state->cb.flags.bit1 = 1;  // fixed bits stay as PUSH PSW has them
+      state->cb.flags.bit3 = 0;
+      state->cb.flags.bit5 = 0;
+      break;
+    case 1:
+      state->b = value >> 8;
+      state->c = value & 0xff;
+      break;
+    case 2:
+      state->d = value >> 8;
+      state->e = value & 0xff;
+      break;
+    case 3:
+      state->h = value >> 8;
+      state->l = value & 0xff;
+      break;
+    case 4:
+      state->sp = value;
+      break;
+    case 5:
+      state->pc = value;
+      break;
+  }
+}
+
+// registers go over the wire low byte first
+static void put_register(char* text, const uint16_t value) {
+  put_hex_byte(text, value & 0xff);
+  put_hex_byte(text + 2, value >> 8);
+}
+
+static uint16_t parse_register(const char* text) {
+  return parse_hex_byte(text) | parse_hex_byte(text + 2) << 8;
+}
+
+// stop reply for the reason a run returned, SIGTRAP but for a ^C
+static void stop_reply(gdb_t* gdb,
+                       const i8080_stop_reason_t reason,
+                       const bool interrupted) {
+  i8080_t* state = gdb->state;
+
+  if (gdb->stopped)
+    gdb->stopped(gdb->context);
+
+  if (interrupted) {
+    strcpy(gdb->last_stop, "S02");
+  } else if (reason == I8080_STOP_WATCH_READ ||
+             reason == I8080_STOP_WATCH_WRITE) {
+    const uint16_t address = i8080_watch_hit(state);
+    const char* kind = reason == I8080_STOP_WATCH_WRITE ? "watch" : "rwatch";
+    snprintf(gdb->last_stop, sizeof(gdb->last_stop), "T05%s:%04x;", kind,
+             address);
+  } else {
+    strcpy(gdb->last_stop, "S05");
+  }
+
+  strcpy(gdb->reply, gdb->last_stop);
+}
+
+// whether gdb sent ^C, without waiting for it
+static bool interrupt_requested(gdb_t* gdb) {
+  struct pollfd poll_fd = {gdb->connection, POLLIN, 0};
+
+  while (gdb->input_used < gdb->input_length ||
+         poll(&poll_fd, 1, 0) > 0) {
+    const int c = receive_byte(gdb);
+    if (c < 0 || c == 0x03)
+      return true;
+  }
+
+  return false;
+}
+
+// c: runs until something stops it, slice by slice so ^C is seen. a halt that
+// nothing can end is a stop too, the slices would idle through it forever
+static void serve_continue(gdb_t* gdb) {
+  i8080_t* state = gdb->state;
+  i8080_run_result_t run;
+  bool interrupted = false;
+
+  do {
+    run = i8080_debug_run(state, I8080_GDB_SLICE);
+    if (state->halted && i8080_next_event(state) == UINT64_MAX)
+      run.reason = I8080_STOP_HALTED;
+  } while (run.reason == I8080_STOP_BUDGET &&
+           !(interrupted = interrupt_requested(gdb)));
+
+  stop_reply(gdb, run.reason, interrupted);
+}
+
+// Z and z: type,address,kind. kind is the length of a watched range
+static void serve_point(gdb_t* gdb, const bool set) {
+  i8080_t* state = gdb->state;
+  const char* text = &gdb->packet[1];
+  const uint32_t type = parse_hex(&text);
+  const uint16_t address = *text == ',' ? (text++, parse_hex(&text)) : 0;
+  const uint32_t size = *text == ',' ? (text++, parse_hex(&text)) : 1;
+
+  switch (type) {
+    case 0:  // software and hardware breakpoints are the same thing here
+    case 1:
+      if (set)
+        i8080_break_set(state, address);
+      else
+        i8080_break_clear(state, address);
+      break;
+    case 2:
+    case 3:
+    case 4:
+      if (set)
+        i8080_watch_set(state, address, size, type != 2, type != 3);
+      else
+        i8080_watch_clear(state, address, size, type != 2, type != 3);
+      break;
+    default:
+      return;  // not supported, empty reply
+  }
+
+  strcpy(gdb->reply, "OK");
+}
+
+// m address,length
+static void serve_read_memory(gdb_t* gdb) {
+  const char* text = &gdb->packet[1];
+  const uint16_t address = parse_hex(&text);
+  uint32_t length = *text == ',' ? (text++, parse_hex(&text)) : 0;
+
+  if (length > GDB_PACKET_SIZE / 2)
+    length = GDB_PACKET_SIZE / 2;
+
+  for (uint32_t i = 0; i < length; i++)
+    put_hex_byte(&gdb->reply[i * 2], i8080_debug_read(gdb->state, address + i));
+  gdb->reply[length * 2] = '\0';
+}
+
+// M address,length:bytes
+static void serve_write_memory(gdb_t* gdb) {
+  const char* text = &gdb->packet[1];
+  const uint16_t address = parse_hex(&text);
+  const uint32_t length = *text == ',' ? (text++, parse_hex(&text)) : 0;
+
+  if (*text++ != ':' || strlen(text) < length * 2) {
+    strcpy(gdb->reply, "E01");
+    return;
+  }
+
+  for (uint32_t i = 0; i < length; i++)
+    i8080_debug_write(gdb->state, address + i, parse_hex_byte(&text[i * 2]));
+
+  strcpy(gdb->reply, "OK");
+}
+
+// answers packets until gdb detaches, kills the target or goes away
+static void serve(gdb_t* gdb) {
+  i8080_t* state = gdb->state;
+
+  strcpy(gdb->last_stop, "S05");
+
+  while (receive_packet(gdb)) {
+    const char* text = &gdb->packet[1];
+    gdb->reply[0] = '\0';  // empty reply: not supported
+
+    switch (gdb->packet[0]) {
+      case '\0':  // ^C while stopped
+        continue;
+      case '?':
+        strcpy(gdb->reply, gdb->last_stop);
+        break;
+      case 'g':
+        for (int i = 0; i < GDB_REGISTERS; i++)
+          put_register(&gdb->reply[i * 4], get_register(state, i));
+        gdb->reply[GDB_REGISTERS * 4] = '\0';
+        break;
+      case 'G':
+        for (int i = 0; i < GDB_REGISTERS && strlen(text) >= (i + 1) * 4; i++)
+          set_register(state, i, parse_register(&text[i * 4]));
+        strcpy(gdb->reply, "OK");
+        break;
+      case 'p': {
+        const uint32_t number = parse_hex(&text);
+        if (number < GDB_REGISTERS) {
+          put_register(gdb->reply, get_register(state, number));
+          gdb->reply[4] = '\0';
+        } else {
+          strcpy(gdb->reply, "E01");
+        }
+        break;
+      }
+      case 'P': {
+        const uint32_t number = parse_hex(&text);
+        if (number < GDB_REGISTERS && *text == '=' && strlen(text) >= 5) {
+          set_register(state, number, parse_register(text + 1));
+          strcpy(gdb->reply, "OK");
+        } else {
+          strcpy(gdb->reply, "E01");
+        }
+        break;
+      }
+      case 'm':
+        serve_read_memory(gdb);
+        break;
+      case 'M':
+        serve_write_memory(gdb);
+        break;
+      case 'c':
+        if (*text)
+          state->pc = parse_hex(&text);
+        serve_continue(gdb);
+        break;
+      case 's':
+        if (*text)
+          state->pc = parse_hex(&text);
+        // exactly one instruction, or an accepted interrupt
+        stop_reply(gdb, i8080_run(state, 1).reason, false);
+        break;
+      case 'Z':
+      case 'z':
+        serve_point(gdb, gdb->packet[0] == 'Z');
+        break;
+      case 'H':
+      case 'T':
+        strcpy(gdb->reply, "OK");  // a single thread, always alive
+        break;
+      case 'q':
+        if (strncmp(gdb->packet, "qSupported", 10) == 0)
+          snprintf(gdb->reply, sizeof(gdb->reply), "PacketSize=%x",
+                   GDB_PACKET_SIZE);
+        else if (strcmp(gdb->packet, "qAttached") == 0)
+          strcpy(gdb->reply, "1");
+        break;
+      case 'D':
+        send_packet(gdb, "OK");
+        return;
+      case 'k':
+        return;
+    }
+
+    if (!send_packet(gdb, gdb->reply))
+      return;
+  }
+}
+
+// the connection of the first gdb on port of the loopback interface, -1 if the
+// socket can't be set up
+static int wait_for_debugger(const uint16_t port) {
+  const int listener = socket(AF_INET, SOCK_STREAM, 0);
+  if (listener < 0)
+    return -1;
+
+  const int reuse = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+  struct sockaddr_in address = {0};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if (bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+      listen(listener, 1) != 0) {
+    close(listener);
+    return -1;
+  }
+
+  const int connection = accept(listener, NULL, NULL);
+  close(listener);  // one debugger per session
+
+  return connection;
+}
+
+bool i8080_gdb_serve(i8080_t* state,
+                     const uint16_t port,
+                     const i8080_gdb_stop_handler_t stopped,
+                     void* context) {
+  const int connection = wait_for_debugger(port);
+  if (connection < 0)
+    return false;
+
+  gdb_t* gdb = calloc(1, sizeof(gdb_t));
+  if (!gdb || !i8080_debug_start(state)) {
+    free(gdb);
+    close(connection);
+    return false;
+  }
+
+  gdb->state = state;
+  gdb->connection = connection;
+  gdb->stopped = stopped;
+  gdb->context = context;
+
+  serve(gdb);
+
+  close(connection);
+  free(gdb);
+  i8080_debug_stop(state);
+
+  return true;
+}
@@ -0,0 +1,72 @@
+#include "i8080/cpm.h"
+#include "i8080/gdb.h"
+#include "i8080/loader.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define DEFAULT_PORT 8080
+
+static void usage(const char* name) {
+  fprintf(stderr,
+          "usage: %s [-p port] program\n"
+          "runs program under cp/m (.com) or from its entry point and waits\n"
+          "for gdb on the local port (default %d): target remote :port\n",
+          name, DEFAULT_PORT);
+}
+
+// console output of the program shows up whenever it stops
+static void flush_console(void* context) {
+  i8080_cpm_flush(context);
+}
+
+int main(int argc, char** argv) {
+  int port = DEFAULT_PORT;
+
+  int option;
+  while ((option = getopt(argc, argv, "p:")) != -1) {
+    if (option == 'p') {
+      port = atoi(optarg);
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind != argc - 1 || port <= 0 || port > 0xffff) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  const char* file_name = argv[optind];
+  i8080_image_t* image =
+      i8080_image_open(file_name, i8080_image_format(file_name), 0x100);
+  if (!image) {
+    fprintf(stderr, "Could not read file: %s\n", file_name);
+    return 1;
+  }
+
+  i8080_t state;
+  init_i8080(&state);
+  if (!i8080_alloc_memory(&state)) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+
+  // cp/m first, the image may cover page zero
+  i8080_cpm_t cpm;
+  i8080_cpm_init(&cpm, &state, ".", stdin, stdout);
+  i8080_image_load(&state, image);
+  state.pc = i8080_image_entry(image);
+
+  fprintf(stderr, "waiting for gdb on port %d\n", port);
+  const bool served = i8080_gdb_serve(&state, port, flush_console, &cpm);
+  if (!served)
+    fprintf(stderr, "Could not listen on port %d\n", port);
+
+  i8080_cpm_close(&cpm);
+  i8080_free_memory(&state);
+  i8080_image_close(image);
+
+  return served ? 0 : 1;
+}
@@ -1,4 +1,275 @@
+#define _GNU_SOURCE  // memfd_create
+
 #include "i8080/i8080.h"
+#include "i8080/replay.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifdef I8080_JIT
+#if !defined(__x86_64__) || !defined(I8080_DISPATCH_TABLE)
+#error "I8080_JIT needs an x86-64 host and the table engine"
+#endif
+
+#define JIT_CODE_SIZE (16 << 20)  // executable code cache, flushed when full
+#define JIT_BLOCK_SPACE 4096      // bound of one block's code and operands
+#define JIT_MAX_INSTRUCTIONS 32   // per block
+#define JIT_HOT_COUNT 16  // entries at an untranslated pc before translating
+#define JIT_MAX_INVALIDATIONS 64  // per page, then it's left to the interpreter
+
+// translated block, counts its cycles and instructions in state as it goes
+typedef void (*jit_code_t)(i8080_t* state);
+
+typedef struct {
+  jit_code_t code;  // NULL when not translated
+  uint32_t end;     // address after the last instruction, blocks stay in a page
+  uint32_t cycles;  // cycles of all instructions but the last
+} jit_block_t;
+
+typedef struct i8080_jit_t {
+  uint8_t* code;  // code cache, filled from the start
+  uint8_t* exec;  // the same memory, executable but not writable
+  size_t code_used;
+
+  jit_block_t blocks[I8080_MAX_MEMORY];  // indexed by start address
+  uint8_t hits[I8080_MAX_MEMORY];        // entries of untranslated addresses
+
+  // ram pages holding translations have write_pages cleared so guest writes
+  // reach jit_write, the direct pointer is kept aside meanwhile
+  bool trapped_pages[I8080_PAGE_COUNT];
+  uint8_t* saved_write_pages[I8080_PAGE_COUNT];
+  // bitmap of bytes that belong to translated instructions
+  uint8_t code_bytes[I8080_PAGE_COUNT][I8080_PAGE_SIZE / 8];
+  uint16_t invalidations[I8080_PAGE_COUNT];
+} i8080_jit_t;
+
+static void jit_forget_page(i8080_t* state, int page);
+static void jit_write(i8080_t* state, uint16_t address, uint8_t byte);
+#endif
+
+#ifdef I8080_BLOCK_CACHE
+#if !defined(I8080_DISPATCH_TABLE) || defined(I8080_JIT)
+#error "I8080_BLOCK_CACHE needs the table engine and excludes I8080_JIT"
+#endif
+
+#define BLOCK_CACHE_SIZE 4096  // decoded blocks, direct-mapped on start address
+#define BLOCK_MAX_OPS 16
+
+// superinstructions, opcode pairs the decoder turns into a single micro-op.
+// extend from the per-pair counts of i8080_block_cache_fusion
+#define FUSED_PAIRS(PAIR)        \
+  PAIR(0d, c2, "DCR C/JNZ")     \
+  PAIR(7e, 23, "MOV A,M/INX H") \
+  PAIR(1a, 12, "LDAX D/STAX D") \
+  PAIR(fe, ca, "CPI/JZ")
+
+#define FUSED_PAIR_INDEX(first, second, name) FUSED_##first##_##second,
+enum { FUSED_PAIRS(FUSED_PAIR_INDEX) FUSED_PAIR_COUNT };
+#undef FUSED_PAIR_INDEX
+
+// instruction decoded once: the table engine's handler, the instruction bytes
+// it takes its operands from and its base cycle cost
+typedef struct {
+  union {
+    void (*handler)(i8080_t* state, const uint8_t* opcode);
+    // superinstruction, returns how many of its two instructions it ran
+    uint32_t (*fused_handler)(i8080_t* state, const uint8_t* opcode);
+  };
+  uint8_t opcode[6];  // bytes of both instructions when fused
+  uint8_t cycles;     // of the first instruction when fused
+  bool fused;
+} micro_op_t;
+
+typedef struct {
+  uint32_t start;       // address of the first instruction, > 0xffff if unused
+  uint32_t end;         // address after the last instruction
+  uint32_t generation;  // of the start page when decoded
+  uint32_t count;
+  micro_op_t ops[BLOCK_MAX_OPS];
+} decoded_block_t;
+
+typedef struct i8080_block_cache_t {
+  decoded_block_t blocks[BLOCK_CACHE_SIZE];
+
+  // a write to decoded code bumps the generation of its page, outdating every
+  // block decoded from it. ram pages holding decoded code have write_pages
+  // cleared so those writes are seen, the direct pointer is kept aside
+  uint32_t generations[I8080_PAGE_COUNT];
+  bool trapped_pages[I8080_PAGE_COUNT];
+  uint8_t* saved_write_pages[I8080_PAGE_COUNT];
+  // bitmap of bytes that belong to decoded instructions
+  uint8_t code_bytes[I8080_PAGE_COUNT][I8080_PAGE_SIZE / 8];
+
+  uint64_t fusions[FUSED_PAIR_COUNT];  // complete runs of each superinstruction
+} i8080_block_cache_t;
+
+static void block_cache_forget_page(i8080_t* state, int page);
+static void block_cache_write(i8080_t* state, uint16_t address, uint8_t byte);
+#endif
+
+#ifdef I8080_CHECK_HOOKS
+static inline void flags_sync(i8080_t* state);
+
+// the jit or block cache is back in the run loop, see i8080_check_hooks. the
+// checker compares cb, so pending flags are written first
+static inline void block_exit(i8080_t* state) {
+  const i8080_check_hooks_t* hooks = state->check_hooks;
+
+  if (hooks && hooks->block_exit) {
+    flags_sync(state);
+    hooks->block_exit(state, hooks->context);
+  }
+}
+
+static inline void check_write(i8080_t* state,
+                               const uint16_t address,
+                               const uint8_t byte) {
+  i8080_check_hooks_t* hooks = state->check_hooks;
+
+  if (hooks->write_count < I8080_CHECK_WRITES) {
+    hooks->writes[hooks->write_count].address = address;
+    hooks->writes[hooks->write_count].byte = byte;
+  }
+  hooks->write_count++;
+}
+#endif
+
+#ifdef I8080_TRACE
+#include <pthread.h>
+
+#include "i8080/trace.h"
+
+#define TRACE_RING_SIZE (16 << 20)  // power of two
+#define TRACE_CHUNK (1 << 20)       // bytes the writer waits for, then writes
+// longest record: tag, pc, opcode, register mask and values, sp, writes
+#define TRACE_RECORD_SIZE \
+  (1 + 2 + 3 + 1 + 8 + 2 + 2 + 3 * I8080_TRACE_MAX_WRITES)
+
+typedef struct i8080_trace_t {
+  // records go into the ring on the cpu's thread and out to file on the
+  // writer's. head is only moved by the former, tail by the latter. the ring
+  // is followed by room for a record, one running past the end is encoded
+  // there whole and then wrapped
+  uint8_t* ring;
+  _Atomic size_t head, tail;
+  size_t signalled;  // head when the writer was last woken
+  pthread_t writer;
+  pthread_mutex_t lock;
+  pthread_cond_t data, space;
+  bool stopping;
+  FILE* file;
+  bool failed;  // a write to file failed, the trace is cut short
+
+  // registers as of the last record, so changes made by host code between
+  // instructions show up in the next one, and the writes of the instruction
+  // being recorded
+  bool recording;
+  uint8_t registers[8];  // b, c, d, e, h, l, a, flags
+  uint16_t sp;
+  uint16_t next_pc;  // pc the next record has unless it says otherwise
+  int write_count;
+  i8080_trace_write_t writes[I8080_TRACE_MAX_WRITES];
+} i8080_trace_t;
+
+// memory writes of the instruction being recorded, host writes between
+// instructions aren't part of any record
+static inline void trace_write(i8080_t* state,
+                               const uint16_t address,
+                               const uint8_t byte) {
+  i8080_trace_t* trace = state->trace;
+
+  if (trace->recording && trace->write_count < I8080_TRACE_MAX_WRITES)
+    trace->writes[trace->write_count++] = (i8080_trace_write_t){address, byte};
+}
+
+static void trace_begin(i8080_t* state);
+static void trace_end(i8080_t* state, uint16_t pc, const uint8_t* opcode);
+#endif
+
+#ifdef I8080_PROFILE
+#include "i8080/profile.h"
+
+static void profile_interrupt(i8080_t* state);
+#endif
+
+// breakpoints and watchpoints, see i8080_debug_start. bitmaps have a bit per
+// page or address, the lowest in bit 0 of the first byte
+typedef struct i8080_debug_t {
+  // the run loop only looks at breakpoints once the bit of their page is set
+  uint8_t break_pages[I8080_PAGE_COUNT / 8];
+  uint8_t breakpoints[I8080_MAX_MEMORY / 8];
+  uint16_t break_counts[I8080_PAGE_COUNT];
+  int break_count;
+
+  // watched pages have read_pages and write_pages cleared so every access
+  // reaches the slow path, the direct pointers are kept aside meanwhile
+  uint8_t watch_reads[I8080_MAX_MEMORY / 8];
+  uint8_t watch_writes[I8080_MAX_MEMORY / 8];
+  uint16_t watch_counts[I8080_PAGE_COUNT];  // watched addresses in each page
+  uint8_t* saved_read_pages[I8080_PAGE_COUNT];
+  uint8_t* saved_write_pages[I8080_PAGE_COUNT];
+
+  bool quiet;    // host access through i8080_debug_read/i8080_debug_write
+  uint16_t hit;  // address of the watched access that stopped the run
+} i8080_debug_t;
+
+// device input record/replay, see i8080_replay_record
+static uint8_t replay_in(i8080_t* state, uint8_t port);
+static bool replay_request(i8080_t* state, uint16_t vector);
+static void replay_seek(i8080_t* state);
+
+static inline bool bit_set(const uint8_t* bitmap, const uint32_t index) {
+  return bitmap[index / 8] & 1 << index % 8;
+}
+
+static inline bool breakpoint_at(const i8080_debug_t* debug,
+                                 const uint16_t address) {
+  return bit_set(debug->break_pages, address / I8080_PAGE_SIZE) &&
+         bit_set(debug->breakpoints, address);
+}
+
+// what the batch run loop stops in front of besides its budget, a constant at
+// each call site so the checks of the others are folded away
+typedef enum { RUN_FREE, RUN_UNTIL, RUN_DEBUG } run_mode_t;
+
+// whether the loop stops in front of the instruction at pc, until is the pc of
+// i8080_run_until
+__attribute__((always_inline)) static inline bool stops_at(
+    const i8080_t* state,
+    const run_mode_t mode,
+    const uint16_t until) {
+  if (mode == RUN_UNTIL)
+    return state->pc == until;
+  if (mode == RUN_DEBUG)
+    return breakpoint_at(state->debug, state->pc);
+
+  return false;
+}
+
+// whether it stops in front of any instruction but the first of the block from
+// start to end. blocks lie within a page, the bit of the page rules out most
+__attribute__((always_inline)) static inline bool stops_within(
+    const i8080_t* state,
+    const run_mode_t mode,
+    const uint16_t until,
+    const uint32_t start,
+    const uint32_t end) {
+  if (mode == RUN_UNTIL)
+    return until > start && until < end;
+  if (mode == RUN_DEBUG &&
+      bit_set(state->debug->break_pages, start / I8080_PAGE_SIZE)) {
+    for (uint32_t address = start + 1; address < end; address++) {
+      if (bit_set(state->debug->breakpoints, address))
+        return true;
+    }
+  }
+
+  return false;
+}
 
 // table represents cpu cycles taken by each instruction
 // duration of conditional calls and returns is different
@@ -24,34 +295,153 @@ static const uint8_t OPCODE_CYCLES[] = {
     5, 10, 10, 4,  11, 11, 7,  11, 5, 5,  10, 4,  11, 17, 7, 11   // f
 };
 
+// table represents byte length of each instruction, opcode included
+static const uint8_t OPCODE_LENGTHS[] = {
+    //  0  1  2  3  4  5  6  7  8  9  a  b  c  d  e  f
+    1, 3, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1,  // 0
+    1, 3, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1,  // 1
+    1, 3, 3, 1, 1, 1, 2, 1, 1, 1, 3, 1, 1, 1, 2, 1,  // 2
+    1, 3, 3, 1, 1, 1, 2, 1, 1, 1, 3, 1, 1, 1, 2, 1,  // 3
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 4
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 5
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 6
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 7
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 8
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 9
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // a
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // b
+    1, 1, 3, 3, 3, 1, 2, 1, 1, 1, 3, 3, 3, 3, 2, 1,  // c
+    1, 1, 3, 2, 3, 1, 2, 1, 1, 1, 3, 2, 3, 3, 2, 1,  // d
+    1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 3, 2, 1,  // e
+    1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 3, 2, 1,  // f
+};
+
 static uint16_t get_regpair_val(const regpair_t* pair) {
   const uint16_t result = (*(*pair).first << 8) | *(*pair).second;
 
   return result;
 }
 
-// returns memory reference M (byte at address made up of HL reg. pair)
-static uint8_t* mem_ref_m(i8080_t* state) {
-  const uint16_t address = (state->h << 8) | state->l;
+// flag bits within the PSW byte, cb.byte is laid out the same way
+#define FLAG_S 0x80
+#define FLAG_Z 0x40
+#define FLAG_AC 0x10
+#define FLAG_P 0x04
+#define FLAG_BIT1 0x02  // always 1
+#define FLAG_C 0x01
+
+// table maps a result byte to its sign, zero and parity (even) bits, already
+// placed as in the PSW byte
+static const uint8_t ZSP_FLAGS[] = {
+    0x44, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,  // 0
+    0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+    0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,  // 1
+    0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+    0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,  // 2
+    0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+    0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,  // 3
+    0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+    0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,  // 4
+    0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+    0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,  // 5
+    0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+    0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,  // 6
+    0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+    0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,  // 7
+    0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+    0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,  // 8
+    0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+    0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,  // 9
+    0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+    0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,  // a
+    0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+    0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,  // b
+    0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+    0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,  // c
+    0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+    0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,  // d
+    0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+    0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,  // e
+    0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+    0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,  // f
+    0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+};
 
-  uint8_t* M = &state->external_memory[address];
+// kinds of alu operations, decides how c and ac are derived from operands
+enum {
+  FLAGS_NONE,   // nothing pending, cb is up to date
+  FLAGS_ADD,    // add, adc, adi, aci, daa
+  FLAGS_SUB,    // sub, sbb, sui, sbi, cmp, cpi
+  FLAGS_ANA,    // ana, ani
+  FLAGS_LOGIC,  // xra, ora, xri, ori
+  FLAGS_INR,    // leaves carry untouched
+  FLAGS_DCR     // leaves carry untouched
+};
 
-  return M;
-}
+__attribute__((always_inline)) static inline void compute_flags(
+    i8080_t* state,
+    const uint8_t kind,
+    const uint8_t lhs,
+    const uint8_t rhs,
+    const uint16_t result) {
+  // every flag is rewritten by one store, bits 3 and 5 stay 0
+  uint8_t flags = ZSP_FLAGS[result & 0xff] | FLAG_BIT1;
 
-static bool should_set_parity_bit(const uint8_t byte) {
-  int count = 0;  // holds count of 1's
+  switch (kind) {
+    case FLAGS_ADD:
+      flags |= ((result >> 8) & FLAG_C) | ((lhs ^ result ^ rhs) & FLAG_AC);
+      break;
+    case FLAGS_SUB:
+      flags |= ((result >> 8) & FLAG_C) | (~(lhs ^ result ^ rhs) & FLAG_AC);
+      break;
+    case FLAGS_ANA:
+      flags |= ((lhs | rhs) << 1) & FLAG_AC;  // carry reset
+      break;
+    case FLAGS_LOGIC:
+      break;  // carry and auxiliary carry reset
+    case FLAGS_INR:
+      flags |= state->cb.byte & FLAG_C;  // carry survives
+      flags |= (0x0f & result) == 0 ? FLAG_AC : 0;
+      break;
+    case FLAGS_DCR:
+      flags |= state->cb.byte & FLAG_C;  // carry survives
+      flags |= (0x0f & result) != 0x0f ? FLAG_AC : 0;
+      break;
+  }
 
-  for (int bit = 0; bit < 8; bit++)
-    count += (byte >> bit) & 1;
+  state->cb.byte = flags;
+}
 
-  return (count % 2 == 0);
+// sets flags after an alu operation. with I8080_LAZY_FLAGS the operands and
+// result are only recorded and cb is written by flags_sync once something
+// reads the flags, otherwise cb is written right away
+__attribute__((always_inline)) static inline void set_flags(
+    i8080_t* state,
+    const uint8_t kind,
+    const uint8_t lhs,
+    const uint8_t rhs,
+    const uint16_t result) {
+#ifdef I8080_LAZY_FLAGS
+  state->lazy =
+      (lazyflags_t){kind, lhs, rhs, result & 0xff, (result >> 8) & 1};
+#else
+  compute_flags(state, kind, lhs, rhs, result);
+#endif
 }
 
-static void set_flags_zsp(i8080_t* state, uint8_t byte) {
-  state->cb.flags.z = (0 == byte);
-  state->cb.flags.s = (0x80 & byte) != 0;
-  state->cb.flags.p = should_set_parity_bit(byte);
+// writes pending flags to cb, must precede any read of cb and any write of
+// only some of its flags. no-op unless built with I8080_LAZY_FLAGS. the record
+// is cleared as a whole, so that machines in the same state compare equal
+static inline void flags_sync(i8080_t* state) {
+#ifdef I8080_LAZY_FLAGS
+  const lazyflags_t lazy = state->lazy;
+
+  if (lazy.kind != FLAGS_NONE) {
+    compute_flags(state, lazy.kind, lazy.lhs, lazy.rhs,
+                  lazy.result | lazy.carry << 8);
+    state->lazy = (lazyflags_t){FLAGS_NONE, 0, 0, 0, 0};
+  }
+#endif
 }
 
 static uint8_t add_bytes_set_flags(i8080_t* state,
@@ -60,9 +450,7 @@ static uint8_t add_bytes_set_flags(i8080_t* state,
                                    const bool carry) {
   const int16_t result = augend + addend + carry;
 
-  state->cb.flags.c = (0x100 & result) != 0;
-  state->cb.flags.ac = ((augend ^ result ^ addend) & 0x10) != 0;
-  set_flags_zsp(state, result & 0xff);
+  set_flags(state, FLAGS_ADD, augend, addend, result);
 
   return result & 0xff;
 }
@@ -73,9 +461,7 @@ static uint8_t sub_bytes_set_flags(i8080_t* state,
                                    const bool carry) {
   const int16_t result = minuend - subtrahend - carry;
 
-  state->cb.flags.c = (0x100 & result) != 0;
-  state->cb.flags.ac = (~(minuend ^ result ^ subtrahend) & 0x10) != 0;
-  set_flags_zsp(state, result & 0xff);
+  set_flags(state, FLAGS_SUB, minuend, subtrahend, result);
 
   return result & 0xff;
 }
@@ -111,39 +497,774 @@ void init_i8080(i8080_t* state) {
   init_conditionbits(&cb);
   state->cb = cb;
 
+  state->lazy = (lazyflags_t){FLAGS_NONE, 0, 0, 0, 0};
+
   state->cycles = 0;
+  state->instructions = 0;
   state->ie = 0;
+  state->ei_delay = 0;
+  state->halted = 0;
+  state->irq_pending = 0;
+  state->irq_vector = 0;
+
+  state->event_count = 0;
+  state->run_deadline = 0;
+  state->stop = 0;
+
+  state->jit = NULL;
+  state->block_cache = NULL;
+  state->trace = NULL;
+  state->profile = NULL;
+  state->debug = NULL;
+  state->replay = NULL;
+  state->check_hooks = NULL;
+
+  state->snapshot = NULL;
+  memset(state->dirty_pages, 1, sizeof(state->dirty_pages));
+  state->device_count = 0;
+
+  state->external_memory = NULL;
+  state->memory_mirrored = 0;
+
+  // nothing mapped, accesses fall back to external_memory
+  for (int page = 0; page < I8080_PAGE_COUNT; page++) {
+    state->fetch_pages[page] = NULL;
+    state->read_pages[page] = NULL;
+    state->write_pages[page] = NULL;
+    state->page_handlers[page] = (i8080_page_handler_t){NULL, NULL, NULL};
+  }
+
+  // no devices attached
+  for (int port = 0; port < I8080_PORT_COUNT; port++)
+    state->ports[port] = (i8080_port_handler_t){NULL, NULL, NULL};
+}
+
+void i8080_map_port(i8080_t* state,
+                    const uint8_t port,
+                    const i8080_port_handler_t handler) {
+  state->ports[port] = handler;
+}
+
+// a page is fetched from directly when the 2 bytes after it in host memory are
+// those of the next page: pages mapped contiguously and, past 0xffff, memory
+// mirrored by i8080_alloc_memory
+static void update_fetch_page(i8080_t* state, const int page) {
+  const int next = (page + 1) % I8080_PAGE_COUNT;
+  uint8_t* memory = state->read_pages[page];
+  const uint8_t* following = state->read_pages[next];
+  bool contiguous = false;
+
+  if (memory && following && next)
+    contiguous = following == memory + I8080_PAGE_SIZE;
+  else if (memory && following)
+    contiguous = state->memory_mirrored &&
+                 following == state->external_memory &&
+                 memory == following + I8080_MAX_MEMORY - I8080_PAGE_SIZE;
+
+  state->fetch_pages[page] = contiguous ? memory : NULL;
+}
+
+// after the read mapping of count pages from first changed, the page before
+// them depends on the first one
+static void update_fetch_pages(i8080_t* state, const int first, int count) {
+  for (int i = -1; i < count && i < I8080_PAGE_COUNT; i++)
+    update_fetch_page(state, (first + i + I8080_PAGE_COUNT) % I8080_PAGE_COUNT);
+}
+
+// takes a watched page out of the page table, see i8080_debug_t
+static void debug_trap_page(i8080_t* state, const int page) {
+  i8080_debug_t* debug = state->debug;
+
+  debug->saved_read_pages[page] = state->read_pages[page];
+  debug->saved_write_pages[page] = state->write_pages[page];
+  state->read_pages[page] = NULL;
+  state->write_pages[page] = NULL;
+}
+
+// watched pages among those just mapped again go back to being trapped
+static void debug_trap_pages(i8080_t* state, const int first, const int count) {
+  if (!state->debug)
+    return;
+
+  for (int i = 0; i < count && first + i < I8080_PAGE_COUNT; i++) {
+    if (state->debug->watch_counts[first + i])
+      debug_trap_page(state, first + i);
+  }
+}
+
+// host memory of a page for reading, also while it is watched
+static inline uint8_t* host_read_page(const i8080_t* state, const int page) {
+  if (state->debug && state->debug->watch_counts[page])
+    return state->debug->saved_read_pages[page];
+
+  return state->read_pages[page];
+}
+
+// write handler of read-only pages
+static void discard_write(void* context,
+                          const uint16_t address,
+                          const uint8_t byte) {}
+
+void i8080_map_memory(i8080_t* state,
+                      const uint16_t address,
+                      const uint32_t size,
+                      uint8_t* memory,
+                      const bool writable) {
+  const int first = address / I8080_PAGE_SIZE;
+  const int count = (size + I8080_PAGE_SIZE - 1) / I8080_PAGE_SIZE;
+
+  for (int i = 0; i < count && first + i < I8080_PAGE_COUNT; i++) {
+    uint8_t* page = &memory[i * I8080_PAGE_SIZE];
+
+#ifdef I8080_JIT
+    jit_forget_page(state, first + i);
+#endif
+#ifdef I8080_BLOCK_CACHE
+    block_cache_forget_page(state, first + i);
+#endif
+
+    state->read_pages[first + i] = page;
+    state->write_pages[first + i] = writable ? page : NULL;
+    state->dirty_pages[first + i] = 1;
+    state->page_handlers[first + i] =
+        (i8080_page_handler_t){NULL, writable ? NULL : discard_write, NULL};
+  }
+
+  debug_trap_pages(state, first, count);
+  update_fetch_pages(state, first, count);
+}
+
+void i8080_map_handler(i8080_t* state,
+                       const uint16_t address,
+                       const uint32_t size,
+                       const i8080_page_handler_t handler) {
+  const int first = address / I8080_PAGE_SIZE;
+  const int count = (size + I8080_PAGE_SIZE - 1) / I8080_PAGE_SIZE;
+
+  for (int i = 0; i < count && first + i < I8080_PAGE_COUNT; i++) {
+#ifdef I8080_JIT
+    jit_forget_page(state, first + i);
+#endif
+#ifdef I8080_BLOCK_CACHE
+    block_cache_forget_page(state, first + i);
+#endif
+
+    state->read_pages[first + i] = NULL;
+    state->write_pages[first + i] = NULL;
+    state->page_handlers[first + i] = handler;
+    state->dirty_pages[first + i] = 1;
+  }
+
+  debug_trap_pages(state, first, count);
+  update_fetch_pages(state, first, count);
+}
+
+// turns a copy-on-write page into ram at its address in external_memory,
+// holding the same bytes
+static uint8_t* own_page(i8080_t* state, const int page) {
+  uint8_t* ram = &state->external_memory[page * I8080_PAGE_SIZE];
+
+  memcpy(ram, host_read_page(state, page), I8080_PAGE_SIZE);
+  i8080_map_memory(state, page * I8080_PAGE_SIZE, I8080_PAGE_SIZE, ram, true);
+
+  return ram;
+}
+
+// write handler of pages mapped by i8080_map_image, context is the machine
+static void copy_on_write(void* context,
+                          const uint16_t address,
+                          const uint8_t byte) {
+  i8080_t* state = context;
+
+  if (state->external_memory)  // nowhere to copy to otherwise, acts as rom
+    own_page(state, address / I8080_PAGE_SIZE)[address % I8080_PAGE_SIZE] =
+        byte;
+}
+
+void i8080_map_image(i8080_t* state,
+                     const uint16_t address,
+                     const uint32_t size,
+                     const uint8_t* image) {
+  const int first = address / I8080_PAGE_SIZE;
+  const int count = (size + I8080_PAGE_SIZE - 1) / I8080_PAGE_SIZE;
+
+  for (int i = 0; i < count && first + i < I8080_PAGE_COUNT; i++) {
+#ifdef I8080_JIT
+    jit_forget_page(state, first + i);
+#endif
+#ifdef I8080_BLOCK_CACHE
+    block_cache_forget_page(state, first + i);
+#endif
+
+    // only ever read, writes go to the copy
+    state->read_pages[first + i] = (uint8_t*)&image[i * I8080_PAGE_SIZE];
+    state->write_pages[first + i] = NULL;
+    state->dirty_pages[first + i] = 1;
+    state->page_handlers[first + i] =
+        (i8080_page_handler_t){NULL, copy_on_write, state};
+  }
+
+  debug_trap_pages(state, first, count);
+  update_fetch_pages(state, first, count);
+}
+
+void i8080_attach_memory(i8080_t* state, uint8_t* memory) {
+  state->external_memory = memory;
+  state->memory_mirrored = 0;
+
+  i8080_map_memory(state, 0x0000, I8080_MAX_MEMORY, memory, true);
+}
+
+// 64 KiB of a memfd followed by its first host page mapped again, NULL if the
+// host doesn't go along
+static uint8_t* alloc_mirrored(const size_t mirror) {
+  if (mirror > I8080_MAX_MEMORY)
+    return NULL;
+
+  const int fd = memfd_create("i8080", MFD_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+
+  // reserve the whole range first so both mappings land next to each other
+  uint8_t* memory = MAP_FAILED;
+  if (ftruncate(fd, I8080_MAX_MEMORY) == 0)
+    memory = mmap(NULL, I8080_MAX_MEMORY + mirror, PROT_NONE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory != MAP_FAILED &&
+      (mmap(memory, I8080_MAX_MEMORY, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+       mmap(memory + I8080_MAX_MEMORY, mirror, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)) {
+    munmap(memory, I8080_MAX_MEMORY + mirror);
+    memory = MAP_FAILED;
+  }
+
+  close(fd);  // the mappings keep it
+
+  return memory == MAP_FAILED ? NULL : memory;
+}
+
+bool i8080_alloc_memory(i8080_t* state) {
+  uint8_t* memory = alloc_mirrored(sysconf(_SC_PAGESIZE));
+
+  if (memory) {
+    state->memory_mirrored = 1;
+    state->external_memory = memory;
+    i8080_map_memory(state, 0x0000, I8080_MAX_MEMORY, memory, true);
+    return true;
+  }
+
+  memory = calloc(1, I8080_MAX_MEMORY);
+  if (!memory)
+    return false;
+
+  i8080_attach_memory(state, memory);
+
+  return true;
+}
+
+void i8080_free_memory(i8080_t* state) {
+  if (state->memory_mirrored)
+    munmap(state->external_memory, I8080_MAX_MEMORY + sysconf(_SC_PAGESIZE));
+  else
+    free(state->external_memory);
 
   state->external_memory = NULL;
+  state->memory_mirrored = 0;
+}
+
+// access to a watched page, stops the run when address is watched for kind
+// (I8080_STOP_WATCH_READ or I8080_STOP_WATCH_WRITE). returns the page's own
+// host memory, NULL when it goes through page_handlers
+static uint8_t* debug_access(i8080_t* state,
+                             const uint16_t address,
+                             const i8080_stop_reason_t kind) {
+  i8080_debug_t* debug = state->debug;
+  const bool write = kind == I8080_STOP_WATCH_WRITE;
+
+  if (!debug->quiet && !state->stop &&
+      bit_set(write ? debug->watch_writes : debug->watch_reads, address)) {
+    debug->hit = address;
+    state->stop = kind;
+    state->run_deadline = 0;  // as i8080_stop
+  }
+
+  return (write ? debug->saved_write_pages
+                : debug->saved_read_pages)[address / I8080_PAGE_SIZE];
+}
+
+// page without host memory: callback, or external_memory if nothing is mapped
+__attribute__((noinline, cold)) static uint8_t read_byte_slow(
+    i8080_t* state,
+    const uint16_t address) {
+  const i8080_page_handler_t* handler =
+      &state->page_handlers[address / I8080_PAGE_SIZE];
+
+  if (state->debug && state->debug->watch_counts[address / I8080_PAGE_SIZE]) {
+    const uint8_t* memory = debug_access(state, address, I8080_STOP_WATCH_READ);
+    if (memory)
+      return memory[address % I8080_PAGE_SIZE];
+  }
+
+  if (handler->read)
+    return handler->read(handler->context, address);
+  if (!handler->write && state->external_memory)
+    return state->external_memory[address];
+
+  return 0xff;  // nothing drives the bus
+}
+
+__attribute__((noinline, cold)) static void write_byte_slow(
+    i8080_t* state,
+    const uint16_t address,
+    const uint8_t byte) {
+  const i8080_page_handler_t* handler =
+      &state->page_handlers[address / I8080_PAGE_SIZE];
+
+  state->dirty_pages[address / I8080_PAGE_SIZE] = 1;
+
+  if (state->debug && state->debug->watch_counts[address / I8080_PAGE_SIZE]) {
+    uint8_t* memory = debug_access(state, address, I8080_STOP_WATCH_WRITE);
+    if (memory) {
+      memory[address % I8080_PAGE_SIZE] = byte;
+      return;
+    }
+  }
+
+#ifdef I8080_JIT
+  // ram pages holding translated code have their direct write pointer taken
+  // away, see jit_trap_page
+  if (state->jit && state->jit->trapped_pages[address / I8080_PAGE_SIZE]) {
+    jit_write(state, address, byte);
+    return;
+  }
+#endif
+#ifdef I8080_BLOCK_CACHE
+  // same for pages holding decoded blocks, see block_decode
+  if (state->block_cache &&
+      state->block_cache->trapped_pages[address / I8080_PAGE_SIZE]) {
+    block_cache_write(state, address, byte);
+    return;
+  }
+#endif
+
+  if (handler->write)
+    handler->write(handler->context, address, byte);
+  else if (!handler->read && state->external_memory)
+    state->external_memory[address] = byte;
+}
+
+// fast path of i8080_read_byte, inlined into the instruction handlers
+__attribute__((always_inline)) static inline uint8_t read_byte(
+    i8080_t* state,
+    const uint16_t address) {
+  const uint8_t* page = state->read_pages[address / I8080_PAGE_SIZE];
+
+  if (__builtin_expect(page != NULL, 1))
+    return page[address % I8080_PAGE_SIZE];
+
+  return read_byte_slow(state, address);
+}
+
+// fast path of i8080_write_byte, inlined into the instruction handlers
+__attribute__((always_inline)) static inline void write_byte(
+    i8080_t* state,
+    const uint16_t address,
+    const uint8_t byte) {
+  uint8_t* page = state->write_pages[address / I8080_PAGE_SIZE];
+
+#ifdef I8080_TRACE
+  if (state->trace)
+    trace_write(state, address, byte);
+#endif
+#ifdef I8080_CHECK_HOOKS
+  if (state->check_hooks)
+    check_write(state, address, byte);
+#endif
+
+  if (__builtin_expect(page != NULL, 1)) {
+    page[address % I8080_PAGE_SIZE] = byte;
+    state->dirty_pages[address / I8080_PAGE_SIZE] = 1;
+  } else {
+    write_byte_slow(state, address, byte);
+  }
+}
+
+__attribute__((noinline, cold)) static uint16_t read_word_slow(
+    i8080_t* state,
+    const uint16_t address) {
+  const uint8_t low = read_byte(state, address);
+
+  return (read_byte(state, address + 1) << 8) | low;
+}
+
+__attribute__((noinline, cold)) static void write_word_slow(
+    i8080_t* state,
+    const uint16_t address,
+    const uint16_t word) {
+  write_byte(state, address, word & 0xff);
+  write_byte(state, address + 1, word >> 8);
+}
+
+// 16-bit accesses, low byte at address. a single page check covers both bytes
+// when they share a directly mapped page, so the fast path has no call in it
+__attribute__((always_inline)) static inline uint16_t read_word(
+    i8080_t* state,
+    const uint16_t address) {
+  const uint8_t* page = state->read_pages[address / I8080_PAGE_SIZE];
+  const uint8_t offset = address % I8080_PAGE_SIZE;
+
+  if (__builtin_expect(page && offset != I8080_PAGE_SIZE - 1, 1))
+    return (page[offset + 1] << 8) | page[offset];
+
+  return read_word_slow(state, address);
+}
+
+__attribute__((always_inline)) static inline void write_word(
+    i8080_t* state,
+    const uint16_t address,
+    const uint16_t word) {
+  uint8_t* page = state->write_pages[address / I8080_PAGE_SIZE];
+  const uint8_t offset = address % I8080_PAGE_SIZE;
+
+  if (__builtin_expect(page && offset != I8080_PAGE_SIZE - 1, 1)) {
+#ifdef I8080_TRACE
+    if (state->trace) {
+      trace_write(state, address, word & 0xff);
+      trace_write(state, address + 1, word >> 8);
+    }
+#endif
+#ifdef I8080_CHECK_HOOKS
+    if (state->check_hooks) {
+      check_write(state, address, word & 0xff);
+      check_write(state, address + 1, word >> 8);
+    }
+#endif
+    page[offset] = word & 0xff;
+    page[offset + 1] = word >> 8;
+    state->dirty_pages[address / I8080_PAGE_SIZE] = 1;
+  } else {
+    write_word_slow(state, address, word);
+  }
+}
+
+// reads memory reference M (byte at address made up of HL reg. pair)
+static uint8_t read_m(i8080_t* state) {
+  return read_byte(state, (state->h << 8) | state->l);
+}
+
+// writes memory reference M (byte at address made up of HL reg. pair)
+static void write_m(i8080_t* state, const uint8_t byte) {
+  write_byte(state, (state->h << 8) | state->l, byte);
 }
 
 uint8_t i8080_read_byte(i8080_t* state, const uint16_t address) {
-  return state->external_memory[address];
+  return read_byte(state, address);
 }
 
 void i8080_write_byte(i8080_t* state,
                       const uint16_t address,
                       const uint8_t byte) {
-  state->external_memory[address] = byte;
+  write_byte(state, address, byte);
 }
 
-void i8080_interrupt(i8080_t* state, uint8_t low, uint8_t high) {
-  // current pc pushed to stack to continue execution when interrupt is finished
-  i8080_write_byte(state, state->sp - 1, state->pc >> 8);
-  i8080_write_byte(state, state->sp - 2, state->pc & 0xff);
+// page contents, shared by all snapshots in which the page has them. the
+// counts are atomic as machines on different threads may share snapshots
+typedef struct {
+  _Atomic int references;
+  uint8_t bytes[I8080_PAGE_SIZE];
+} snapshot_page_t;
+
+struct i8080_snapshot_t {
+  _Atomic int references;  // the owner's and machines tracked against it
+  uint8_t cpu[offsetof(i8080_t, external_memory)];  // start of i8080_t
+  i8080_event_t events[I8080_MAX_EVENTS];
+  int event_count;
+  snapshot_page_t* pages[I8080_PAGE_COUNT];  // NULL where there is no ram
+  int device_count;
+  size_t device_sizes[I8080_MAX_DEVICES];
+  uint8_t devices[];  // saved device state, one after another
+};
+
+// host memory of a ram page, NULL for rom and pages behind handlers. that of
+// a copy-on-write page is the image, only good for reading
+static uint8_t* ram_page(const i8080_t* state, const int page) {
+  const i8080_page_handler_t* handler = &state->page_handlers[page];
+  uint8_t* memory = host_read_page(state, page);
+
+  if (memory) {
+    if (handler->write == discard_write ||
+        (handler->write == copy_on_write && !state->external_memory))
+      return NULL;
+    return memory;
+  }
+  if (!handler->read && !handler->write && state->external_memory)
+    return &state->external_memory[page * I8080_PAGE_SIZE];
+
+  return NULL;
+}
+
+static void snapshot_release(i8080_snapshot_t* snapshot) {
+  if (!snapshot || atomic_fetch_sub(&snapshot->references, 1) > 1)
+    return;
+
+  for (int page = 0; page < I8080_PAGE_COUNT; page++) {
+    snapshot_page_t* saved = snapshot->pages[page];
+    if (saved && atomic_fetch_sub(&saved->references, 1) == 1)
+      free(saved);
+  }
+  free(snapshot);
+}
+
+// memory now matches snapshot, dirty pages are counted from here
+static void snapshot_track(i8080_t* state, i8080_snapshot_t* snapshot) {
+  atomic_fetch_add(&snapshot->references, 1);
+  snapshot_release(state->snapshot);
+  state->snapshot = snapshot;
+  memset(state->dirty_pages, 0, sizeof(state->dirty_pages));
+}
+
+i8080_snapshot_t* i8080_snapshot(i8080_t* state) {
+  size_t device_size = 0;
+  for (int i = 0; i < state->device_count; i++)
+    device_size += state->devices[i].size;
+
+  i8080_snapshot_t* snapshot = calloc(1, sizeof(*snapshot) + device_size);
+  if (!snapshot)
+    return NULL;
+  atomic_init(&snapshot->references, 1);
+
+  // pages the guest didn't touch are shared with the last snapshot
+  const i8080_snapshot_t* last = state->snapshot;
+  for (int page = 0; page < I8080_PAGE_COUNT; page++) {
+    const uint8_t* memory = ram_page(state, page);
+    if (!memory)
+      continue;
+
+    if (last && last->pages[page] && !state->dirty_pages[page]) {
+      snapshot->pages[page] = last->pages[page];
+      atomic_fetch_add(&snapshot->pages[page]->references, 1);
+      continue;
+    }
+
+    snapshot_page_t* saved = malloc(sizeof(*saved));
+    if (!saved) {
+      snapshot_release(snapshot);
+      return NULL;
+    }
+    atomic_init(&saved->references, 1);
+    memcpy(saved->bytes, memory, I8080_PAGE_SIZE);
+    snapshot->pages[page] = saved;
+  }
+
+  memcpy(snapshot->cpu, state, sizeof(snapshot->cpu));
+  memcpy(snapshot->events, state->events,
+         state->event_count * sizeof(i8080_event_t));
+  snapshot->event_count = state->event_count;
+
+  uint8_t* device = snapshot->devices;
+  for (int i = 0; i < state->device_count; i++) {
+    state->devices[i].save(state->devices[i].context, device);
+    snapshot->device_sizes[i] = state->devices[i].size;
+    device += state->devices[i].size;
+  }
+  snapshot->device_count = state->device_count;
+
+  snapshot_track(state, snapshot);
+
+  return snapshot;
+}
+
+void i8080_restore(i8080_t* state, i8080_snapshot_t* snapshot) {
+  const i8080_snapshot_t* last = state->snapshot;
+
+  for (int page = 0; page < I8080_PAGE_COUNT; page++) {
+    const snapshot_page_t* saved = snapshot->pages[page];
+    uint8_t* memory = ram_page(state, page);
+    if (!saved || !memory)
+      continue;
+    if (last && last->pages[page] == saved && !state->dirty_pages[page])
+      continue;  // holds these bytes already
+    if (state->page_handlers[page].write == copy_on_write)
+      memory = own_page(state, page);
+
+    memcpy(memory, saved->bytes, I8080_PAGE_SIZE);
+#ifdef I8080_JIT
+    jit_forget_page(state, page);
+#endif
+#ifdef I8080_BLOCK_CACHE
+    block_cache_forget_page(state, page);
+#endif
+  }
+
+  memcpy(state, snapshot->cpu, sizeof(snapshot->cpu));
+  memcpy(state->events, snapshot->events,
+         snapshot->event_count * sizeof(i8080_event_t));
+  state->event_count = snapshot->event_count;
+  state->run_deadline = 0;  // a batch run loop has to look at all of it again
+
+  if (state->replay)
+    replay_seek(state);
+
+  // devices attached since the snapshot was taken keep their state
+  const uint8_t* device = snapshot->devices;
+  for (int i = 0; i < snapshot->device_count && i < state->device_count; i++) {
+    if (state->devices[i].size == snapshot->device_sizes[i])
+      state->devices[i].restore(state->devices[i].context, device);
+    device += snapshot->device_sizes[i];
+  }
+
+  snapshot_track(state, snapshot);
+}
+
+void i8080_snapshot_free(i8080_snapshot_t* snapshot) {
+  snapshot_release(snapshot);
+}
+
+void i8080_snapshot_forget(i8080_t* state) {
+  snapshot_release(state->snapshot);
+  state->snapshot = NULL;
+  memset(state->dirty_pages, 1, sizeof(state->dirty_pages));
+}
+
+bool i8080_attach_device(i8080_t* state, const i8080_device_state_t device) {
+  if (state->device_count == I8080_MAX_DEVICES)
+    return false;
+
+  state->devices[state->device_count++] = device;
+
+  return true;
+}
+
+void i8080_memory_written(i8080_t* state,
+                          const uint16_t address,
+                          const uint32_t size) {
+  const int first = address / I8080_PAGE_SIZE;
+  const int last = (address + size - 1) / I8080_PAGE_SIZE;
+
+  for (int page = first; size && page <= last && page < I8080_PAGE_COUNT;
+       page++) {
+    state->dirty_pages[page] = 1;
+#ifdef I8080_JIT
+    jit_forget_page(state, page);
+#endif
+#ifdef I8080_BLOCK_CACHE
+    block_cache_forget_page(state, page);
+#endif
+  }
+}
+
+// a byte of an instruction, from host memory where the page has some, watched
+// or not, and through the bus otherwise
+static uint8_t fetch_byte(i8080_t* state, const uint16_t address) {
+  const uint8_t* page = host_read_page(state, address / I8080_PAGE_SIZE);
+
+  return page ? page[address % I8080_PAGE_SIZE] : read_byte(state, address);
+}
+
+// pages without fetch_pages: still direct when the instruction doesn't run past
+// the page, watched ones too, otherwise its bytes are gathered into buffer (3
+// bytes) so handlers only see the bytes that belong to the instruction
+__attribute__((noinline)) static const uint8_t* fetch_slow(i8080_t* state,
+                                                          uint8_t* buffer) {
+  const uint16_t pc = state->pc;
+  const uint8_t* page = host_read_page(state, pc / I8080_PAGE_SIZE);
+  const int offset = pc % I8080_PAGE_SIZE;
+
+  if (page && offset + OPCODE_LENGTHS[page[offset]] <= I8080_PAGE_SIZE)
+    return &page[offset];
+
+  buffer[0] = fetch_byte(state, pc);
+  for (int i = 1; i < OPCODE_LENGTHS[buffer[0]]; i++)
+    buffer[i] = fetch_byte(state, pc + i);
+
+  return buffer;
+}
+
+// returns the instruction at pc. a single lookup finds it in host memory in
+// pages followed by their next page (fetch_pages), which covers instructions
+// that cross into it, 0xffff into 0x0000 too with i8080_alloc_memory
+__attribute__((always_inline)) static inline const uint8_t* fetch(
+    i8080_t* state,
+    uint8_t* buffer) {
+  const uint16_t pc = state->pc;
+  const uint8_t* page = state->fetch_pages[pc / I8080_PAGE_SIZE];
+
+  if (__builtin_expect(page != NULL, 1))
+    return &page[pc % I8080_PAGE_SIZE];
+
+  return fetch_slow(state, buffer);
+}
+
+// pushes return address onto stack and jumps to address, shared by RST and
+// accepted interrupts
+static void restart(i8080_t* state,
+                    const uint16_t ret,
+                    const uint16_t address) {
+  write_word(state, state->sp - 2, ret);
 
   state->sp -= 2;
 
-  state->pc = (high << 8) | low;
+  state->pc = address;
+}
+
+static void request_interrupt(i8080_t* state, const uint16_t vector) {
+  state->irq_pending = 1;
+  state->irq_vector = vector;
+
+  // stops a running batch loop so the request is looked at right away
+  state->run_deadline = 0;
+}
+
+void i8080_interrupt(i8080_t* state, uint8_t low, uint8_t high) {
+  if (state->replay && !replay_request(state, (high << 8) | low))
+    return;
+
+  request_interrupt(state, (high << 8) | low);
+}
+
+static inline bool interrupt_ready(const i8080_t* state) {
+  return state->irq_pending && state->ie && !state->ei_delay;
+}
+
+// the interrupting device supplies an RST, which is executed in place of the
+// next instruction
+static void accept_interrupt(i8080_t* state) {
+  state->irq_pending = 0;
+  state->ie = 0;
+  state->halted = 0;
+
+  state->cycles += OPCODE_CYCLES[0xc7];
+
+#ifdef I8080_TRACE
+  if (state->trace)
+    trace_begin(state);
+#endif
+
+  // current pc pushed to stack to continue execution when interrupt is finished
+  restart(state, state->pc, state->irq_vector);
+
+#ifdef I8080_TRACE
+  if (state->trace)
+    trace_end(state, state->pc, NULL);
+#endif
+#ifdef I8080_PROFILE
+  if (state->profile)
+    profile_interrupt(state);
+#endif
 }
 
 void i8080_stc(i8080_t* state) {
+  flags_sync(state);
+
   state->cb.flags.c = 1;
 
   state->pc++;
 }
 
 void i8080_cmc(i8080_t* state) {
+  flags_sync(state);
+
   state->cb.flags.c = ~state->cb.flags.c;
 
   state->pc++;
@@ -152,8 +1273,8 @@ void i8080_cmc(i8080_t* state) {
 void i8080_inr(i8080_t* state, uint8_t* reg) {
   const uint8_t res = *reg + 1;
 
-  state->cb.flags.ac = ((0x0f & res) == 0);
-  set_flags_zsp(state, res);
+  flags_sync(state);  // carry survives
+  set_flags(state, FLAGS_INR, *reg, 1, res);
 
   *reg = res;
   state->pc++;
@@ -162,8 +1283,8 @@ void i8080_inr(i8080_t* state, uint8_t* reg) {
 void i8080_dcr(i8080_t* state, uint8_t* reg) {
   const uint8_t res = *reg - 1;
 
-  state->cb.flags.ac = !((0x0f & res) == 0x0f);
-  set_flags_zsp(state, res);
+  flags_sync(state);  // carry survives
+  set_flags(state, FLAGS_DCR, *reg, 1, res);
 
   *reg = res;
   state->pc++;
@@ -176,6 +1297,8 @@ void i8080_cma(i8080_t* state) {
 }
 
 void i8080_daa(i8080_t* state) {
+  flags_sync(state);
+
   bool carry = state->cb.flags.c;
   uint8_t value_to_add = 0;
 
@@ -192,6 +1315,7 @@ void i8080_daa(i8080_t* state) {
 
   state->a = add_bytes_set_flags(state, state->a, value_to_add, 0);
 
+  flags_sync(state);
   state->cb.flags.c = carry;
 
   state->pc++;
@@ -201,6 +1325,15 @@ void i8080_nop(i8080_t* state) {
   state->pc++;
 }
 
+void i8080_hlt(i8080_t* state) {
+  state->halted = 1;
+
+  // ends the batch inner loop, which then idles until an event
+  state->run_deadline = 0;
+
+  state->pc++;  // an accepted interrupt returns after the HLT
+}
+
 void i8080_mov(i8080_t* state, uint8_t* dst, const uint8_t* src) {
   *dst = *src;
 
@@ -210,7 +1343,7 @@ void i8080_mov(i8080_t* state, uint8_t* dst, const uint8_t* src) {
 void i8080_stax(i8080_t* state, const regpair_t pair) {
   const uint16_t address = (*pair.first << 8) | *pair.second;
 
-  i8080_write_byte(state, address, state->a);
+  write_byte(state, address, state->a);
 
   state->pc++;
 }
@@ -218,7 +1351,7 @@ void i8080_stax(i8080_t* state, const regpair_t pair) {
 void i8080_ldax(i8080_t* state, const regpair_t pair) {
   const uint16_t address = (*pair.first << 8) | *pair.second;
 
-  state->a = i8080_read_byte(state, address);
+  state->a = read_byte(state, address);
 
   state->pc++;
 }
@@ -230,6 +1363,7 @@ void i8080_add(i8080_t* state, const uint8_t* reg) {
 }
 
 void i8080_adc(i8080_t* state, const uint8_t* reg) {
+  flags_sync(state);
   state->a = add_bytes_set_flags(state, state->a, *reg, state->cb.flags.c);
 
   state->pc++;
@@ -242,6 +1376,7 @@ void i8080_sub(i8080_t* state, const uint8_t* reg) {
 }
 
 void i8080_sbb(i8080_t* state, const uint8_t* reg) {
+  flags_sync(state);
   state->a = sub_bytes_set_flags(state, state->a, *reg, state->cb.flags.c);
 
   state->pc++;
@@ -250,30 +1385,26 @@ void i8080_sbb(i8080_t* state, const uint8_t* reg) {
 void i8080_ana(i8080_t* state, const uint8_t* reg) {
   const uint8_t result = state->a & *reg;
 
-  state->cb.flags.c = 0;  // reset
-  state->cb.flags.ac = (0x08 & (state->a | *reg)) != 0;
-  set_flags_zsp(state, result);
+  set_flags(state, FLAGS_ANA, state->a, *reg, result);
 
   state->a = result;
   state->pc++;
 }
 
 void i8080_xra(i8080_t* state, const uint8_t* reg) {
+  const uint8_t lhs = state->a;
   state->a = state->a ^ *reg;
 
-  state->cb.flags.c = 0;   // reset
-  state->cb.flags.ac = 0;  // reset
-  set_flags_zsp(state, state->a);
+  set_flags(state, FLAGS_LOGIC, lhs, *reg, state->a);
 
   state->pc++;
 }
 
 void i8080_ora(i8080_t* state, const uint8_t* reg) {
+  const uint8_t lhs = state->a;
   state->a = state->a | *reg;
 
-  state->cb.flags.c = 0;   // reset
-  state->cb.flags.ac = 0;  // reset
-  set_flags_zsp(state, state->a);
+  set_flags(state, FLAGS_LOGIC, lhs, *reg, state->a);
 
   state->pc++;
 }
@@ -285,6 +1416,8 @@ void i8080_cmp(i8080_t* state, const uint8_t* reg) {
 }
 
 void i8080_rlc(i8080_t* state) {
+  flags_sync(state);
+
   bool hbit = (0x80 & state->a) != 0;
 
   state->a = (state->a << 1) | hbit;
@@ -295,6 +1428,8 @@ void i8080_rlc(i8080_t* state) {
 }
 
 void i8080_rrc(i8080_t* state) {
+  flags_sync(state);
+
   bool lbit = (0x01 & state->a) != 0;
 
   state->a = (lbit << 7) | (state->a >> 1);
@@ -305,6 +1440,8 @@ void i8080_rrc(i8080_t* state) {
 }
 
 void i8080_ral(i8080_t* state) {
+  flags_sync(state);
+
   bool hbit = (0x80 & state->a) != 0;
 
   state->a = (state->a << 1) | state->cb.flags.c;
@@ -315,6 +1452,8 @@ void i8080_ral(i8080_t* state) {
 }
 
 void i8080_rar(i8080_t* state) {
+  flags_sync(state);
+
   bool lbit = (0x01 & state->a) != 0;
 
   state->a = (state->cb.flags.c << 7) | (state->a >> 1);
@@ -327,36 +1466,27 @@ void i8080_rar(i8080_t* state) {
 void i8080_push(i8080_t* state, const regpair_t pair) {
   state->sp -= 2;
 
-  i8080_write_byte(state, state->sp, *pair.second);
-  i8080_write_byte(state, state->sp + 1, *pair.first);
+  write_word(state, state->sp, (*pair.first << 8) | *pair.second);
 
   state->pc++;
 }
 
 static void i8080_push_psw(i8080_t* state) {
-  uint8_t flags = 0x02;  // bit 1 always set
-  if (state->cb.flags.s)
-    flags |= 0x80;
-  if (state->cb.flags.z)
-    flags |= 0x40;
-  if (state->cb.flags.ac)
-    flags |= 0x10;
-  if (state->cb.flags.p)
-    flags |= 0x04;
-  if (state->cb.flags.c)
-    flags |= 0x01;
+  flags_sync(state);
+
+  const uint8_t flags = state->cb.byte;  // already in PSW format
 
   state->sp -= 2;
 
-  i8080_write_byte(state, state->sp, flags);
-  i8080_write_byte(state, state->sp + 1, state->a);
+  write_word(state, state->sp, (state->a << 8) | flags);
 
   state->pc++;
 }
 
 void i8080_pop(i8080_t* state, regpair_t pair) {
-  *pair.second = i8080_read_byte(state, state->sp);
-  *pair.first = i8080_read_byte(state, state->sp + 1);
+  const uint16_t word = read_word(state, state->sp);
+  *pair.second = word & 0xff;
+  *pair.first = word >> 8;
 
   state->sp += 2;
 
@@ -364,17 +1494,14 @@ void i8080_pop(i8080_t* state, regpair_t pair) {
 }
 
 void i8080_pop_psw(i8080_t* state) {
-  uint8_t flags = i8080_read_byte(state, state->sp);
-  state->cb.flags.s = (flags & 0x80) != 0;
-  state->cb.flags.z = (flags & 0x40) != 0;
-  state->cb.flags.ac = (flags & 0x10) != 0;
-  state->cb.flags.p = (flags & 0x04) != 0;
-  state->cb.flags.c = (flags & 0x01) != 0;
-  state->cb.flags.bit5 = 0;
-  state->cb.flags.bit3 = 0;
-  state->cb.flags.bit1 = 1;
-
-  state->a = i8080_read_byte(state, state->sp + 1);
+  flags_sync(state);
+
+  const uint16_t word = read_word(state, state->sp);
+  const uint8_t flags = word & 0xff;
+  state->cb.byte = (flags & (FLAG_S | FLAG_Z | FLAG_AC | FLAG_P | FLAG_C)) |
+                   FLAG_BIT1;  // bits 5 and 3 always 0, bit 1 always 1
+
+  state->a = word >> 8;
 
   state->sp += 2;
 
@@ -382,6 +1509,8 @@ void i8080_pop_psw(i8080_t* state) {
 }
 
 void i8080_dad(i8080_t* state, const uint16_t addend) {
+  flags_sync(state);
+
   const uint16_t hl = (state->h << 8) | state->l;
 
   const uint32_t result = hl + addend;
@@ -440,11 +1569,11 @@ void i8080_xthl(i8080_t* state) {
   uint8_t temp1 = state->l;
   uint8_t temp2 = state->h;
 
-  state->l = i8080_read_byte(state, state->sp);
-  state->h = i8080_read_byte(state, state->sp + 1);
+  const uint16_t word = read_word(state, state->sp);
+  state->l = word & 0xff;
+  state->h = word >> 8;
 
-  i8080_write_byte(state, state->sp, temp1);
-  i8080_write_byte(state, state->sp + 1, temp2);
+  write_word(state, state->sp, (temp2 << 8) | temp1);
 
   state->pc++;
 }
@@ -483,6 +1612,7 @@ void i8080_adi(i8080_t* state, const uint8_t byte) {
 }
 
 void i8080_aci(i8080_t* state, const uint8_t byte) {
+  flags_sync(state);
   state->a = add_bytes_set_flags(state, state->a, byte, state->cb.flags.c);
 
   state->pc += 2;
@@ -495,6 +1625,7 @@ void i8080_sui(i8080_t* state, const uint8_t byte) {
 }
 
 void i8080_sbi(i8080_t* state, const uint8_t byte) {
+  flags_sync(state);
   state->a = sub_bytes_set_flags(state, state->a, byte, state->cb.flags.c);
 
   state->pc += 2;
@@ -503,30 +1634,26 @@ void i8080_sbi(i8080_t* state, const uint8_t byte) {
 void i8080_ani(i8080_t* state, const uint8_t byte) {
   const uint8_t result = state->a & byte;
 
-  state->cb.flags.c = 0;  // reset
-  state->cb.flags.ac = (0x08 & (state->a | byte)) != 0;
-  set_flags_zsp(state, result);
+  set_flags(state, FLAGS_ANA, state->a, byte, result);
 
   state->a = result;
   state->pc += 2;
 }
 
 void i8080_xri(i8080_t* state, const uint8_t byte) {
+  const uint8_t lhs = state->a;
   state->a = state->a ^ byte;
 
-  state->cb.flags.c = 0;   // reset
-  state->cb.flags.ac = 0;  // reset
-  set_flags_zsp(state, state->a);
+  set_flags(state, FLAGS_LOGIC, lhs, byte, state->a);
 
   state->pc += 2;
 }
 
 void i8080_ori(i8080_t* state, uint8_t byte) {
+  const uint8_t lhs = state->a;
   state->a = state->a | byte;
 
-  state->cb.flags.c = 0;   // reset
-  state->cb.flags.ac = 0;  // reset
-  set_flags_zsp(state, state->a);
+  set_flags(state, FLAGS_LOGIC, lhs, byte, state->a);
 
   state->pc += 2;
 }
@@ -540,7 +1667,7 @@ void i8080_cpi(i8080_t* state, uint8_t byte) {
 void i8080_sta(i8080_t* state, uint8_t low, uint8_t high) {
   const uint16_t address = (high << 8) | low;
 
-  i8080_write_byte(state, address, state->a);
+  write_byte(state, address, state->a);
 
   state->pc += 3;
 }
@@ -548,7 +1675,7 @@ void i8080_sta(i8080_t* state, uint8_t low, uint8_t high) {
 void i8080_lda(i8080_t* state, uint8_t low, uint8_t high) {
   const uint16_t address = (high << 8) | low;
 
-  state->a = i8080_read_byte(state, address);
+  state->a = read_byte(state, address);
 
   state->pc += 3;
 }
@@ -556,8 +1683,7 @@ void i8080_lda(i8080_t* state, uint8_t low, uint8_t high) {
 void i8080_shld(i8080_t* state, uint8_t low, uint8_t high) {
   const uint16_t address = (high << 8) | low;
 
-  i8080_write_byte(state, address, state->l);
-  i8080_write_byte(state, address + 1, state->h);
+  write_word(state, address, (state->h << 8) | state->l);
 
   state->pc += 3;
 }
@@ -565,8 +1691,9 @@ void i8080_shld(i8080_t* state, uint8_t low, uint8_t high) {
 void i8080_lhld(i8080_t* state, uint8_t low, uint8_t high) {
   const uint16_t address = (high << 8) | low;
 
-  state->l = i8080_read_byte(state, address);
-  state->h = i8080_read_byte(state, address + 1);
+  const uint16_t word = read_word(state, address);
+  state->l = word & 0xff;
+  state->h = word >> 8;
 
   state->pc += 3;
 }
@@ -589,34 +1716,42 @@ static void i8080_cond_jmp(i8080_t* state,
 }
 
 void i8080_jc(i8080_t* state, uint8_t low, uint8_t high) {
+  flags_sync(state);
   i8080_cond_jmp(state, low, high, state->cb.flags.c);
 }
 
 void i8080_jnc(i8080_t* state, uint8_t low, uint8_t high) {
+  flags_sync(state);
   i8080_cond_jmp(state, low, high, !state->cb.flags.c);
 }
 
 void i8080_jz(i8080_t* state, uint8_t low, uint8_t high) {
+  flags_sync(state);
   i8080_cond_jmp(state, low, high, state->cb.flags.z);
 }
 
 void i8080_jnz(i8080_t* state, uint8_t low, uint8_t high) {
+  flags_sync(state);
   i8080_cond_jmp(state, low, high, !state->cb.flags.z);
 }
 
 void i8080_jm(i8080_t* state, uint8_t low, uint8_t high) {
+  flags_sync(state);
   i8080_cond_jmp(state, low, high, state->cb.flags.s);
 }
 
 void i8080_jp(i8080_t* state, uint8_t low, uint8_t high) {
+  flags_sync(state);
   i8080_cond_jmp(state, low, high, !state->cb.flags.s);
 }
 
 void i8080_jpe(i8080_t* state, uint8_t low, uint8_t high) {
+  flags_sync(state);
   i8080_cond_jmp(state, low, high, state->cb.flags.p);
 }
 
 void i8080_jpo(i8080_t* state, uint8_t low, uint8_t high) {
+  flags_sync(state);
   i8080_cond_jmp(state, low, high, !state->cb.flags.p);
 }
 
@@ -625,8 +1760,7 @@ void i8080_call(i8080_t* state, uint8_t low, uint8_t high) {
   const uint16_t next_pc = state->pc + 3;
 
   // return address (pc of next instr.) pushed to stack
-  i8080_write_byte(state, state->sp - 1, next_pc >> 8);
-  i8080_write_byte(state, state->sp - 2, next_pc & 0xff);
+  write_word(state, state->sp - 2, next_pc);
 
   state->sp -= 2;  // new sp pos.
 
@@ -645,42 +1779,48 @@ static void i8080_cond_call(i8080_t* state,
 }
 
 void i8080_cc(i8080_t* state, uint8_t low, uint8_t high) {
+  flags_sync(state);
   i8080_cond_call(state, low, high, state->cb.flags.c);
 }
 
 void i8080_cnc(i8080_t* state, uint8_t low, uint8_t high) {
+  flags_sync(state);
   i8080_cond_call(state, low, high, !state->cb.flags.c);
 }
 
 void i8080_cz(i8080_t* state, uint8_t low, uint8_t high) {
+  flags_sync(state);
   i8080_cond_call(state, low, high, state->cb.flags.z);
 }
 
 void i8080_cnz(i8080_t* state, uint8_t low, uint8_t high) {
+  flags_sync(state);
   i8080_cond_call(state, low, high, !state->cb.flags.z);
 }
 
 void i8080_cm(i8080_t* state, uint8_t low, uint8_t high) {
+  flags_sync(state);
   i8080_cond_call(state, low, high, state->cb.flags.s);
 }
 
 void i8080_cp(i8080_t* state, uint8_t low, uint8_t high) {
+  flags_sync(state);
   i8080_cond_call(state, low, high, !state->cb.flags.s);
 }
 
 void i8080_cpe(i8080_t* state, uint8_t low, uint8_t high) {
+  flags_sync(state);
   i8080_cond_call(state, low, high, state->cb.flags.p);
 }
 
 void i8080_cpo(i8080_t* state, uint8_t low, uint8_t high) {
+  flags_sync(state);
   i8080_cond_call(state, low, high, !state->cb.flags.p);
 }
 
 void i8080_ret(i8080_t* state) {
   // retrieve address from stack
-  uint8_t low = i8080_read_byte(state, state->sp);
-  uint8_t high = i8080_read_byte(state, state->sp + 1);
-  state->pc = (high << 8) | low;
+  state->pc = read_word(state, state->sp);
 
   state->sp += 2;  // pop address off stack
 }
@@ -694,68 +1834,78 @@ void i8080_cond_ret(i8080_t* state, bool cond) {
 }
 
 void i8080_rc(i8080_t* state) {
+  flags_sync(state);
   i8080_cond_ret(state, state->cb.flags.c);
 }
 
 void i8080_rnc(i8080_t* state) {
+  flags_sync(state);
   i8080_cond_ret(state, !state->cb.flags.c);
 }
 
 void i8080_rz(i8080_t* state) {
+  flags_sync(state);
   i8080_cond_ret(state, state->cb.flags.z);
 }
 
 void i8080_rnz(i8080_t* state) {
+  flags_sync(state);
   i8080_cond_ret(state, !state->cb.flags.z);
 }
 
 void i8080_rm(i8080_t* state) {
+  flags_sync(state);
   i8080_cond_ret(state, state->cb.flags.s);
 }
 
 void i8080_rp(i8080_t* state) {
+  flags_sync(state);
   i8080_cond_ret(state, !state->cb.flags.s);
 }
 
 void i8080_rpe(i8080_t* state) {
+  flags_sync(state);
   i8080_cond_ret(state, state->cb.flags.p);
 }
 
 void i8080_rpo(i8080_t* state) {
+  flags_sync(state);
   i8080_cond_ret(state, !state->cb.flags.p);
 }
 
 void i8080_rst(i8080_t* state, uint8_t rst_num) {
-  switch (rst_num) {
-    case 0:
-      i8080_interrupt(state, 0x00, 0x00);
-      break;  // RST 0 (0x00)
-    case 1:
-      i8080_interrupt(state, 0x08, 0x00);
-      break;  // RST 1 (0x08)
-    case 2:
-      i8080_interrupt(state, 0x10, 0x00);
-      break;  // RST 2 (0x10)
-    case 3:
-      i8080_interrupt(state, 0x18, 0x00);
-      break;  // RST 3 (0x18)
-    case 4:
-      i8080_interrupt(state, 0x20, 0x00);
-      break;  // RST 4 (0x20)
-    case 5:
-      i8080_interrupt(state, 0x28, 0x00);
-      break;  // RST 5 (0x28)
-    case 6:
-      i8080_interrupt(state, 0x30, 0x00);
-      break;  // RST 6 (0x30)
-    case 7:
-      i8080_interrupt(state, 0x38, 0x00);
-      break;  // RST 7 (0x38)
-  }
+  // RST n (0xc7 | n << 3) calls 8 * n, returning after itself
+  restart(state, state->pc + 1, rst_num * 8);
+}
+
+static uint8_t device_in(i8080_t* state, const uint8_t port) {
+  const i8080_port_handler_t* handler = &state->ports[port];
+
+  // nothing drives the data bus on ports without a device
+  return handler->in ? handler->in(handler->context, port) : 0xff;
+}
+
+void i8080_in(i8080_t* state, uint8_t port) {
+  state->a = state->replay ? replay_in(state, port) : device_in(state, port);
+
+  state->pc += 2;
+}
+
+void i8080_out(i8080_t* state, uint8_t port) {
+  const i8080_port_handler_t* handler = &state->ports[port];
+
+  if (handler->out)
+    handler->out(handler->context, port, state->a);
+
+  state->pc += 2;
 }
 
 void i8080_ei(i8080_t* state) {
   state->ie = 1;
+  state->ei_delay = 1;  // cleared when the next instruction is executed
+
+  // ends the batch inner loop, the next instruction is run on its own
+  state->run_deadline = 0;
 
   state->pc++;
 }
@@ -766,7 +1916,11 @@ void i8080_di(i8080_t* state) {
   state->pc++;
 }
 
-void i8080_step(i8080_t* state) {
+#ifndef I8080_DISPATCH_TABLE
+
+// executes one instruction at current pc, inlined into i8080_step and the
+// batch run loops so those don't pay a call per instruction
+__attribute__((always_inline)) static inline void dispatch(i8080_t* state) {
   // shorthand identifiers for registers, makes switch more readable
   uint8_t* A = &state->a;
   uint8_t* B = &state->b;
@@ -775,13 +1929,15 @@ void i8080_step(i8080_t* state) {
   uint8_t* E = &state->e;
   uint8_t* H = &state->h;
   uint8_t* L = &state->l;
-  uint8_t* M = mem_ref_m(state);
+  uint8_t m;  // memory reference M, read/written through the bus by the cases
+  uint8_t* M = &m;
   uint16_t* SP = &state->sp;
   regpair_t BC = {&state->b, &state->c};
   regpair_t DE = {&state->d, &state->e};
   regpair_t HL = {&state->h, &state->l};
 
-  uint8_t* opcode = &state->external_memory[state->pc];
+  uint8_t buffer[3];
+  const uint8_t* opcode = fetch(state, buffer);
 
   state->cycles += OPCODE_CYCLES[*opcode];
 
@@ -946,13 +2102,18 @@ void i8080_step(i8080_t* state) {
       i8080_inx(state, (regpair_t){}, SP);
       break;
     case 0x34:
+      m = read_m(state);
       i8080_inr(state, M);
+      write_m(state, m);
       break;
     case 0x35:
+      m = read_m(state);
       i8080_dcr(state, M);
+      write_m(state, m);
       break;
     case 0x36:
       i8080_mvi(state, M, opcode[1]);
+      write_m(state, m);
       break;
     case 0x37:
       i8080_stc(state);
@@ -1001,6 +2162,7 @@ void i8080_step(i8080_t* state) {
       i8080_mov(state, B, L);
       break;
     case 0x46:
+      m = read_m(state);
       i8080_mov(state, B, M);
       break;
     case 0x47:
@@ -1025,6 +2187,7 @@ void i8080_step(i8080_t* state) {
       i8080_mov(state, C, L);
       break;
     case 0x4e:
+      m = read_m(state);
       i8080_mov(state, C, M);
       break;
     case 0x4f:
@@ -1050,6 +2213,7 @@ void i8080_step(i8080_t* state) {
       i8080_mov(state, D, L);
       break;
     case 0x56:
+      m = read_m(state);
       i8080_mov(state, D, M);
       break;
     case 0x57:
@@ -1074,6 +2238,7 @@ void i8080_step(i8080_t* state) {
       i8080_mov(state, E, L);
       break;
     case 0x5e:
+      m = read_m(state);
       i8080_mov(state, E, M);
       break;
     case 0x5f:
@@ -1099,6 +2264,7 @@ void i8080_step(i8080_t* state) {
       i8080_mov(state, H, L);
       break;
     case 0x66:
+      m = read_m(state);
       i8080_mov(state, H, M);
       break;
     case 0x67:
@@ -1123,6 +2289,7 @@ void i8080_step(i8080_t* state) {
       i8080_mov(state, L, L);
       break;
     case 0x6e:
+      m = read_m(state);
       i8080_mov(state, L, M);
       break;
     case 0x6f:
@@ -1131,27 +2298,34 @@ void i8080_step(i8080_t* state) {
 
     case 0x70:
       i8080_mov(state, M, B);
+      write_m(state, m);
       break;
     case 0x71:
       i8080_mov(state, M, C);
+      write_m(state, m);
       break;
     case 0x72:
       i8080_mov(state, M, D);
+      write_m(state, m);
       break;
     case 0x73:
       i8080_mov(state, M, E);
+      write_m(state, m);
       break;
     case 0x74:
       i8080_mov(state, M, H);
+      write_m(state, m);
       break;
     case 0x75:
       i8080_mov(state, M, L);
+      write_m(state, m);
       break;
     case 0x76:
-      state->pc--;
+      i8080_hlt(state);
       break;
     case 0x77:
       i8080_mov(state, M, A);
+      write_m(state, m);
       break;
     case 0x78:
       i8080_mov(state, A, B);
@@ -1172,6 +2346,7 @@ void i8080_step(i8080_t* state) {
       i8080_mov(state, A, L);
       break;
     case 0x7e:
+      m = read_m(state);
       i8080_mov(state, A, M);
       break;
     case 0x7f:
@@ -1197,6 +2372,7 @@ void i8080_step(i8080_t* state) {
       i8080_add(state, L);
       break;
     case 0x86:
+      m = read_m(state);
       i8080_add(state, M);
       break;
     case 0x87:
@@ -1221,6 +2397,7 @@ void i8080_step(i8080_t* state) {
       i8080_adc(state, L);
       break;
     case 0x8e:
+      m = read_m(state);
       i8080_adc(state, M);
       break;
     case 0x8f:
@@ -1246,6 +2423,7 @@ void i8080_step(i8080_t* state) {
       i8080_sub(state, L);
       break;
     case 0x96:
+      m = read_m(state);
       i8080_sub(state, M);
       break;
     case 0x97:
@@ -1270,6 +2448,7 @@ void i8080_step(i8080_t* state) {
       i8080_sbb(state, L);
       break;
     case 0x9e:
+      m = read_m(state);
       i8080_sbb(state, M);
       break;
     case 0x9f:
@@ -1295,6 +2474,7 @@ void i8080_step(i8080_t* state) {
       i8080_ana(state, L);
       break;
     case 0xa6:
+      m = read_m(state);
       i8080_ana(state, M);
       break;
     case 0xa7:
@@ -1319,6 +2499,7 @@ void i8080_step(i8080_t* state) {
       i8080_xra(state, L);
       break;
     case 0xae:
+      m = read_m(state);
       i8080_xra(state, M);
       break;
     case 0xaf:
@@ -1344,6 +2525,7 @@ void i8080_step(i8080_t* state) {
       i8080_ora(state, L);
       break;
     case 0xb6:
+      m = read_m(state);
       i8080_ora(state, M);
       break;
     case 0xb7:
@@ -1368,6 +2550,7 @@ void i8080_step(i8080_t* state) {
       i8080_cmp(state, L);
       break;
     case 0xbe:
+      m = read_m(state);
       i8080_cmp(state, M);
       break;
     case 0xbf:
@@ -1433,7 +2616,8 @@ void i8080_step(i8080_t* state) {
       i8080_jnc(state, opcode[1], opcode[2]);
       break;
     case 0xd3:
-      break;  // OUT d8 ---unimplemented (ext. hardware)
+      i8080_out(state, opcode[1]);
+      break;
     case 0xd4:
       i8080_cnc(state, opcode[1], opcode[2]);
       break;
@@ -1456,7 +2640,8 @@ void i8080_step(i8080_t* state) {
       i8080_jc(state, opcode[1], opcode[2]);
       break;
     case 0xdb:
-      break;  // IN d8 ---unimplemented(ext. hardware)
+      i8080_in(state, opcode[1]);
+      break;
     case 0xdc:
       i8080_cc(state, opcode[1], opcode[2]);
       break;
@@ -1570,860 +2755,2336 @@ void i8080_step(i8080_t* state) {
   }
 }
 
-// returns bytes of operation at pc
-uint8_t i8080_disassemble(const unsigned char* buffer, const uint16_t pc) {
-  const unsigned char* opcode = &buffer[pc];
+#else  // I8080_DISPATCH_TABLE
+
+// table dispatch engine: one handler per opcode with its registers resolved at
+// compile time, so a step is a table load and an indirect call instead of
+// rebuilding the register shorthands and walking the switch
+typedef void (*opcode_handler_t)(i8080_t* state, const uint8_t* opcode);
+
+// same shorthand identifiers as the switch engine, bound to state in each
+// handler, keeps the handler list below comparable to the switch line by line
+#define A (&state->a)
+#define B (&state->b)
+#define C (&state->c)
+#define D (&state->d)
+#define E (&state->e)
+#define H (&state->h)
+#define L (&state->l)
+#define M (&m)
+#define SP (&state->sp)
+#define BC ((regpair_t){&state->b, &state->c})
+#define DE ((regpair_t){&state->d, &state->e})
+#define HL ((regpair_t){&state->h, &state->l})
+
+#define OPCODE_HANDLER(op, body)                               \
+  static void op_##op(i8080_t* state, const uint8_t* opcode) { \
+    body;                                                      \
+  }
 
-  uint8_t opbytes = 1;  // default byte length of instructions
+// handlers using M get it as local m, read before and/or written after body
+#define OPCODE_HANDLER_READ_M(op, body)                        \
+  static void op_##op(i8080_t* state, const uint8_t* opcode) { \
+    uint8_t m = read_m(state);                                 \
+    body;                                                      \
+  }
+#define OPCODE_HANDLER_WRITE_M(op, body)                       \
+  static void op_##op(i8080_t* state, const uint8_t* opcode) { \
+    uint8_t m;                                                 \
+    body;                                                      \
+    write_m(state, m);                                         \
+  }
+#define OPCODE_HANDLER_UPDATE_M(op, body)                      \
+  static void op_##op(i8080_t* state, const uint8_t* opcode) { \
+    uint8_t m = read_m(state);                                 \
+    body;                                                      \
+    write_m(state, m);                                         \
+  }
 
-  printf("%04x ", pc);
+OPCODE_HANDLER(00, i8080_nop(state))
+OPCODE_HANDLER(01, i8080_lxi(state, BC, NULL, opcode[1], opcode[2]))
+OPCODE_HANDLER(02, i8080_stax(state, BC))
+OPCODE_HANDLER(03, i8080_inx(state, BC, NULL))
+OPCODE_HANDLER(04, i8080_inr(state, B))
+OPCODE_HANDLER(05, i8080_dcr(state, B))
+OPCODE_HANDLER(06, i8080_mvi(state, B, opcode[1]))
+OPCODE_HANDLER(07, i8080_rlc(state))
+OPCODE_HANDLER(08, i8080_nop(state))
+OPCODE_HANDLER(09, i8080_dad(state, get_regpair_val(&BC)))
+OPCODE_HANDLER(0a, i8080_ldax(state, BC))
+OPCODE_HANDLER(0b, i8080_dcx(state, BC, NULL))
+OPCODE_HANDLER(0c, i8080_inr(state, C))
+OPCODE_HANDLER(0d, i8080_dcr(state, C))
+OPCODE_HANDLER(0e, i8080_mvi(state, C, opcode[1]))
+OPCODE_HANDLER(0f, i8080_rrc(state))
+
+OPCODE_HANDLER(10, i8080_nop(state))
+OPCODE_HANDLER(11, i8080_lxi(state, DE, NULL, opcode[1], opcode[2]))
+OPCODE_HANDLER(12, i8080_stax(state, DE))
+OPCODE_HANDLER(13, i8080_inx(state, DE, NULL))
+OPCODE_HANDLER(14, i8080_inr(state, D))
+OPCODE_HANDLER(15, i8080_dcr(state, D))
+OPCODE_HANDLER(16, i8080_mvi(state, D, opcode[1]))
+OPCODE_HANDLER(17, i8080_ral(state))
+OPCODE_HANDLER(18, i8080_nop(state))
+OPCODE_HANDLER(19, i8080_dad(state, get_regpair_val(&DE)))
+OPCODE_HANDLER(1a, i8080_ldax(state, DE))
+OPCODE_HANDLER(1b, i8080_dcx(state, DE, NULL))
+OPCODE_HANDLER(1c, i8080_inr(state, E))
+OPCODE_HANDLER(1d, i8080_dcr(state, E))
+OPCODE_HANDLER(1e, i8080_mvi(state, E, opcode[1]))
+OPCODE_HANDLER(1f, i8080_rar(state))
+
+OPCODE_HANDLER(20, i8080_nop(state))
+OPCODE_HANDLER(21, i8080_lxi(state, HL, NULL, opcode[1], opcode[2]))
+OPCODE_HANDLER(22, i8080_shld(state, opcode[1], opcode[2]))
+OPCODE_HANDLER(23, i8080_inx(state, HL, NULL))
+OPCODE_HANDLER(24, i8080_inr(state, H))
+OPCODE_HANDLER(25, i8080_dcr(state, H))
+OPCODE_HANDLER(26, i8080_mvi(state, H, opcode[1]))
+OPCODE_HANDLER(27, i8080_daa(state))
+OPCODE_HANDLER(28, i8080_nop(state))
+OPCODE_HANDLER(29, i8080_dad(state, get_regpair_val(&HL)))
+OPCODE_HANDLER(2a, i8080_lhld(state, opcode[1], opcode[2]))
+OPCODE_HANDLER(2b, i8080_dcx(state, HL, NULL))
+OPCODE_HANDLER(2c, i8080_inr(state, L))
+OPCODE_HANDLER(2d, i8080_dcr(state, L))
+OPCODE_HANDLER(2e, i8080_mvi(state, L, opcode[1]))
+OPCODE_HANDLER(2f, i8080_cma(state))
+
+OPCODE_HANDLER(30, i8080_nop(state))
+OPCODE_HANDLER(31, i8080_lxi(state, (regpair_t){}, SP, opcode[1], opcode[2]))
+OPCODE_HANDLER(32, i8080_sta(state, opcode[1], opcode[2]))
+OPCODE_HANDLER(33, i8080_inx(state, (regpair_t){}, SP))
+OPCODE_HANDLER_UPDATE_M(34, i8080_inr(state, M))
+OPCODE_HANDLER_UPDATE_M(35, i8080_dcr(state, M))
+OPCODE_HANDLER_WRITE_M(36, i8080_mvi(state, M, opcode[1]))
+OPCODE_HANDLER(37, i8080_stc(state))
+OPCODE_HANDLER(38, i8080_nop(state))
+OPCODE_HANDLER(39, i8080_dad(state, *SP))
+OPCODE_HANDLER(3a, i8080_lda(state, opcode[1], opcode[2]))
+OPCODE_HANDLER(3b, i8080_dcx(state, (regpair_t){}, SP))
+OPCODE_HANDLER(3c, i8080_inr(state, A))
+OPCODE_HANDLER(3d, i8080_dcr(state, A))
+OPCODE_HANDLER(3e, i8080_mvi(state, A, opcode[1]))
+OPCODE_HANDLER(3f, i8080_cmc(state))
+
+OPCODE_HANDLER(40, i8080_mov(state, B, B))
+OPCODE_HANDLER(41, i8080_mov(state, B, C))
+OPCODE_HANDLER(42, i8080_mov(state, B, D))
+OPCODE_HANDLER(43, i8080_mov(state, B, E))
+OPCODE_HANDLER(44, i8080_mov(state, B, H))
+OPCODE_HANDLER(45, i8080_mov(state, B, L))
+OPCODE_HANDLER_READ_M(46, i8080_mov(state, B, M))
+OPCODE_HANDLER(47, i8080_mov(state, B, A))
+OPCODE_HANDLER(48, i8080_mov(state, C, B))
+OPCODE_HANDLER(49, i8080_mov(state, C, C))
+OPCODE_HANDLER(4a, i8080_mov(state, C, D))
+OPCODE_HANDLER(4b, i8080_mov(state, C, E))
+OPCODE_HANDLER(4c, i8080_mov(state, C, H))
+OPCODE_HANDLER(4d, i8080_mov(state, C, L))
+OPCODE_HANDLER_READ_M(4e, i8080_mov(state, C, M))
+OPCODE_HANDLER(4f, i8080_mov(state, C, A))
+
+OPCODE_HANDLER(50, i8080_mov(state, D, B))
+OPCODE_HANDLER(51, i8080_mov(state, D, C))
+OPCODE_HANDLER(52, i8080_mov(state, D, D))
+OPCODE_HANDLER(53, i8080_mov(state, D, E))
+OPCODE_HANDLER(54, i8080_mov(state, D, H))
+OPCODE_HANDLER(55, i8080_mov(state, D, L))
+OPCODE_HANDLER_READ_M(56, i8080_mov(state, D, M))
+OPCODE_HANDLER(57, i8080_mov(state, D, A))
+OPCODE_HANDLER(58, i8080_mov(state, E, B))
+OPCODE_HANDLER(59, i8080_mov(state, E, C))
+OPCODE_HANDLER(5a, i8080_mov(state, E, D))
+OPCODE_HANDLER(5b, i8080_mov(state, E, E))
+OPCODE_HANDLER(5c, i8080_mov(state, E, H))
+OPCODE_HANDLER(5d, i8080_mov(state, E, L))
+OPCODE_HANDLER_READ_M(5e, i8080_mov(state, E, M))
+OPCODE_HANDLER(5f, i8080_mov(state, E, A))
+
+OPCODE_HANDLER(60, i8080_mov(state, H, B))
+OPCODE_HANDLER(61, i8080_mov(state, H, C))
+OPCODE_HANDLER(62, i8080_mov(state, H, D))
+OPCODE_HANDLER(63, i8080_mov(state, H, E))
+OPCODE_HANDLER(64, i8080_mov(state, H, H))
+OPCODE_HANDLER(65, i8080_mov(state, H, L))
+OPCODE_HANDLER_READ_M(66, i8080_mov(state, H, M))
+OPCODE_HANDLER(67, i8080_mov(state, H, A))
+OPCODE_HANDLER(68, i8080_mov(state, L, B))
+OPCODE_HANDLER(69, i8080_mov(state, L, C))
+OPCODE_HANDLER(6a, i8080_mov(state, L, D))
+OPCODE_HANDLER(6b, i8080_mov(state, L, E))
+OPCODE_HANDLER(6c, i8080_mov(state, L, H))
+OPCODE_HANDLER(6d, i8080_mov(state, L, L))
+OPCODE_HANDLER_READ_M(6e, i8080_mov(state, L, M))
+OPCODE_HANDLER(6f, i8080_mov(state, L, A))
+
+OPCODE_HANDLER_WRITE_M(70, i8080_mov(state, M, B))
+OPCODE_HANDLER_WRITE_M(71, i8080_mov(state, M, C))
+OPCODE_HANDLER_WRITE_M(72, i8080_mov(state, M, D))
+OPCODE_HANDLER_WRITE_M(73, i8080_mov(state, M, E))
+OPCODE_HANDLER_WRITE_M(74, i8080_mov(state, M, H))
+OPCODE_HANDLER_WRITE_M(75, i8080_mov(state, M, L))
+OPCODE_HANDLER(76, i8080_hlt(state))
+OPCODE_HANDLER_WRITE_M(77, i8080_mov(state, M, A))
+OPCODE_HANDLER(78, i8080_mov(state, A, B))
+OPCODE_HANDLER(79, i8080_mov(state, A, C))
+OPCODE_HANDLER(7a, i8080_mov(state, A, D))
+OPCODE_HANDLER(7b, i8080_mov(state, A, E))
+OPCODE_HANDLER(7c, i8080_mov(state, A, H))
+OPCODE_HANDLER(7d, i8080_mov(state, A, L))
+OPCODE_HANDLER_READ_M(7e, i8080_mov(state, A, M))
+OPCODE_HANDLER(7f, i8080_mov(state, A, A))
+
+OPCODE_HANDLER(80, i8080_add(state, B))
+OPCODE_HANDLER(81, i8080_add(state, C))
+OPCODE_HANDLER(82, i8080_add(state, D))
+OPCODE_HANDLER(83, i8080_add(state, E))
+OPCODE_HANDLER(84, i8080_add(state, H))
+OPCODE_HANDLER(85, i8080_add(state, L))
+OPCODE_HANDLER_READ_M(86, i8080_add(state, M))
+OPCODE_HANDLER(87, i8080_add(state, A))
+OPCODE_HANDLER(88, i8080_adc(state, B))
+OPCODE_HANDLER(89, i8080_adc(state, C))
+OPCODE_HANDLER(8a, i8080_adc(state, D))
+OPCODE_HANDLER(8b, i8080_adc(state, E))
+OPCODE_HANDLER(8c, i8080_adc(state, H))
+OPCODE_HANDLER(8d, i8080_adc(state, L))
+OPCODE_HANDLER_READ_M(8e, i8080_adc(state, M))
+OPCODE_HANDLER(8f, i8080_adc(state, A))
+
+OPCODE_HANDLER(90, i8080_sub(state, B))
+OPCODE_HANDLER(91, i8080_sub(state, C))
+OPCODE_HANDLER(92, i8080_sub(state, D))
+OPCODE_HANDLER(93, i8080_sub(state, E))
+OPCODE_HANDLER(94, i8080_sub(state, H))
+OPCODE_HANDLER(95, i8080_sub(state, L))
+OPCODE_HANDLER_READ_M(96, i8080_sub(state, M))
+OPCODE_HANDLER(97, i8080_sub(state, A))
+OPCODE_HANDLER(98, i8080_sbb(state, B))
+OPCODE_HANDLER(99, i8080_sbb(state, C))
+OPCODE_HANDLER(9a, i8080_sbb(state, D))
+OPCODE_HANDLER(9b, i8080_sbb(state, E))
+OPCODE_HANDLER(9c, i8080_sbb(state, H))
+OPCODE_HANDLER(9d, i8080_sbb(state, L))
+OPCODE_HANDLER_READ_M(9e, i8080_sbb(state, M))
+OPCODE_HANDLER(9f, i8080_sbb(state, A))
+
+OPCODE_HANDLER(a0, i8080_ana(state, B))
+OPCODE_HANDLER(a1, i8080_ana(state, C))
+OPCODE_HANDLER(a2, i8080_ana(state, D))
+OPCODE_HANDLER(a3, i8080_ana(state, E))
+OPCODE_HANDLER(a4, i8080_ana(state, H))
+OPCODE_HANDLER(a5, i8080_ana(state, L))
+OPCODE_HANDLER_READ_M(a6, i8080_ana(state, M))
+OPCODE_HANDLER(a7, i8080_ana(state, A))
+OPCODE_HANDLER(a8, i8080_xra(state, B))
+OPCODE_HANDLER(a9, i8080_xra(state, C))
+OPCODE_HANDLER(aa, i8080_xra(state, D))
+OPCODE_HANDLER(ab, i8080_xra(state, E))
+OPCODE_HANDLER(ac, i8080_xra(state, H))
+OPCODE_HANDLER(ad, i8080_xra(state, L))
+OPCODE_HANDLER_READ_M(ae, i8080_xra(state, M))
+OPCODE_HANDLER(af, i8080_xra(state, A))
+
+OPCODE_HANDLER(b0, i8080_ora(state, B))
+OPCODE_HANDLER(b1, i8080_ora(state, C))
+OPCODE_HANDLER(b2, i8080_ora(state, D))
+OPCODE_HANDLER(b3, i8080_ora(state, E))
+OPCODE_HANDLER(b4, i8080_ora(state, H))
+OPCODE_HANDLER(b5, i8080_ora(state, L))
+OPCODE_HANDLER_READ_M(b6, i8080_ora(state, M))
+OPCODE_HANDLER(b7, i8080_ora(state, A))
+OPCODE_HANDLER(b8, i8080_cmp(state, B))
+OPCODE_HANDLER(b9, i8080_cmp(state, C))
+OPCODE_HANDLER(ba, i8080_cmp(state, D))
+OPCODE_HANDLER(bb, i8080_cmp(state, E))
+OPCODE_HANDLER(bc, i8080_cmp(state, H))
+OPCODE_HANDLER(bd, i8080_cmp(state, L))
+OPCODE_HANDLER_READ_M(be, i8080_cmp(state, M))
+OPCODE_HANDLER(bf, i8080_cmp(state, A))
+
+OPCODE_HANDLER(c0, i8080_rnz(state))
+OPCODE_HANDLER(c1, i8080_pop(state, BC))
+OPCODE_HANDLER(c2, i8080_jnz(state, opcode[1], opcode[2]))
+OPCODE_HANDLER(c3, i8080_jmp(state, opcode[1], opcode[2]))
+OPCODE_HANDLER(c4, i8080_cnz(state, opcode[1], opcode[2]))
+OPCODE_HANDLER(c5, i8080_push(state, BC))
+OPCODE_HANDLER(c6, i8080_adi(state, opcode[1]))
+OPCODE_HANDLER(c7, i8080_rst(state, 0))
+OPCODE_HANDLER(c8, i8080_rz(state))
+OPCODE_HANDLER(c9, i8080_ret(state))
+OPCODE_HANDLER(ca, i8080_jz(state, opcode[1], opcode[2]))
+OPCODE_HANDLER(cb, i8080_jmp(state, opcode[1], opcode[2]))
+OPCODE_HANDLER(cc, i8080_cz(state, opcode[1], opcode[2]))
+OPCODE_HANDLER(cd, i8080_call(state, opcode[1], opcode[2]))
+OPCODE_HANDLER(ce, i8080_aci(state, opcode[1]))
+OPCODE_HANDLER(cf, i8080_rst(state, 1))
+
+OPCODE_HANDLER(d0, i8080_rnc(state))
+OPCODE_HANDLER(d1, i8080_pop(state, DE))
+OPCODE_HANDLER(d2, i8080_jnc(state, opcode[1], opcode[2]))
+OPCODE_HANDLER(d3, i8080_out(state, opcode[1]))
+OPCODE_HANDLER(d4, i8080_cnc(state, opcode[1], opcode[2]))
+OPCODE_HANDLER(d5, i8080_push(state, DE))
+OPCODE_HANDLER(d6, i8080_sui(state, opcode[1]))
+OPCODE_HANDLER(d7, i8080_rst(state, 2))
+OPCODE_HANDLER(d8, i8080_rc(state))
+OPCODE_HANDLER(d9, i8080_ret(state))
+OPCODE_HANDLER(da, i8080_jc(state, opcode[1], opcode[2]))
+OPCODE_HANDLER(db, i8080_in(state, opcode[1]))
+OPCODE_HANDLER(dc, i8080_cc(state, opcode[1], opcode[2]))
+OPCODE_HANDLER(dd, i8080_call(state, opcode[1], opcode[2]))
+OPCODE_HANDLER(de, i8080_sbi(state, opcode[1]))
+OPCODE_HANDLER(df, i8080_rst(state, 3))
+
+OPCODE_HANDLER(e0, i8080_rpo(state))
+OPCODE_HANDLER(e1, i8080_pop(state, HL))
+OPCODE_HANDLER(e2, i8080_jpo(state, opcode[1], opcode[2]))
+OPCODE_HANDLER(e3, i8080_xthl(state))
+OPCODE_HANDLER(e4, i8080_cpo(state, opcode[1], opcode[2]))
+OPCODE_HANDLER(e5, i8080_push(state, HL))
+OPCODE_HANDLER(e6, i8080_ani(state, opcode[1]))
+OPCODE_HANDLER(e7, i8080_rst(state, 4))
+OPCODE_HANDLER(e8, i8080_rpe(state))
+OPCODE_HANDLER(e9, i8080_pchl(state))
+OPCODE_HANDLER(ea, i8080_jpe(state, opcode[1], opcode[2]))
+OPCODE_HANDLER(eb, i8080_xchg(state))
+OPCODE_HANDLER(ec, i8080_cpe(state, opcode[1], opcode[2]))
+OPCODE_HANDLER(ed, i8080_call(state, opcode[1], opcode[2]))
+OPCODE_HANDLER(ee, i8080_xri(state, opcode[1]))
+OPCODE_HANDLER(ef, i8080_rst(state, 5))
+
+OPCODE_HANDLER(f0, i8080_rp(state))
+OPCODE_HANDLER(f1, i8080_pop_psw(state))
+OPCODE_HANDLER(f2, i8080_jp(state, opcode[1], opcode[2]))
+OPCODE_HANDLER(f3, i8080_di(state))
+OPCODE_HANDLER(f4, i8080_cp(state, opcode[1], opcode[2]))
+OPCODE_HANDLER(f5, i8080_push_psw(state))
+OPCODE_HANDLER(f6, i8080_ori(state, opcode[1]))
+OPCODE_HANDLER(f7, i8080_rst(state, 6))
+OPCODE_HANDLER(f8, i8080_rm(state))
+OPCODE_HANDLER(f9, i8080_sphl(state))
+OPCODE_HANDLER(fa, i8080_jm(state, opcode[1], opcode[2]))
+OPCODE_HANDLER(fb, i8080_ei(state))
+OPCODE_HANDLER(fc, i8080_cm(state, opcode[1], opcode[2]))
+OPCODE_HANDLER(fd, i8080_call(state, opcode[1], opcode[2]))
+OPCODE_HANDLER(fe, i8080_cpi(state, opcode[1]))
+OPCODE_HANDLER(ff, i8080_rst(state, 7))
+
+#undef OPCODE_HANDLER
+#undef OPCODE_HANDLER_READ_M
+#undef OPCODE_HANDLER_WRITE_M
+#undef OPCODE_HANDLER_UPDATE_M
+#undef A
+#undef B
+#undef C
+#undef D
+#undef E
+#undef H
+#undef L
+#undef M
+#undef SP
+#undef BC
+#undef DE
+#undef HL
+
+static const opcode_handler_t OPCODE_HANDLERS[] = {
+    op_00, op_01, op_02, op_03, op_04, op_05, op_06, op_07,  // 0
+    op_08, op_09, op_0a, op_0b, op_0c, op_0d, op_0e, op_0f,
+    op_10, op_11, op_12, op_13, op_14, op_15, op_16, op_17,  // 1
+    op_18, op_19, op_1a, op_1b, op_1c, op_1d, op_1e, op_1f,
+    op_20, op_21, op_22, op_23, op_24, op_25, op_26, op_27,  // 2
+    op_28, op_29, op_2a, op_2b, op_2c, op_2d, op_2e, op_2f,
+    op_30, op_31, op_32, op_33, op_34, op_35, op_36, op_37,  // 3
+    op_38, op_39, op_3a, op_3b, op_3c, op_3d, op_3e, op_3f,
+    op_40, op_41, op_42, op_43, op_44, op_45, op_46, op_47,  // 4
+    op_48, op_49, op_4a, op_4b, op_4c, op_4d, op_4e, op_4f,
+    op_50, op_51, op_52, op_53, op_54, op_55, op_56, op_57,  // 5
+    op_58, op_59, op_5a, op_5b, op_5c, op_5d, op_5e, op_5f,
+    op_60, op_61, op_62, op_63, op_64, op_65, op_66, op_67,  // 6
+    op_68, op_69, op_6a, op_6b, op_6c, op_6d, op_6e, op_6f,
+    op_70, op_71, op_72, op_73, op_74, op_75, op_76, op_77,  // 7
+    op_78, op_79, op_7a, op_7b, op_7c, op_7d, op_7e, op_7f,
+    op_80, op_81, op_82, op_83, op_84, op_85, op_86, op_87,  // 8
+    op_88, op_89, op_8a, op_8b, op_8c, op_8d, op_8e, op_8f,
+    op_90, op_91, op_92, op_93, op_94, op_95, op_96, op_97,  // 9
+    op_98, op_99, op_9a, op_9b, op_9c, op_9d, op_9e, op_9f,
+    op_a0, op_a1, op_a2, op_a3, op_a4, op_a5, op_a6, op_a7,  // a
+    op_a8, op_a9, op_aa, op_ab, op_ac, op_ad, op_ae, op_af,
+    op_b0, op_b1, op_b2, op_b3, op_b4, op_b5, op_b6, op_b7,  // b
+    op_b8, op_b9, op_ba, op_bb, op_bc, op_bd, op_be, op_bf,
+    op_c0, op_c1, op_c2, op_c3, op_c4, op_c5, op_c6, op_c7,  // c
+    op_c8, op_c9, op_ca, op_cb, op_cc, op_cd, op_ce, op_cf,
+    op_d0, op_d1, op_d2, op_d3, op_d4, op_d5, op_d6, op_d7,  // d
+    op_d8, op_d9, op_da, op_db, op_dc, op_dd, op_de, op_df,
+    op_e0, op_e1, op_e2, op_e3, op_e4, op_e5, op_e6, op_e7,  // e
+    op_e8, op_e9, op_ea, op_eb, op_ec, op_ed, op_ee, op_ef,
+    op_f0, op_f1, op_f2, op_f3, op_f4, op_f5, op_f6, op_f7,  // f
+    op_f8, op_f9, op_fa, op_fb, op_fc, op_fd, op_fe, op_ff,
+};
 
-  switch (*opcode) {
-    case 0x00:
-      printf("NOP");
-      break;
-    case 0x01:
-      printf("LXI\tB,#$%02x%02x", opcode[2], opcode[1]);
-      opbytes = 3;
-      break;
-    case 0x02:
-      printf("STAX\tB");
-      break;
-    case 0x03:
-      printf("INX\tB");
-      break;
-    case 0x04:
-      printf("INR\tB");
-      break;
-    case 0x05:
-      printf("DCR\tB");
-      break;
-    case 0x06:
-      printf("MVI\tB,#$%02x", opcode[1]);
-      opbytes = 2;
-      break;
-    case 0x07:
-      printf("RLC");
-      break;
-    case 0x08:
-      printf("NOP");
-      break;
-    case 0x09:
-      printf("DAD\tB");
-      break;
-    case 0x0a:
-      printf("LDAX\tB");
-      break;
-    case 0x0b:
-      printf("DCX\tB");
-      break;
-    case 0x0c:
-      printf("INR\tC");
-      break;
-    case 0x0d:
-      printf("DCR\tC");
-      break;
-    case 0x0e:
-      printf("MVI\tC,#$%02x", opcode[1]);
-      break;
-    case 0x0f:
-      printf("RRC");
-      break;
+__attribute__((always_inline)) static inline void dispatch(i8080_t* state) {
+  uint8_t buffer[3];
+  const uint8_t* opcode = fetch(state, buffer);
 
-    case 0x10:
-      printf("NOP");
-      break;
-    case 0x11:
-      printf("LXI\tD,#$%02x%02x", opcode[2], opcode[1]);
-      opbytes = 3;
-      break;
+  state->cycles += OPCODE_CYCLES[*opcode];
+
+  OPCODE_HANDLERS[*opcode](state, opcode);
+}
+
+#endif  // I8080_DISPATCH_TABLE
+
+#if defined(I8080_JIT) || defined(I8080_BLOCK_CACHE)
+
+static bool ends_block(const uint8_t op) {
+  switch (op & 0xc7) {
+    case 0xc0:  // Rcc
+    case 0xc2:  // Jcc
+    case 0xc4:  // Ccc
+    case 0xc7:  // RST
+      return true;
+  }
+
+  switch (op) {
+    case 0x76:  // HLT
+    case 0xc3:  // JMP
+    case 0xcb:
+    case 0xc9:  // RET
+    case 0xd9:
+    case 0xcd:  // CALL
+    case 0xdd:
+    case 0xed:
+    case 0xfd:
+    case 0xe9:  // PCHL
+    case 0xfb:  // EI, interrupts are looked at after the next instruction
+      return true;
+  }
+
+  return false;
+}
+
+// direct host memory the guest can only change through the page table: ram,
+// whose writes can be trapped, rom, or an image whose first write remaps it
+static bool plain_memory_page(const i8080_t* state, const int page) {
+  const uint8_t* memory = state->read_pages[page];
+
+  if (!memory)
+    return false;
+
+  return state->write_pages[page] == memory ||
+         (!state->write_pages[page] &&
+          (state->page_handlers[page].write == discard_write ||
+           state->page_handlers[page].write == copy_on_write));
+}
+
+#endif
+
+#ifdef I8080_JIT
+
+// x86-64 translator. a block is a straight run of instructions within one page
+// up to the first jump, call, return, RST, HLT or EI. register moves, INX/DCX
+// and jumps are translated inline, everything else to a call into the table
+// engine's handler with the instruction bytes copied next to the code. the
+// generated code keeps state in rbx.
+// the code cache is a memfd mapped twice, written through one view and run
+// from the other, so no page is ever writable and executable at once.
+// a block is only entered when all of its instructions fit before the run
+// deadline, the interpreter takes the ones in front of a deadline. only bus
+// accesses can reach code that moves the deadline (devices, interrupts, page
+// invalidation), so the deadline is compared again after those alone. events
+// and interrupts see the same instruction boundaries as with the interpreter
+
+// registers in opcode order B, C, D, E, H, L, M, A. M has no offset
+static const int JIT_REGISTERS[8] = {
+    offsetof(i8080_t, b), offsetof(i8080_t, c), offsetof(i8080_t, d),
+    offsetof(i8080_t, e), offsetof(i8080_t, h), offsetof(i8080_t, l),
+    -1,                   offsetof(i8080_t, a)};
+
+// instructions going through memory or port handlers
+static bool jit_uses_bus(const uint8_t op) {
+  if (op >= 0x40 && op < 0xc0 && op != 0x76)
+    return (op & 7) == 6 || (op < 0x80 && (op & 0x38) == 0x30);  // M operand
+
+  switch (op) {
+    case 0x02:  // STAX
     case 0x12:
-      printf("STAX\tD");
-      break;
-    case 0x13:
-      printf("INX\tD");
-      break;
-    case 0x14:
-      printf("INR\tD");
-      break;
-    case 0x15:
-      printf("DCR\tD");
-      break;
-    case 0x16:
-      printf("MVI\tD,#$%02x", opcode[1]);
-      opbytes = 2;
-      break;
-    case 0x17:
-      printf("RAL");
-      break;
-    case 0x18:
-      printf("NOP");
-      break;
-    case 0x19:
-      printf("DAD\tD");
-      break;
+    case 0x0a:  // LDAX
     case 0x1a:
-      printf("LDAX\tD");
-      break;
-    case 0x1b:
-      printf("DCX\tD");
-      break;
-    case 0x1c:
-      printf("INR\tE");
-      break;
-    case 0x1d:
-      printf("DCR\tE");
-      break;
-    case 0x1e:
-      printf("MVI\tE,#$%02x", opcode[1]);
-      opbytes = 2;
-      break;
-    case 0x1f:
-      printf("RAR");
-      break;
+    case 0x22:  // SHLD
+    case 0x2a:  // LHLD
+    case 0x32:  // STA
+    case 0x3a:  // LDA
+    case 0x34:  // INR M
+    case 0x35:  // DCR M
+    case 0x36:  // MVI M
+    case 0xc1:  // POP
+    case 0xd1:
+    case 0xe1:
+    case 0xf1:
+    case 0xc5:  // PUSH
+    case 0xd5:
+    case 0xe5:
+    case 0xf5:
+    case 0xe3:  // XTHL
+    case 0xd3:  // OUT
+    case 0xdb:  // IN
+      return true;
+  }
 
-    case 0x20:
-      printf("NOP");
-      break;
-    case 0x21:
-      printf("LXI\tH,#$%02x%02x", opcode[2], opcode[1]);
-      opbytes = 3;
-      break;
-    case 0x22:
-      printf("SHLD\t$%02x%02x", opcode[2], opcode[1]);
-      opbytes = 3;
-      break;
-    case 0x23:
-      printf("INX\tH");
-      break;
-    case 0x24:
-      printf("INR\tH");
-      break;
-    case 0x25:
-      printf("DCR\tH");
-      break;
-    case 0x26:
-      printf("MVI\tH,#$%02x", opcode[1]);
-      opbytes = 2;
-      break;
-    case 0x27:
-      printf("DAA");
-      break;
-    case 0x28:
-      printf("NOP");
-      break;
-    case 0x29:
-      printf("DAD\tH");
-      break;
-    case 0x2a:
-      printf("LHLD\t$%02x%02x", opcode[2], opcode[1]);
-      opbytes = 3;
-      break;
-    case 0x2b:
-      printf("DCX\tH");
-      break;
-    case 0x2c:
-      printf("INR\tL");
-      break;
-    case 0x2d:
-      printf("DCR\tL");
-      break;
-    case 0x2e:
-      printf("MVI\tL,#$%02x", opcode[1]);
-      opbytes = 2;
-      break;
-    case 0x2f:
-      printf("CMA");
-      break;
+  return false;
+}
 
-    case 0x30:
-      printf("NOP");
-      break;
-    case 0x31:
-      printf("LXI\tSP,#$%02x%02x", opcode[2], opcode[1]);
-      opbytes = 3;
-      break;
-    case 0x32:
-      printf("STA\t$%02x%02x", opcode[2], opcode[1]);
-      opbytes = 3;
-      break;
-    case 0x33:
-      printf("INX\tSP");
-      break;
-    case 0x34:
-      printf("INR\tM");
-      break;
-    case 0x35:
-      printf("DCR\tM");
-      break;
-    case 0x36:
-      printf("MVI\tM,#$%02x", opcode[1]);
-      opbytes = 2;
-      break;
-    case 0x37:
-      printf("STC");
-      break;
-    case 0x38:
-      printf("NOP");
-      break;
-    case 0x39:
-      printf("DAD\tSP");
-      break;
-    case 0x3a:
-      printf("LDA\t$%02x%02x", opcode[2], opcode[1]);
-      opbytes = 3;
-      break;
-    case 0x3b:
-      printf("DCX\tSP");
-      break;
-    case 0x3c:
-      printf("INR\tA");
-      break;
-    case 0x3d:
-      printf("DCR\tA");
-      break;
-    case 0x3e:
-      printf("MVI\tA,#$%02x", opcode[1]);
-      opbytes = 2;
-      break;
-    case 0x3f:
-      printf("CMC");
-      break;
+static void jit_emit(uint8_t** at, const void* bytes, const size_t count) {
+  memcpy(*at, bytes, count);
+  *at += count;
+}
 
-    case 0x40:
-      printf("MOV\tB,B");
-      break;
-    case 0x41:
-      printf("MOV\tB,C");
-      break;
-    case 0x42:
-      printf("MOV\tB,D");
-      break;
-    case 0x43:
-      printf("MOV\tB,E");
-      break;
-    case 0x44:
-      printf("MOV\tB,H");
-      break;
-    case 0x45:
-      printf("MOV\tB,L");
-      break;
-    case 0x46:
-      printf("MOV\tB,M");
-      break;
-    case 0x47:
-      printf("MOV\tB,A");
-      break;
-    case 0x48:
-      printf("MOV\tC,B");
-      break;
-    case 0x49:
-      printf("MOV\tC,C");
-      break;
-    case 0x4a:
-      printf("MOV\tC,D");
-      break;
-    case 0x4b:
-      printf("MOV\tC,E");
-      break;
-    case 0x4c:
-      printf("MOV\tC,H");
-      break;
-    case 0x4d:
-      printf("MOV\tC,L");
-      break;
-    case 0x4e:
-      printf("MOV\tC,M");
-      break;
-    case 0x4f:
-      printf("MOV\tC,A");
-      break;
+// instruction with a [rbx + offset] operand, opcode bytes then modrm and
+// 32-bit displacement, followed by an immediate of immediate_size bytes
+static void jit_emit_state(uint8_t** at,
+                           const void* opcode,
+                           const size_t opcode_size,
+                           const uint8_t reg,
+                           const int32_t offset,
+                           const uint32_t immediate,
+                           const size_t immediate_size) {
+  const uint8_t modrm = 0x80 | reg << 3 | 3;  // [rbx + disp32]
+
+  jit_emit(at, opcode, opcode_size);
+  jit_emit(at, &modrm, 1);
+  jit_emit(at, &offset, 4);
+  jit_emit(at, &immediate, immediate_size);  // little endian, low bytes first
+}
 
-    case 0x50:
-      printf("MOV\tD,B");
-      break;
-    case 0x51:
-      printf("MOV\tD,C");
-      break;
-    case 0x52:
-      printf("MOV\tD,D");
-      break;
-    case 0x53:
-      printf("MOV\tD.E");
-      break;
-    case 0x54:
-      printf("MOV\tD,H");
-      break;
-    case 0x55:
-      printf("MOV\tD,L");
-      break;
-    case 0x56:
-      printf("MOV\tD,M");
-      break;
-    case 0x57:
-      printf("MOV\tD,A");
-      break;
-    case 0x58:
-      printf("MOV\tE,B");
-      break;
-    case 0x59:
-      printf("MOV\tE,C");
-      break;
-    case 0x5a:
-      printf("MOV\tE,D");
-      break;
-    case 0x5b:
-      printf("MOV\tE,E");
-      break;
-    case 0x5c:
-      printf("MOV\tE,H");
-      break;
-    case 0x5d:
-      printf("MOV\tE,L");
-      break;
-    case 0x5e:
-      printf("MOV\tE,M");
-      break;
-    case 0x5f:
-      printf("MOV\tE,A");
-      break;
+// pop rbx; ret
+static void jit_emit_return(uint8_t** at) {
+  jit_emit(at, (uint8_t[]){0x5b, 0xc3}, 2);
+}
 
-    case 0x60:
-      printf("MOV\tH,B");
-      break;
-    case 0x61:
-      printf("MOV\tH,C");
-      break;
-    case 0x62:
-      printf("MOV\tH,D");
-      break;
-    case 0x63:
-      printf("MOV\tH.E");
-      break;
-    case 0x64:
-      printf("MOV\tH,H");
-      break;
-    case 0x65:
-      printf("MOV\tH,L");
-      break;
-    case 0x66:
-      printf("MOV\tH,M");
-      break;
-    case 0x67:
-      printf("MOV\tH,A");
-      break;
-    case 0x68:
-      printf("MOV\tL,B");
-      break;
-    case 0x69:
-      printf("MOV\tL,C");
-      break;
-    case 0x6a:
-      printf("MOV\tL,D");
-      break;
-    case 0x6b:
-      printf("MOV\tL,E");
-      break;
-    case 0x6c:
-      printf("MOV\tL,H");
-      break;
-    case 0x6d:
-      printf("MOV\tL,L");
-      break;
-    case 0x6e:
-      printf("MOV\tL,M");
-      break;
-    case 0x6f:
-      printf("MOV\tL,A");
-      break;
+// returns if cycles has reached run_deadline
+static void jit_emit_check(uint8_t** at) {
+  jit_emit_state(at, (uint8_t[]){0x48, 0x8b}, 2, 0,  // mov rax, cycles
+                 offsetof(i8080_t, cycles), 0, 0);
+  jit_emit_state(at, (uint8_t[]){0x48, 0x3b}, 2, 0,  // cmp rax, run_deadline
+                 offsetof(i8080_t, run_deadline), 0, 0);
+  jit_emit(at, (uint8_t[]){0x72, 0x02}, 2);  // jb over the return
+  jit_emit_return(at);
+}
 
-    case 0x70:
-      printf("MOV\tM,B");
-      break;
-    case 0x71:
-      printf("MOV\tM,C");
-      break;
-    case 0x72:
-      printf("MOV\tM,D");
-      break;
-    case 0x73:
-      printf("MOV\tM.E");
-      break;
-    case 0x74:
-      printf("MOV\tM,H");
-      break;
-    case 0x75:
-      printf("MOV\tM,L");
-      break;
-    case 0x76:
-      printf("HLT");
-      break;
-    case 0x77:
-      printf("MOV\tM,A");
-      break;
-    case 0x78:
-      printf("MOV\tA,B");
-      break;
-    case 0x79:
-      printf("MOV\tA,C");
-      break;
-    case 0x7a:
-      printf("MOV\tA,D");
-      break;
-    case 0x7b:
-      printf("MOV\tA,E");
-      break;
-    case 0x7c:
-      printf("MOV\tA,H");
-      break;
-    case 0x7d:
-      printf("MOV\tA,L");
-      break;
-    case 0x7e:
-      printf("MOV\tA,M");
-      break;
-    case 0x7f:
-      printf("MOV\tA,A");
-      break;
+static void jit_emit_add_pc(uint8_t** at, const uint8_t length) {
+  jit_emit_state(at, (uint8_t[]){0x66, 0x83}, 2, 0,  // add word pc, imm8
+                 offsetof(i8080_t, pc), length, 1);
+}
 
-    case 0x80:
-      printf("ADD\tB");
-      break;
-    case 0x81:
-      printf("ADD\tC");
-      break;
-    case 0x82:
-      printf("ADD\tD");
-      break;
-    case 0x83:
-      printf("ADD\tE");
-      break;
-    case 0x84:
-      printf("ADD\tH");
-      break;
-    case 0x85:
-      printf("ADD\tL");
-      break;
-    case 0x86:
-      printf("ADD\tM");
-      break;
-    case 0x87:
-      printf("ADD\tA");
-      break;
-    case 0x88:
-      printf("ADC\tB");
-      break;
-    case 0x89:
-      printf("ADC\tC");
-      break;
-    case 0x8a:
-      printf("ADC\tD");
-      break;
-    case 0x8b:
-      printf("ADC\tE");
+static void jit_emit_store(uint8_t** at, const int offset, const uint8_t byte) {
+  jit_emit_state(at, (uint8_t[]){0xc6}, 1, 0, offset, byte, 1);
+}
+
+// opcode points at a copy of the instruction bytes, address is where it is in
+// guest memory
+static void jit_emit_instruction(uint8_t** at,
+                                 const uint8_t* opcode,
+                                 const uint16_t address) {
+  const uint8_t op = opcode[0];
+  const int dst = JIT_REGISTERS[(op >> 3) & 7];
+  const int src = JIT_REGISTERS[op & 7];
+
+  if (op >= 0x40 && op < 0x80 && dst >= 0 && src >= 0) {  // MOV r, r
+    jit_emit_state(at, (uint8_t[]){0x8a}, 1, 0, src, 0, 0);  // mov al, src
+    jit_emit_state(at, (uint8_t[]){0x88}, 1, 0, dst, 0, 0);  // mov dst, al
+    jit_emit_add_pc(at, 1);
+  } else if ((op & 0xc7) == 0x00) {  // NOP and its aliases
+    jit_emit_add_pc(at, 1);
+  } else if ((op & 0xc7) == 0x06 && dst >= 0) {  // MVI r
+    jit_emit_store(at, dst, opcode[1]);
+    jit_emit_add_pc(at, 2);
+  } else if ((op & 0xcf) == 0x01) {  // LXI
+    const int pair = (op >> 4) & 3;
+    if (pair == 3) {
+      jit_emit_state(at, (uint8_t[]){0x66, 0xc7}, 2, 0,  // mov word sp, imm16
+                     offsetof(i8080_t, sp), (opcode[2] << 8) | opcode[1], 2);
+    } else {
+      jit_emit_store(at, JIT_REGISTERS[pair * 2], opcode[2]);
+      jit_emit_store(at, JIT_REGISTERS[pair * 2 + 1], opcode[1]);
+    }
+    jit_emit_add_pc(at, 3);
+  } else if ((op & 0xc7) == 0x03) {  // INX, DCX
+    const int pair = (op >> 4) & 3;
+    const bool dcx = op & 0x08;
+    if (pair == 3) {
+      jit_emit_state(at, (uint8_t[]){0x66, 0x83}, 2, dcx ? 5 : 0,  // sub/add
+                     offsetof(i8080_t, sp), 1, 1);
+    } else {
+      jit_emit_state(at, (uint8_t[]){0x80}, 1, dcx ? 5 : 0,  // sub/add low, 1
+                     JIT_REGISTERS[pair * 2 + 1], 1, 1);
+      jit_emit_state(at, (uint8_t[]){0x80}, 1, dcx ? 3 : 2,  // sbb/adc high, 0
+                     JIT_REGISTERS[pair * 2], 0, 1);
+    }
+    jit_emit_add_pc(at, 1);
+  } else if (op == 0xeb) {  // XCHG
+    for (int i = 0; i < 2; i++) {
+      const int hl = JIT_REGISTERS[4 + i];
+      const int de = JIT_REGISTERS[2 + i];
+      jit_emit_state(at, (uint8_t[]){0x8a}, 1, 0, hl, 0, 0);  // mov al, hl
+      jit_emit_state(at, (uint8_t[]){0x86}, 1, 0, de, 0, 0);  // xchg de, al
+      jit_emit_state(at, (uint8_t[]){0x88}, 1, 0, hl, 0, 0);  // mov hl, al
+    }
+    jit_emit_add_pc(at, 1);
+  } else if (op == 0xc3 || op == 0xcb) {  // JMP
+    jit_emit_state(at, (uint8_t[]){0x66, 0xc7}, 2, 0,  // mov word pc, imm16
+                   offsetof(i8080_t, pc), (opcode[2] << 8) | opcode[1], 2);
+#ifndef I8080_LAZY_FLAGS
+  } else if ((op & 0xc7) == 0xc2) {  // Jcc, tests cb directly when it's eager
+    static const uint8_t FLAGS[4] = {FLAG_Z, FLAG_C, FLAG_P, FLAG_S};
+    const uint8_t condition = (op >> 3) & 7;  // odd: jump when flag is set
+
+    jit_emit_state(at, (uint8_t[]){0x66, 0xc7}, 2, 0,  // mov word pc, next
+                   offsetof(i8080_t, pc), (uint16_t)(address + 3), 2);
+    jit_emit_state(at, (uint8_t[]){0xf6}, 1, 0,  // test byte cb, flag
+                   offsetof(i8080_t, cb), FLAGS[condition >> 1], 1);
+    // jz/jnz over the taken branch
+    jit_emit(at, (uint8_t[]){condition & 1 ? 0x74 : 0x75, 0x09}, 2);
+    jit_emit_state(at, (uint8_t[]){0x66, 0xc7}, 2, 0,  // mov word pc, target
+                   offsetof(i8080_t, pc), (opcode[2] << 8) | opcode[1], 2);
+#endif
+  } else {
+    const uint64_t handler = (uintptr_t)OPCODE_HANDLERS[op];
+    const uint64_t bytes = (uintptr_t)opcode;
+
+    jit_emit(at, (uint8_t[]){0x48, 0x89, 0xdf}, 3);  // mov rdi, rbx
+    jit_emit(at, (uint8_t[]){0x48, 0xbe}, 2);        // mov rsi, bytes
+    jit_emit(at, &bytes, 8);
+    jit_emit(at, (uint8_t[]){0x48, 0xb8}, 2);  // mov rax, handler
+    jit_emit(at, &handler, 8);
+    jit_emit(at, (uint8_t[]){0xff, 0xd0}, 2);  // call rax
+  }
+}
+
+static bool jit_can_translate(const i8080_t* state, const int page) {
+  if (state->jit->invalidations[page] >= JIT_MAX_INVALIDATIONS)
+    return false;  // self-modifying code, translating it again doesn't pay
+
+  return state->jit->trapped_pages[page] || plain_memory_page(state, page);
+}
+
+static void jit_trap_page(i8080_t* state, const int page) {
+  i8080_jit_t* jit = state->jit;
+
+  if (jit->trapped_pages[page] || !state->write_pages[page])
+    return;
+
+  jit->trapped_pages[page] = true;
+  jit->saved_write_pages[page] = state->write_pages[page];
+  state->write_pages[page] = NULL;
+}
+
+// drops translations of a page and gives it its write pointer back. a block
+// that is running stops after the current instruction
+static void jit_forget_page(i8080_t* state, const int page) {
+  i8080_jit_t* jit = state->jit;
+
+  if (!jit)
+    return;
+
+  for (int i = 0; i < I8080_PAGE_SIZE; i++) {
+    jit->blocks[page * I8080_PAGE_SIZE + i].code = NULL;
+    jit->hits[page * I8080_PAGE_SIZE + i] = 0;
+  }
+  memset(jit->code_bytes[page], 0, sizeof(jit->code_bytes[page]));
+
+  if (jit->trapped_pages[page]) {
+    jit->trapped_pages[page] = false;
+    state->write_pages[page] = jit->saved_write_pages[page];
+  }
+
+  state->run_deadline = 0;
+}
+
+// guest write to a trapped page, invalidates the page if it hits code
+static void jit_write(i8080_t* state,
+                      const uint16_t address,
+                      const uint8_t byte) {
+  i8080_jit_t* jit = state->jit;
+  const int page = address / I8080_PAGE_SIZE;
+  const int offset = address % I8080_PAGE_SIZE;
+  uint8_t* memory = jit->saved_write_pages[page];
+
+  if (jit->code_bytes[page][offset / 8] & (1 << offset % 8)) {
+    jit->invalidations[page]++;
+    jit_forget_page(state, page);
+  }
+
+  memory[offset] = byte;
+}
+
+static void jit_translate(i8080_t* state, const uint16_t start) {
+  i8080_jit_t* jit = state->jit;
+  const int page = start / I8080_PAGE_SIZE;
+
+  if (!jit_can_translate(state, page))
+    return;
+  if (jit->code_used + JIT_BLOCK_SPACE > JIT_CODE_SIZE)
+    i8080_jit_flush(state);
+
+  const uint8_t* memory = state->read_pages[page];
+  uint8_t* operands = &jit->code[jit->code_used];  // bytes handed to handlers
+  uint8_t* const entry = &operands[JIT_MAX_INSTRUCTIONS * 3];
+  uint8_t* at = entry;
+
+  // push rbx; mov rbx, rdi
+  jit_emit(&at, (uint8_t[]){0x53, 0x48, 0x89, 0xfb}, 4);
+
+  int offset = start % I8080_PAGE_SIZE;
+  uint32_t count = 0;
+  uint32_t cycles = 0;
+  bool check = false;  // previous instruction used the bus
+
+  while (count < JIT_MAX_INSTRUCTIONS) {
+    const uint8_t op = memory[offset];
+    const int length = OPCODE_LENGTHS[op];
+
+    if (offset + length > I8080_PAGE_SIZE)
+      break;  // left to the interpreter, which reads it through the bus
+
+    if (check)
+      jit_emit_check(&at);
+
+    uint8_t* opcode = &operands[count * 3];
+    memcpy(opcode, &memory[offset], length);
+
+    // add qword cycles, imm8
+    jit_emit_state(&at, (uint8_t[]){0x48, 0x83}, 2, 0,
+                   offsetof(i8080_t, cycles), OPCODE_CYCLES[op], 1);
+    jit_emit_instruction(&at, opcode, page * I8080_PAGE_SIZE + offset);
+    // add qword instructions, 1
+    jit_emit_state(&at, (uint8_t[]){0x48, 0x83}, 2, 0,
+                   offsetof(i8080_t, instructions), 1, 1);
+
+    for (int i = offset; i < offset + length; i++)
+      jit->code_bytes[page][i / 8] |= 1 << i % 8;
+
+    offset += length;
+    count++;
+    cycles += OPCODE_CYCLES[op];
+    check = jit_uses_bus(op);
+
+    if (ends_block(op))
       break;
-    case 0x8c:
-      printf("ADC\tH");
+  }
+
+  if (!count)
+    return;
+
+  jit_emit_return(&at);
+
+  const uint8_t last = operands[(count - 1) * 3];
+  const jit_code_t code = (jit_code_t)&jit->exec[entry - jit->code];
+  jit->blocks[start] = (jit_block_t){code, page * I8080_PAGE_SIZE + offset,
+                                     cycles - OPCODE_CYCLES[last]};
+  jit->code_used = (at - jit->code + 15) & ~(size_t)15;
+
+  jit_trap_page(state, page);
+}
+
+// runs the block at pc, translating it once it is hot, or a single instruction
+// through the interpreter
+__attribute__((always_inline)) static inline void jit_run(
+    i8080_t* state,
+    const run_mode_t mode,
+    const uint16_t until) {
+  i8080_jit_t* jit = state->jit;
+  const uint16_t start = state->pc;
+  const jit_block_t* block = &jit->blocks[start];
+
+  if (__builtin_expect(!block->code, 0) &&
+      ++jit->hits[start] >= JIT_HOT_COUNT) {
+    jit->hits[start] = 0;
+    jit_translate(state, start);
+  }
+
+  // blocks can't stop in front of the until pc, a breakpoint or the deadline,
+  // the interpreter runs those
+  if (block->code && state->cycles + block->cycles < state->run_deadline &&
+      !stops_within(state, mode, until, start, block->end)) {
+    block->code(state);
+#ifdef I8080_CHECK_HOOKS
+    block_exit(state);
+#endif
+    return;
+  }
+
+  dispatch(state);
+  state->instructions++;
+#ifdef I8080_CHECK_HOOKS
+  block_exit(state);
+#endif
+}
+
+bool i8080_jit_enable(i8080_t* state) {
+  if (state->jit)
+    return true;
+
+  i8080_jit_t* jit = calloc(1, sizeof(i8080_jit_t));
+  if (!jit)
+    return false;
+
+  const int fd = memfd_create("i8080-jit", MFD_CLOEXEC);
+  if (fd < 0) {
+    free(jit);
+    return false;
+  }
+
+  jit->code = jit->exec = MAP_FAILED;
+  if (ftruncate(fd, JIT_CODE_SIZE) == 0) {
+    jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     fd, 0);
+    jit->exec = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_EXEC, MAP_SHARED,
+                     fd, 0);
+  }
+  close(fd);  // the mappings keep it
+
+  if (jit->code == MAP_FAILED || jit->exec == MAP_FAILED) {
+    if (jit->code != MAP_FAILED)
+      munmap(jit->code, JIT_CODE_SIZE);
+    if (jit->exec != MAP_FAILED)
+      munmap(jit->exec, JIT_CODE_SIZE);
+    free(jit);
+    return false;
+  }
+
+  state->jit = jit;
+
+  return true;
+}
+
+void i8080_jit_disable(i8080_t* state) {
+  if (!state->jit)
+    return;
+
+  i8080_jit_flush(state);  // restores the write pointers of trapped pages
+
+  munmap(state->jit->code, JIT_CODE_SIZE);
+  munmap(state->jit->exec, JIT_CODE_SIZE);
+  free(state->jit);
+  state->jit = NULL;
+}
+
+void i8080_jit_flush(i8080_t* state) {
+  if (!state->jit)
+    return;
+
+  for (int page = 0; page < I8080_PAGE_COUNT; page++)
+    jit_forget_page(state, page);
+
+  memset(state->jit->invalidations, 0, sizeof(state->jit->invalidations));
+  state->jit->code_used = 0;
+}
+
+#else
+
+bool i8080_jit_enable(i8080_t* state) {
+  return false;  // not built with I8080_JIT
+}
+
+void i8080_jit_disable(i8080_t* state) {}
+
+void i8080_jit_flush(i8080_t* state) {}
+
+#endif  // I8080_JIT
+
+#ifdef I8080_BLOCK_CACHE
+
+// pre-decoded blocks for the interpreter. a block is a straight run of up to
+// BLOCK_MAX_OPS instructions within one page, ending at the first jump, call,
+// return, RST, HLT or EI, decoded into micro-ops so running it skips fetch and
+// the handler table. the run deadline is compared between micro-ops exactly as
+// in the plain loop, blocks holding the until pc or a breakpoint after their
+// first instruction are left to it
+
+// superinstruction handlers call both table handlers, which the compiler
+// inlines into one body. the deadline is compared between the two as the plain
+// loop would, blocks holding the until pc are not run at all
+#define FUSED_HANDLER(first, second, name)                                  \
+  static uint32_t fused_##first##_##second(i8080_t* state,                 \
+                                           const uint8_t* opcode) {        \
+    op_##first(state, opcode);                                             \
+    if (state->cycles >= state->run_deadline)                              \
+      return 1;                                                            \
+                                                                           \
+    state->cycles += OPCODE_CYCLES[0x##second];                            \
+    op_##second(state, &opcode[OPCODE_LENGTHS[0x##first]]);                \
+    state->block_cache->fusions[FUSED_##first##_##second]++;               \
+                                                                           \
+    return 2;                                                              \
+  }
+FUSED_PAIRS(FUSED_HANDLER)
+#undef FUSED_HANDLER
+
+#define FUSED_PAIR(first, second, name) \
+  {0x##first, 0x##second, fused_##first##_##second, name},
+static const struct {
+  uint8_t first, second;
+  uint32_t (*handler)(i8080_t* state, const uint8_t* opcode);
+  const char* name;
+} FUSED[FUSED_PAIR_COUNT] = {FUSED_PAIRS(FUSED_PAIR)};
+#undef FUSED_PAIR
+
+// superinstruction for the pair of opcodes, -1 if there is none
+static int fused_pair(const uint8_t first, const uint8_t second) {
+  for (int i = 0; i < FUSED_PAIR_COUNT; i++) {
+    if (FUSED[i].first == first && FUSED[i].second == second)
+      return i;
+  }
+
+  return -1;
+}
+
+// outdates the blocks of a page and gives it its write pointer back. a block
+// that is running stops after the current instruction
+static void block_cache_forget_page(i8080_t* state, const int page) {
+  i8080_block_cache_t* cache = state->block_cache;
+
+  if (!cache)
+    return;
+
+  cache->generations[page]++;
+  memset(cache->code_bytes[page], 0, sizeof(cache->code_bytes[page]));
+
+  if (cache->trapped_pages[page]) {
+    cache->trapped_pages[page] = false;
+    state->write_pages[page] = cache->saved_write_pages[page];
+  }
+
+  state->run_deadline = 0;
+}
+
+// guest write to a trapped page, outdates the page if it hits decoded code
+static void block_cache_write(i8080_t* state,
+                              const uint16_t address,
+                              const uint8_t byte) {
+  i8080_block_cache_t* cache = state->block_cache;
+  const int page = address / I8080_PAGE_SIZE;
+  const int offset = address % I8080_PAGE_SIZE;
+  uint8_t* memory = cache->saved_write_pages[page];
+
+  if (cache->code_bytes[page][offset / 8] & (1 << offset % 8))
+    block_cache_forget_page(state, page);
+
+  memory[offset] = byte;
+}
+
+static bool block_decode(i8080_t* state,
+                         decoded_block_t* block,
+                         const uint16_t start) {
+  i8080_block_cache_t* cache = state->block_cache;
+  const int page = start / I8080_PAGE_SIZE;
+  const uint8_t* memory = state->read_pages[page];
+
+  block->start = UINT32_MAX;
+
+  if (!cache->trapped_pages[page] && !plain_memory_page(state, page))
+    return false;
+
+  int offset = start % I8080_PAGE_SIZE;
+  uint32_t count = 0;
+
+  while (count < BLOCK_MAX_OPS) {
+    const uint8_t op = memory[offset];
+    int length = OPCODE_LENGTHS[op];
+
+    if (offset + length > I8080_PAGE_SIZE)
+      break;  // left to the interpreter, which reads it through the bus
+
+    micro_op_t* micro_op = &block->ops[count];
+    micro_op->handler = OPCODE_HANDLERS[op];
+    micro_op->cycles = OPCODE_CYCLES[op];
+    micro_op->fused = false;
+
+    // none of the first opcodes ends a block, the second one may
+    bool last = ends_block(op);
+    if (offset + length < I8080_PAGE_SIZE) {
+      const uint8_t next = memory[offset + length];
+      const int pair = fused_pair(op, next);
+
+      if (pair >= 0 &&
+          offset + length + OPCODE_LENGTHS[next] <= I8080_PAGE_SIZE) {
+        micro_op->fused_handler = FUSED[pair].handler;
+        micro_op->fused = true;
+        length += OPCODE_LENGTHS[next];
+        last = ends_block(next);
+      }
+    }
+
+    for (int i = 0; i < length; i++) {
+      micro_op->opcode[i] = memory[offset + i];
+      cache->code_bytes[page][(offset + i) / 8] |= 1 << (offset + i) % 8;
+    }
+
+    offset += length;
+    count++;
+
+    if (last)
       break;
-    case 0x8d:
-      printf("ADC\tL");
+  }
+
+  if (!count)
+    return false;
+
+  block->start = start;
+  block->end = page * I8080_PAGE_SIZE + offset;
+  block->generation = cache->generations[page];
+  block->count = count;
+
+  if (!cache->trapped_pages[page] && state->write_pages[page]) {
+    cache->trapped_pages[page] = true;
+    cache->saved_write_pages[page] = state->write_pages[page];
+    state->write_pages[page] = NULL;
+  }
+
+  return true;
+}
+
+// runs the block at pc, decoding it first if it isn't cached or outdated, or a
+// single instruction if it can't be decoded. returns instructions executed
+__attribute__((always_inline)) static inline void block_run(
+    i8080_t* state,
+    const run_mode_t mode,
+    const uint16_t until) {
+  i8080_block_cache_t* cache = state->block_cache;
+  const uint16_t start = state->pc;
+  decoded_block_t* block = &cache->blocks[start % BLOCK_CACHE_SIZE];
+
+  if ((__builtin_expect(block->start != start ||
+                            block->generation !=
+                                cache->generations[start / I8080_PAGE_SIZE],
+                        0) &&
+       !block_decode(state, block, start)) ||
+      stops_within(state, mode, until, start, block->end)) {
+    // superinstructions can't stop in front of the until pc or a breakpoint
+    dispatch(state);
+    state->instructions++;
+#ifdef I8080_CHECK_HOOKS
+    block_exit(state);
+#endif
+    return;
+  }
+
+  const micro_op_t* micro_op = block->ops;
+  const micro_op_t* end = &block->ops[block->count];
+
+  // only the last micro-op can jump, the until pc and breakpoints were ruled
+  // out above
+  do {
+    state->cycles += micro_op->cycles;
+    if (micro_op->fused) {
+      state->instructions += micro_op->fused_handler(state, micro_op->opcode);
+    } else {
+      micro_op->handler(state, micro_op->opcode);
+      state->instructions++;
+    }
+    micro_op++;
+  } while (micro_op != end && state->cycles < state->run_deadline);
+#ifdef I8080_CHECK_HOOKS
+  block_exit(state);
+#endif
+}
+
+bool i8080_block_cache_enable(i8080_t* state) {
+  if (state->block_cache)
+    return true;
+
+  i8080_block_cache_t* cache = calloc(1, sizeof(i8080_block_cache_t));
+  if (!cache)
+    return false;
+
+  for (int i = 0; i < BLOCK_CACHE_SIZE; i++)
+    cache->blocks[i].start = UINT32_MAX;
+
+  state->block_cache = cache;
+
+  return true;
+}
+
+void i8080_block_cache_disable(i8080_t* state) {
+  if (!state->block_cache)
+    return;
+
+  i8080_block_cache_flush(state);  // restores the write pointers
+
+  free(state->block_cache);
+  state->block_cache = NULL;
+}
+
+void i8080_block_cache_flush(i8080_t* state) {
+  for (int page = 0; page < I8080_PAGE_COUNT; page++)
+    block_cache_forget_page(state, page);
+}
+
+const char* i8080_block_cache_fusion(const i8080_t* state,
+                                     const int index,
+                                     uint64_t* executed) {
+  if (index < 0 || index >= FUSED_PAIR_COUNT)
+    return NULL;
+
+  *executed = state->block_cache ? state->block_cache->fusions[index] : 0;
+
+  return FUSED[index].name;
+}
+
+#else
+
+bool i8080_block_cache_enable(i8080_t* state) {
+  return false;  // not built with I8080_BLOCK_CACHE
+}
+
+void i8080_block_cache_disable(i8080_t* state) {}
+
+void i8080_block_cache_flush(i8080_t* state) {}
+
+const char* i8080_block_cache_fusion(const i8080_t* state,
+                                     const int index,
+                                     uint64_t* executed) {
+  return NULL;
+}
+
+#endif  // I8080_BLOCK_CACHE
+
+#if defined(I8080_TRACE) || defined(I8080_PROFILE)
+// the instruction at pc for the tracer and profiler, before it runs. the bytes
+// are taken from the page table, an instruction in handler pages is read
+// through the handler twice
+static void peek_instruction(i8080_t* state, uint8_t* opcode) {
+  for (int i = 0; i < 3; i++) {
+    const uint16_t address = state->pc + i;
+    const uint8_t* page = host_read_page(state, address / I8080_PAGE_SIZE);
+    opcode[i] =
+        page ? page[address % I8080_PAGE_SIZE] : read_byte_slow(state, address);
+    if (i + 1 == OPCODE_LENGTHS[opcode[0]])
       break;
-    case 0x8e:
-      printf("ADC\tM");
+  }
+}
+#endif
+
+#ifdef I8080_TRACE
+
+// trace recorder. the cpu's thread encodes a record per instruction into the
+// ring, a writer thread streams the ring to file in TRACE_CHUNK pieces. the
+// cpu only waits when the ring is full
+
+static void* trace_writer(void* context) {
+  i8080_trace_t* trace = context;
+  bool stopping = false;
+
+  while (!stopping) {
+    pthread_mutex_lock(&trace->lock);
+    while (!trace->stopping &&
+           atomic_load(&trace->head) - atomic_load(&trace->tail) < TRACE_CHUNK)
+      pthread_cond_wait(&trace->data, &trace->lock);
+    stopping = trace->stopping;
+    pthread_mutex_unlock(&trace->lock);
+
+    // everything so far, in at most two pieces where the ring wraps
+    const size_t head =
+        atomic_load_explicit(&trace->head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&trace->tail, memory_order_relaxed);
+    while (tail != head) {
+      const size_t offset = tail & (TRACE_RING_SIZE - 1);
+      size_t count = head - tail;
+      if (count > TRACE_RING_SIZE - offset)
+        count = TRACE_RING_SIZE - offset;
+
+      if (!trace->failed &&
+          fwrite(&trace->ring[offset], 1, count, trace->file) != count)
+        trace->failed = true;
+      tail += count;
+    }
+    atomic_store_explicit(&trace->tail, tail, memory_order_release);
+
+    pthread_mutex_lock(&trace->lock);
+    pthread_cond_signal(&trace->space);
+    pthread_mutex_unlock(&trace->lock);
+  }
+
+  return NULL;
+}
+
+// room for the longest record at head, waits for the writer if the ring is
+// that full. returns where the record goes, it may run into the slack past
+// the end of the ring
+static uint8_t* trace_reserve(i8080_trace_t* trace, const size_t head) {
+  if (head + TRACE_RECORD_SIZE -
+          atomic_load_explicit(&trace->tail, memory_order_acquire) >
+      TRACE_RING_SIZE) {
+    pthread_mutex_lock(&trace->lock);
+    pthread_cond_signal(&trace->data);
+    while (head + TRACE_RECORD_SIZE - atomic_load(&trace->tail) >
+           TRACE_RING_SIZE)
+      pthread_cond_wait(&trace->space, &trace->lock);
+    pthread_mutex_unlock(&trace->lock);
+  }
+
+  return &trace->ring[head & (TRACE_RING_SIZE - 1)];
+}
+
+// hands the record at head to the writer, wrapping what went into the slack
+static void trace_commit(i8080_trace_t* trace,
+                         const size_t head,
+                         const size_t length) {
+  const size_t end = (head & (TRACE_RING_SIZE - 1)) + length;
+
+  if (end > TRACE_RING_SIZE)
+    memcpy(trace->ring, &trace->ring[TRACE_RING_SIZE], end - TRACE_RING_SIZE);
+  atomic_store_explicit(&trace->head, head + length, memory_order_release);
+
+  if (head + length - trace->signalled >= TRACE_CHUNK) {
+    pthread_mutex_lock(&trace->lock);
+    pthread_cond_signal(&trace->data);
+    pthread_mutex_unlock(&trace->lock);
+    trace->signalled = head + length;
+  }
+}
+
+static void trace_registers(const i8080_t* state, uint8_t* registers) {
+  registers[0] = state->b;
+  registers[1] = state->c;
+  registers[2] = state->d;
+  registers[3] = state->e;
+  registers[4] = state->h;
+  registers[5] = state->l;
+  registers[6] = state->a;
+  registers[7] = state->cb.byte;
+}
+
+static void trace_begin(i8080_t* state) {
+  i8080_trace_t* trace = state->trace;
+
+  trace->write_count = 0;
+  trace->recording = true;
+}
+
+// encodes the record of the instruction at pc straight into the ring, opcode
+// NULL for an interrupt restarting at pc. everything is relative to the
+// previous record
+static void trace_end(i8080_t* state,
+                      const uint16_t pc,
+                      const uint8_t* opcode) {
+  i8080_trace_t* trace = state->trace;
+  const size_t head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+  uint8_t* record = trace_reserve(trace, head);
+  size_t length = 1;
+  uint8_t tag = 0;
+
+  trace->recording = false;
+  flags_sync(state);
+
+  if (pc != trace->next_pc || !opcode) {
+    tag |= I8080_TRACE_PC;
+    record[length++] = pc & 0xff;
+    record[length++] = pc >> 8;
+  }
+
+  if (opcode) {
+    const int size = OPCODE_LENGTHS[opcode[0]];
+    record[length] = opcode[0];
+    record[length + 1] = opcode[1];
+    record[length + 2] = opcode[2];
+    length += size;
+    trace->next_pc = pc + size;
+  } else {
+    tag |= I8080_TRACE_INTERRUPT;
+    trace->next_pc = pc;
+  }
+
+  uint8_t registers[8];
+  trace_registers(state, registers);
+  uint8_t changed = 0;
+  for (int i = 0; i < 8; i++)
+    changed |= (registers[i] != trace->registers[i]) << i;
+  if (changed) {
+    tag |= I8080_TRACE_REGISTERS;
+    record[length++] = changed;
+    for (int i = 0; i < 8; i++) {
+      if ((changed >> i) & 1)
+        record[length++] = registers[i];
+    }
+    memcpy(trace->registers, registers, sizeof(registers));
+  }
+
+  if (state->sp != trace->sp) {
+    tag |= I8080_TRACE_SP;
+    record[length++] = state->sp & 0xff;
+    record[length++] = state->sp >> 8;
+    trace->sp = state->sp;
+  }
+
+  if (trace->write_count) {
+    tag |= I8080_TRACE_WRITES;
+    record[length++] = trace->write_count & 0xff;
+    record[length++] = trace->write_count >> 8;
+    for (int i = 0; i < trace->write_count; i++) {
+      record[length++] = trace->writes[i].address & 0xff;
+      record[length++] = trace->writes[i].address >> 8;
+      record[length++] = trace->writes[i].byte;
+    }
+  }
+
+  record[0] = tag;
+  trace_commit(trace, head, length);
+}
+
+// runs the instruction at pc and records it
+static void trace_instruction(i8080_t* state) {
+  const uint16_t pc = state->pc;
+  uint8_t opcode[3];
+
+  peek_instruction(state, opcode);
+  trace_begin(state);
+  dispatch(state);
+  trace_end(state, pc, opcode);
+}
+
+bool i8080_trace_start(i8080_t* state, const char* file_name) {
+  if (state->trace)
+    return false;
+
+  i8080_trace_t* trace = calloc(1, sizeof(i8080_trace_t));
+  if (!trace)
+    return false;
+
+  trace->ring = malloc(TRACE_RING_SIZE + TRACE_RECORD_SIZE);
+  trace->file = fopen(file_name, "wb");
+  if (!trace->ring || !trace->file) {
+    if (trace->file)
+      fclose(trace->file);
+    free(trace->ring);
+    free(trace);
+    return false;
+  }
+
+  // header, the registers everything else is relative to
+  flags_sync(state);
+  uint8_t header[sizeof(I8080_TRACE_MAGIC) - 1 + 1 + 12];
+  memcpy(header, I8080_TRACE_MAGIC, sizeof(I8080_TRACE_MAGIC) - 1);
+  header[8] = I8080_TRACE_VERSION;
+  header[9] = state->pc & 0xff;
+  header[10] = state->pc >> 8;
+  header[11] = state->sp & 0xff;
+  header[12] = state->sp >> 8;
+  header[13] = state->a;
+  header[14] = state->b;
+  header[15] = state->c;
+  header[16] = state->d;
+  header[17] = state->e;
+  header[18] = state->h;
+  header[19] = state->l;
+  header[20] = state->cb.byte;
+  fwrite(header, 1, sizeof(header), trace->file);
+
+  trace_registers(state, trace->registers);
+  trace->sp = state->sp;
+  trace->next_pc = state->pc;
+  pthread_mutex_init(&trace->lock, NULL);
+  pthread_cond_init(&trace->data, NULL);
+  pthread_cond_init(&trace->space, NULL);
+  if (pthread_create(&trace->writer, NULL, trace_writer, trace) != 0) {
+    fclose(trace->file);
+    free(trace->ring);
+    free(trace);
+    return false;
+  }
+
+  state->trace = trace;
+
+  return true;
+}
+
+bool i8080_trace_stop(i8080_t* state) {
+  i8080_trace_t* trace = state->trace;
+  if (!trace)
+    return false;
+
+  pthread_mutex_lock(&trace->lock);
+  trace->stopping = true;
+  pthread_cond_signal(&trace->data);
+  pthread_mutex_unlock(&trace->lock);
+  pthread_join(trace->writer, NULL);
+
+  const bool written = !trace->failed && fclose(trace->file) == 0;
+  if (trace->failed)
+    fclose(trace->file);
+
+  pthread_mutex_destroy(&trace->lock);
+  pthread_cond_destroy(&trace->data);
+  pthread_cond_destroy(&trace->space);
+  free(trace->ring);
+  free(trace);
+  state->trace = NULL;
+
+  return written;
+}
+
+#else
+
+bool i8080_trace_start(i8080_t* state, const char* file_name) {
+  return false;  // not built with I8080_TRACE
+}
+
+bool i8080_trace_stop(i8080_t* state) {
+  return false;
+}
+
+#endif  // I8080_TRACE
+
+#ifdef I8080_PROFILE
+
+// profiler. every instruction is counted by opcode and address, calls and
+// returns are followed on a shadow stack to attribute cycles to functions
+
+// the edge slot of caller calling callee, -1 once the table is full
+static int profile_edge(i8080_profile_t* profile,
+                        const uint16_t caller,
+                        const uint16_t callee) {
+  const uint32_t key = (caller << 16) | callee;
+  uint32_t slot = (key * 2654435761u) >> 20;  // 12 bits, I8080_PROFILE_EDGES
+
+  for (int probes = 0; probes < I8080_PROFILE_EDGES; probes++) {
+    i8080_profile_edge_t* edge = &profile->edges[slot];
+    if (edge->calls && edge->caller == caller && edge->callee == callee)
+      return slot;
+    if (!edge->calls) {
+      if (profile->edge_count == I8080_PROFILE_EDGES - 1)
+        break;  // one slot stays free so lookups end
+      edge->caller = caller;
+      edge->callee = callee;
+      profile->edge_count++;
+      return slot;
+    }
+    slot = (slot + 1) & (I8080_PROFILE_EDGES - 1);
+  }
+
+  return -1;
+}
+
+// entered function at pc, with the return address just pushed
+static void profile_call(i8080_t* state) {
+  i8080_profile_t* profile = state->profile;
+  const uint16_t function = state->pc;
+
+  profile->calls[function]++;
+  if (profile->depth == I8080_PROFILE_DEPTH)
+    return;  // its cycles go to the deepest function followed
+
+  const int edge = profile_edge(
+      profile, profile->stack[profile->depth - 1].function, function);
+  if (edge >= 0)
+    profile->edges[edge].calls++;
+  else
+    profile->lost_calls++;
+
+  profile->stack[profile->depth++] =
+      (i8080_profile_frame_t){function, state->sp, edge, state->cycles};
+  profile->active[function]++;
+}
+
+static void profile_pop(i8080_profile_t* profile, const uint64_t cycles) {
+  const i8080_profile_frame_t* frame = &profile->stack[--profile->depth];
+  // none if the count went back past the call, a restore
+  const uint64_t spent = cycles > frame->start ? cycles - frame->start : 0;
+
+  // only the outermost frame of a recursive function adds to its total
+  if (--profile->active[frame->function] == 0)
+    profile->total_cycles[frame->function] += spent;
+  if (frame->edge >= 0)
+    profile->edges[frame->edge].cycles += spent;
+}
+
+static void profile_interrupt(i8080_t* state) {
+  i8080_profile_t* profile = state->profile;
+
+  // the restart's cycles belong to whatever was interrupted
+  profile->self_cycles[profile->stack[profile->depth - 1].function] +=
+      OPCODE_CYCLES[0xc7];
+  profile_call(state);
+}
+
+// runs the instruction at pc, traced too if recording, and counts it
+static void profile_instruction(i8080_t* state) {
+  i8080_profile_t* profile = state->profile;
+  const uint16_t pc = state->pc;
+  const uint16_t sp = state->sp;
+  const uint64_t start = state->cycles;
+  uint8_t* opcode = &profile->code[pc];
+
+  peek_instruction(state, opcode);
+
+#ifdef I8080_TRACE
+  if (state->trace)
+    trace_instruction(state);
+  else
+#endif
+    dispatch(state);
+
+  const uint64_t cycles = state->cycles - start;
+  profile->opcode_count[opcode[0]]++;
+  profile->opcode_cycles[opcode[0]] += cycles;
+  profile->pc_count[pc]++;
+  profile->pc_cycles[pc] += cycles;
+  profile->self_cycles[profile->stack[profile->depth - 1].function] += cycles;
+
+  // CALL, Ccc and RST push the return address, RET and Rcc pop it when taken
+  const bool call = (opcode[0] & 0xc7) == 0xc4 || (opcode[0] & 0xc7) == 0xc7 ||
+                    (opcode[0] & 0xcf) == 0xcd;
+  const bool ret = (opcode[0] & 0xc7) == 0xc0 || (opcode[0] & 0xef) == 0xc9;
+
+  if (call && state->sp == (uint16_t)(sp - 2)) {
+    profile_call(state);
+  } else if (ret && state->sp == (uint16_t)(sp + 2)) {
+    // frames the stack has moved past, those left without a RET too
+    while (profile->depth > 1 &&
+           profile->stack[profile->depth - 1].sp < state->sp)
+      profile_pop(profile, state->cycles);
+  }
+}
+
+bool i8080_profile_start(i8080_t* state) {
+  if (state->profile)
+    return false;
+
+  i8080_profile_t* profile = calloc(1, sizeof(i8080_profile_t));
+  if (!profile)
+    return false;
+
+  profile->stack[0] = (i8080_profile_frame_t){state->pc, 0xffff, -1, 0};
+  profile->depth = 1;
+  profile->active[state->pc] = 1;  // calls back into it don't add to its total
+  state->profile = profile;
+
+  return true;
+}
+
+bool i8080_profile_save(const i8080_t* state, const char* file_name) {
+  if (!state->profile)
+    return false;
+
+  // functions still running count up to now, on a copy so profiling goes on.
+  // everything ran under the first one
+  i8080_profile_t* profile = malloc(sizeof(i8080_profile_t));
+  if (!profile)
+    return false;
+  memcpy(profile, state->profile, sizeof(i8080_profile_t));
+  while (profile->depth > 1)
+    profile_pop(profile, state->cycles);
+  uint64_t* root = &profile->total_cycles[profile->stack[0].function];
+  *root = 0;
+  for (int i = 0; i < I8080_MAX_MEMORY; i++)
+    *root += profile->self_cycles[i];
+
+  FILE* file = fopen(file_name, "wb");
+  const uint8_t version = I8080_PROFILE_VERSION;
+  bool written =
+      file &&
+      fwrite(I8080_PROFILE_MAGIC, sizeof(I8080_PROFILE_MAGIC) - 1, 1, file) ==
+          1 &&
+      fwrite(&version, 1, 1, file) == 1 &&
+      fwrite(profile, sizeof(i8080_profile_t), 1, file) == 1;
+  if (file)
+    written = fclose(file) == 0 && written;
+
+  free(profile);
+
+  return written;
+}
+
+void i8080_profile_stop(i8080_t* state) {
+  free(state->profile);
+  state->profile = NULL;
+}
+
+#else
+
+bool i8080_profile_start(i8080_t* state) {
+  return false;  // not built with I8080_PROFILE
+}
+
+bool i8080_profile_save(const i8080_t* state, const char* file_name) {
+  return false;
+}
+
+void i8080_profile_stop(i8080_t* state) {}
+
+#endif  // I8080_PROFILE
+
+bool i8080_check_hooks(i8080_t* state, i8080_check_hooks_t* hooks) {
+#ifdef I8080_CHECK_HOOKS
+  state->check_hooks = hooks;
+  return true;
+#else
+  return false;  // not built with I8080_CHECK_HOOKS
+#endif
+}
+
+// timed events are kept in a binary min-heap on time, events[0] is next due
+static void event_heap_up(i8080_t* state, int index) {
+  i8080_event_t* events = state->events;
+
+  while (index > 0) {
+    const int parent = (index - 1) / 2;
+    if (events[parent].time <= events[index].time)
       break;
-    case 0x8f:
-      printf("ADC\tA");
+
+    const i8080_event_t temp = events[parent];
+    events[parent] = events[index];
+    events[index] = temp;
+    index = parent;
+  }
+}
+
+static void event_heap_down(i8080_t* state, int index) {
+  i8080_event_t* events = state->events;
+
+  while (1) {
+    const int left = 2 * index + 1;
+    const int right = left + 1;
+    int smallest = index;
+
+    if (left < state->event_count && events[left].time < events[smallest].time)
+      smallest = left;
+    if (right < state->event_count &&
+        events[right].time < events[smallest].time)
+      smallest = right;
+    if (smallest == index)
       break;
 
-    case 0x90:
-      printf("SUB\tB");
-      break;
-    case 0x91:
-      printf("SUB\tC");
-      break;
-    case 0x92:
-      printf("SUB\tD");
-      break;
-    case 0x93:
-      printf("SUB\tE");
-      break;
-    case 0x94:
-      printf("SUB\tH");
-      break;
-    case 0x95:
-      printf("SUB\tL");
-      break;
-    case 0x96:
-      printf("SUB\tM");
-      break;
-    case 0x97:
-      printf("SUB\tA");
-      break;
-    case 0x98:
-      printf("SBB\tB");
-      break;
-    case 0x99:
-      printf("SBB\tC");
-      break;
-    case 0x9a:
-      printf("SBB\tD");
-      break;
-    case 0x9b:
-      printf("SBB\tE");
-      break;
-    case 0x9c:
-      printf("SBB\tH");
-      break;
-    case 0x9d:
-      printf("SBB\tL");
-      break;
-    case 0x9e:
-      printf("SBB\tM");
-      break;
-    case 0x9f:
-      printf("SBB\tA");
-      break;
+    const i8080_event_t temp = events[smallest];
+    events[smallest] = events[index];
+    events[index] = temp;
+    index = smallest;
+  }
+}
+
+static void event_heap_remove(i8080_t* state, const int index) {
+  state->event_count--;
+  state->events[index] = state->events[state->event_count];
+
+  event_heap_down(state, index);
+  event_heap_up(state, index);
+}
+
+bool i8080_schedule(i8080_t* state,
+                    const uint64_t time,
+                    const i8080_event_handler_t handler,
+                    void* context) {
+  if (state->event_count == I8080_MAX_EVENTS)
+    return false;
+
+  state->events[state->event_count] = (i8080_event_t){time, handler, context};
+  event_heap_up(state, state->event_count);
+  state->event_count++;
+
+  // a running batch loop picks the new event up at its next check
+  if (time < state->run_deadline)
+    state->run_deadline = time;
+
+  return true;
+}
+
+int i8080_cancel(i8080_t* state,
+                 const i8080_event_handler_t handler,
+                 void* context) {
+  int cancelled = 0;
+
+  for (int i = state->event_count - 1; i >= 0; i--) {
+    if (state->events[i].handler == handler &&
+        state->events[i].context == context) {
+      event_heap_remove(state, i);
+      cancelled++;
+      i = state->event_count;  // heap was reordered, rescan
+    }
+  }
+
+  return cancelled;
+}
+
+uint64_t i8080_next_event(const i8080_t* state) {
+  return state->event_count ? state->events[0].time : UINT64_MAX;
+}
+
+// appends to the log being recorded
+static void replay_append(i8080_replay_t* replay,
+                          const i8080_replay_entry_t entry) {
+  if (replay->failed)
+    return;
+
+  if (replay->count == replay->capacity) {
+    const size_t capacity = replay->capacity ? replay->capacity * 2 : 4096;
+    i8080_replay_entry_t* entries =
+        realloc(replay->entries, capacity * sizeof(i8080_replay_entry_t));
+    if (!entries) {
+      replay->failed = true;
+      return;
+    }
+
+    replay->entries = entries;
+    replay->capacity = capacity;
+  }
+
+  replay->entries[replay->count++] = entry;
+}
+
+// the machine left the log, the run ends there
+static void replay_diverge(i8080_t* state) {
+  i8080_replay_t* replay = state->replay;
+
+  if (replay->diverged)
+    return;
+
+  replay->diverged = true;
+  replay->divergence = state->cycles;
+  if (!state->stop)
+    state->stop = I8080_STOP_DIVERGED;
+  state->run_deadline = 0;  // as i8080_stop
+}
+
+static uint8_t replay_in(i8080_t* state, const uint8_t port) {
+  i8080_replay_t* replay = state->replay;
+
+  if (!replay->replaying) {
+    const uint8_t value = device_in(state, port);
+    replay_append(replay, (i8080_replay_entry_t){state->cycles, I8080_REPLAY_IN,
+                                                  port, value, 0});
+    return value;
+  }
+
+  size_t next = replay->next_in;
+  while (next < replay->count &&
+         replay->entries[next].kind != I8080_REPLAY_IN)
+    next++;
+
+  if (!replay->diverged && next < replay->count &&
+      replay->entries[next].cycles == state->cycles &&
+      replay->entries[next].port == port) {
+    replay->next_in = next + 1;
+    return replay->entries[next].value;
+  }
+
+  replay_diverge(state);
+
+  return device_in(state, port);
+}
+
+// an interrupt request from a device or host code, logged when recording.
+// false when it is dropped: replaying, the log raises them
+static bool replay_request(i8080_t* state, const uint16_t vector) {
+  i8080_replay_t* replay = state->replay;
+
+  if (replay->replaying)
+    return replay->diverged;  // the devices have taken over
+
+  replay_append(replay, (i8080_replay_entry_t){state->cycles,
+                                               I8080_REPLAY_INTERRUPT, 0, 0,
+                                               vector});
+
+  return true;
+}
+
+static void replay_schedule(i8080_t* state);
+
+// event of the logged interrupt at next_interrupt
+static void replay_interrupt(i8080_t* state, void* context) {
+  i8080_replay_t* replay = context;
+
+  if (replay->diverged)
+    return;
+
+  request_interrupt(state, replay->entries[replay->next_interrupt++].vector);
+  replay_schedule(state);
+}
+
+// schedules the next logged interrupt, an event at the cycle count it was
+// raised at fires after the same instruction
+static void replay_schedule(i8080_t* state) {
+  i8080_replay_t* replay = state->replay;
+
+  while (replay->next_interrupt < replay->count &&
+         replay->entries[replay->next_interrupt].kind !=
+             I8080_REPLAY_INTERRUPT)
+    replay->next_interrupt++;
+
+  if (replay->diverged || replay->next_interrupt == replay->count)
+    return;
+
+  if (!i8080_schedule(state, replay->entries[replay->next_interrupt].cycles,
+                      replay_interrupt, replay))
+    replay_diverge(state);
+}
+
+// the machine's cycle count changed under the log (a snapshot was restored),
+// entries up to it are in the past
+static void replay_seek(i8080_t* state) {
+  i8080_replay_t* replay = state->replay;
+  size_t low = 0;
+  size_t high = replay->count;
+
+  // first entry after the cycle count
+  while (low < high) {
+    const size_t middle = low + (high - low) / 2;
+    if (replay->entries[middle].cycles <= state->cycles)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  if (!replay->replaying) {
+    replay->count = low;  // recording goes on from here
+    return;
+  }
+
+  i8080_cancel(state, replay_interrupt, replay);
+  replay->next_in = low;
+  replay->next_interrupt = low;
+  replay->diverged = false;
+  replay_schedule(state);
+}
+
+void i8080_replay_record(i8080_t* state, i8080_replay_t* replay) {
+  i8080_replay_stop(state);
+
+  replay->replaying = false;
+  state->replay = replay;
+}
+
+void i8080_replay_play(i8080_t* state, i8080_replay_t* replay) {
+  i8080_replay_stop(state);
+
+  replay->replaying = true;
+  replay->next_in = 0;
+  replay->next_interrupt = 0;
+  replay->diverged = false;
+  state->replay = replay;
+
+  replay_schedule(state);
+}
+
+void i8080_replay_stop(i8080_t* state) {
+  if (state->replay && state->replay->replaying)
+    i8080_cancel(state, replay_interrupt, state->replay);
+
+  state->replay = NULL;
+}
+
+static inline bool event_due(const i8080_t* state) {
+  return state->event_count && state->events[0].time <= state->cycles;
+}
+
+// runs handlers of all events that are due, in time order. handlers may
+// schedule further events, including ones that are due right away
+static void fire_events(i8080_t* state) {
+  while (event_due(state)) {
+    const i8080_event_t event = state->events[0];
+    event_heap_remove(state, 0);
+
+    event.handler(state, event.context);
+  }
+}
+
+uint64_t i8080_cycles(const i8080_t* state) {
+  return state->cycles;
+}
+
+uint64_t i8080_instructions(const i8080_t* state) {
+  return state->instructions;
+}
+
+uint8_t i8080_opcode_length(const uint8_t opcode) {
+  return OPCODE_LENGTHS[opcode];
+}
+
+uint8_t i8080_opcode_cycles(const uint8_t opcode) {
+  return OPCODE_CYCLES[opcode];
+}
+
+// jumps a halted cpu forward to wake, the time passes without instructions
+static inline void idle_until(i8080_t* state, const uint64_t wake) {
+  if (state->cycles < wake)
+    state->cycles = wake;
+}
+
+void i8080_step(i8080_t* state) {
+  if (interrupt_ready(state)) {
+    accept_interrupt(state);
+    state->instructions++;
+  } else if (state->halted) {
+    // only an event can raise an interrupt, skip the idle cycles up to it
+    if (state->event_count)
+      idle_until(state, i8080_next_event(state));
+  } else {
+    state->ei_delay = 0;  // EI sets it again
+#ifdef I8080_PROFILE
+    if (state->profile)
+      profile_instruction(state);
+    else
+#endif
+#ifdef I8080_TRACE
+    if (state->trace)
+      trace_instruction(state);
+    else
+#endif
+      dispatch(state);
+    state->instructions++;
+  }
+
+  if (event_due(state))
+    fire_events(state);
+
+  flags_sync(state);  // keeps cb valid between steps
+}
+
+// shared loop of i8080_run, i8080_run_until and i8080_debug_run, until is the
+// pc of i8080_run_until
+__attribute__((always_inline)) static inline i8080_run_result_t run_loop(
+    i8080_t* state,
+    const uint64_t max_cycles,
+    const run_mode_t mode,
+    const uint16_t until) {
+  const uint64_t start = state->cycles;
+  const uint64_t end =
+      max_cycles > UINT64_MAX - start ? UINT64_MAX : start + max_cycles;
+  // counted in state as they run, devices and event handlers see it exact
+  const uint64_t start_instructions = state->instructions;
+
+  while (state->cycles < end && !stops_at(state, mode, until) &&
+         !state->stop) {
+    // run up to the budget or the next event, whichever is first
+    const uint64_t next_event = i8080_next_event(state);
+    const uint64_t deadline = next_event < end ? next_event : end;
+
+    if (state->ei_delay) {
+      // the instruction after EI runs before any interrupt is accepted
+      state->ei_delay = 0;
+#ifdef I8080_PROFILE
+      if (state->profile)
+        profile_instruction(state);
+      else
+#endif
+#ifdef I8080_TRACE
+      if (state->trace)
+        trace_instruction(state);
+      else
+#endif
+        dispatch(state);
+      state->instructions++;
+    } else if (interrupt_ready(state)) {
+      accept_interrupt(state);
+      state->instructions++;
+    } else if (state->halted) {
+      if (deadline == UINT64_MAX)
+        break;  // nothing left that could wake the cpu
+      idle_until(state, deadline);
+    } else {
+      state->run_deadline = deadline;
+
+      // the inner loop only compares against the next deadline, devices are
+      // not polled. i8080_schedule lowers run_deadline for events scheduled
+      // from within handlers, EI, HLT and i8080_interrupt drop it to 0
+      while (state->cycles < state->run_deadline &&
+             !stops_at(state, mode, until)) {
+#ifdef I8080_PROFILE
+        // every instruction is counted, the jit and block cache sit it out
+        if (state->profile) {
+          profile_instruction(state);
+          state->instructions++;
+          continue;
+        }
+#endif
+#ifdef I8080_TRACE
+        // every instruction is recorded, the jit and block cache sit it out
+        if (state->trace) {
+          trace_instruction(state);
+          state->instructions++;
+          continue;
+        }
+#endif
+#ifdef I8080_JIT
+        if (state->jit) {
+          jit_run(state, mode, until);
+          continue;
+        }
+#endif
+#ifdef I8080_BLOCK_CACHE
+        if (state->block_cache) {
+          block_run(state, mode, until);
+          continue;
+        }
+#endif
+        dispatch(state);
+        state->instructions++;
+      }
+    }
+
+    fire_events(state);
+  }
+
+  i8080_stop_reason_t reason = state->stop;
+  if (!state->stop) {
+    if (stops_at(state, mode, until))
+      reason = mode == RUN_UNTIL ? I8080_STOP_PC : I8080_STOP_BREAKPOINT;
+    else
+      reason = state->cycles < end ? I8080_STOP_HALTED : I8080_STOP_BUDGET;
+  }
+
+  state->stop = 0;
+  flags_sync(state);  // cb is only guaranteed valid on return
+
+  return (i8080_run_result_t){state->cycles - start,
+                              state->instructions - start_instructions, reason};
+}
+
+void i8080_stop(i8080_t* state) {
+  state->stop = I8080_STOP_REQUESTED;
+  state->run_deadline = 0;  // ends the inner loop, the outer one sees stop
+}
+
+i8080_run_result_t i8080_run(i8080_t* state, const uint64_t max_cycles) {
+  return run_loop(state, max_cycles, RUN_FREE, 0);
+}
+
+i8080_run_result_t i8080_run_until(i8080_t* state,
+                                   const uint16_t pc,
+                                   const uint64_t max_cycles) {
+  return run_loop(state, max_cycles, RUN_UNTIL, pc);
+}
+
+bool i8080_debug_start(i8080_t* state) {
+  if (state->debug)
+    return true;
+
+  state->debug = calloc(1, sizeof(i8080_debug_t));
+
+  return state->debug != NULL;
+}
+
+void i8080_debug_stop(i8080_t* state) {
+  i8080_debug_t* debug = state->debug;
+
+  if (!debug)
+    return;
+
+  i8080_watch_clear(state, 0x0000, I8080_MAX_MEMORY, true, true);
+
+  free(debug);
+  state->debug = NULL;
+}
+
+i8080_run_result_t i8080_debug_run(i8080_t* state, const uint64_t max_cycles) {
+  const i8080_debug_t* debug = state->debug;
+
+  if (!debug || !debug->break_count)
+    return i8080_run(state, max_cycles);
+
+  // the breakpoint at pc is the one the last run stopped at, or one the caller
+  // means to start from
+  i8080_run_result_t first = {0, 0, I8080_STOP_BUDGET};
+  if (breakpoint_at(debug, state->pc) && max_cycles) {
+    first = i8080_run(state, 1);
+    if (first.reason != I8080_STOP_BUDGET || first.cycles >= max_cycles)
+      return first;
+  }
+
+  i8080_run_result_t run =
+      run_loop(state, max_cycles - first.cycles, RUN_DEBUG, 0);
+  run.cycles += first.cycles;
+  run.instructions += first.instructions;
+
+  return run;
+}
+
+bool i8080_break_set(i8080_t* state, const uint16_t address) {
+  i8080_debug_t* debug = state->debug;
+  const int page = address / I8080_PAGE_SIZE;
+
+  if (!debug || bit_set(debug->breakpoints, address))
+    return false;
+
+  debug->breakpoints[address / 8] |= 1 << address % 8;
+  debug->break_pages[page / 8] |= 1 << page % 8;
+  debug->break_counts[page]++;
+  debug->break_count++;
+
+  return true;
+}
+
+bool i8080_break_clear(i8080_t* state, const uint16_t address) {
+  i8080_debug_t* debug = state->debug;
+  const int page = address / I8080_PAGE_SIZE;
+
+  if (!debug || !bit_set(debug->breakpoints, address))
+    return false;
+
+  debug->breakpoints[address / 8] &= ~(1 << address % 8);
+  if (--debug->break_counts[page] == 0)
+    debug->break_pages[page / 8] &= ~(1 << page % 8);
+  debug->break_count--;
+
+  return true;
+}
+
+// sets or clears the watch bits of size bytes, pages are trapped with their
+// first watched address and given back with their last
+static void watch_update(i8080_t* state,
+                         const uint16_t address,
+                         const uint32_t size,
+                         const bool reads,
+                         const bool writes,
+                         const bool set) {
+  i8080_debug_t* debug = state->debug;
+
+  if (!debug)
+    return;
+
+  for (uint32_t i = 0; i < size && address + i < I8080_MAX_MEMORY; i++) {
+    const uint16_t at = address + i;
+    const int page = at / I8080_PAGE_SIZE;
+    const uint8_t bit = 1 << at % 8;
+    const bool watched = bit_set(debug->watch_reads, at) ||
+                         bit_set(debug->watch_writes, at);
+
+    if (reads)
+      debug->watch_reads[at / 8] = set ? debug->watch_reads[at / 8] | bit
+                                       : debug->watch_reads[at / 8] & ~bit;
+    if (writes)
+      debug->watch_writes[at / 8] = set ? debug->watch_writes[at / 8] | bit
+                                        : debug->watch_writes[at / 8] & ~bit;
+
+    const bool now =
+        bit_set(debug->watch_reads, at) || bit_set(debug->watch_writes, at);
+
+    if (now && !watched && debug->watch_counts[page]++ == 0) {
+      // translated code and decoded blocks give back the write pointer first
+#ifdef I8080_JIT
+      jit_forget_page(state, page);
+#endif
+#ifdef I8080_BLOCK_CACHE
+      block_cache_forget_page(state, page);
+#endif
+      debug_trap_page(state, page);
+      update_fetch_pages(state, page, 1);
+    } else if (!now && watched && --debug->watch_counts[page] == 0) {
+      state->read_pages[page] = debug->saved_read_pages[page];
+      state->write_pages[page] = debug->saved_write_pages[page];
+      update_fetch_pages(state, page, 1);
+    }
+  }
+}
+
+void i8080_watch_set(i8080_t* state,
+                     const uint16_t address,
+                     const uint32_t size,
+                     const bool reads,
+                     const bool writes) {
+  watch_update(state, address, size, reads, writes, true);
+}
 
-    case 0xa0:
-      printf("ANA\tB");
-      break;
-    case 0xa1:
-      printf("ANA\tC");
-      break;
-    case 0xa2:
-      printf("ANA\tD");
-      break;
-    case 0xa3:
-      printf("ANA\tE");
-      break;
-    case 0xa4:
-      printf("ANA\tH");
-      break;
-    case 0xa5:
-      printf("ANA\tL");
-      break;
-    case 0xa6:
-      printf("ANA\tM");
-      break;
-    case 0xa7:
-      printf("ANA\tA");
-      break;
-    case 0xa8:
-      printf("XRA\tB");
-      break;
-    case 0xa9:
-      printf("XRA\tC");
-      break;
-    case 0xaa:
-      printf("XRA\tD");
-      break;
-    case 0xab:
-      printf("XRA\tE");
-      break;
-    case 0xac:
-      printf("XRA\tH");
-      break;
-    case 0xad:
-      printf("XRA\tL");
-      break;
-    case 0xae:
-      printf("XRA\tM");
-      break;
-    case 0xaf:
-      printf("XRA\tA");
-      break;
+void i8080_watch_clear(i8080_t* state,
+                       const uint16_t address,
+                       const uint32_t size,
+                       const bool reads,
+                       const bool writes) {
+  watch_update(state, address, size, reads, writes, false);
+}
 
-    case 0xb0:
-      printf("ORA\tB");
-      break;
-    case 0xb1:
-      printf("ORA\tC");
-      break;
-    case 0xb2:
-      printf("ORA\tD");
-      break;
-    case 0xb3:
-      printf("ORA\tE");
-      break;
-    case 0xb4:
-      printf("ORA\tH");
-      break;
-    case 0xb5:
-      printf("ORA\tL");
-      break;
-    case 0xb6:
-      printf("ORA\tM");
-      break;
-    case 0xb7:
-      printf("ORA\tA");
-      break;
-    case 0xb8:
-      printf("CMP\tB");
-      break;
-    case 0xb9:
-      printf("CMP\tC");
-      break;
-    case 0xba:
-      printf("CMP\tD");
-      break;
-    case 0xbb:
-      printf("CMP\tE");
-      break;
-    case 0xbc:
-      printf("CMP\tH");
-      break;
-    case 0xbd:
-      printf("CMP\tL");
-      break;
-    case 0xbe:
-      printf("CMP\tM");
-      break;
-    case 0xbf:
-      printf("CMP\tA");
-      break;
+uint16_t i8080_watch_hit(const i8080_t* state) {
+  return state->debug ? state->debug->hit : 0;
+}
 
-    case 0xc0:
-      printf("RNZ");
-      break;
-    case 0xc1:
-      printf("POP\tB");
-      break;
-    case 0xc2:
-      printf("JNZ\t$%02x%02x", opcode[2], opcode[1]);
-      opbytes = 3;
-      break;
-    case 0xc3:
-      printf("JMP\t$%02x%02x", opcode[2], opcode[1]);
-      opbytes = 3;
-      break;
-    case 0xc4:
-      printf("CNZ\t$%02x%02x", opcode[2], opcode[1]);
-      opbytes = 3;
-      break;
-    case 0xc5:
-      printf("PUSH\tB");
-      break;
-    case 0xc6:
-      printf("ADI\t#$%02x", opcode[1]);
-      opbytes = 2;
-      break;
-    case 0xc7:
-      printf("RST\t0");
-      break;
-    case 0xc8:
-      printf("RZ");
-      break;
-    case 0xc9:
-      printf("RET");
-      break;
-    case 0xca:
-      printf("JZ\t$%02x%02x", opcode[2], opcode[1]);
-      opbytes = 3;
-      break;
-    case 0xcb:
-      printf("JMP\t$%02x%02x", opcode[2], opcode[1]);
-      opbytes = 3;
-      break;
-    case 0xcc:
-      printf("CZ\t$%02x%02x", opcode[2], opcode[1]);
-      opbytes = 3;
-      break;
-    case 0xcd:
-      printf("CALL\t$%02x%02x", opcode[2], opcode[1]);
-      opbytes = 3;
-      break;
-    case 0xce:
-      printf("ACI\t#$%02x", opcode[1]);
-      opbytes = 2;
-      break;
-    case 0xcf:
-      printf("RST\t1");
-      break;
+uint8_t i8080_debug_read(i8080_t* state, const uint16_t address) {
+  if (!state->debug)
+    return read_byte(state, address);
 
-    case 0xd0:
-      printf("RNC");
-      break;
-    case 0xd1:
-      printf("POP\tD");
-      break;
-    case 0xd2:
-      printf("JNC\t$%02x%02x", opcode[2], opcode[1]);
-      opbytes = 3;
-      break;
-    case 0xd3:
-      printf("OUT\t#$%02x", opcode[1]);
-      opbytes = 2;
-      break;
-    case 0xd4:
-      printf("CNC\t$%02x%02x", opcode[2], opcode[1]);
-      opbytes = 3;
-      break;
-    case 0xd5:
-      printf("PUSH\tD");
-      break;
-    case 0xd6:
-      printf("SUI\t#$%02x", opcode[1]);
-      opbytes = 2;
-      break;
-    case 0xd7:
-      printf("RST\t2");
-      break;
-    case 0xd8:
-      printf("RC");
-      break;
-    case 0xd9:
-      printf("RET");
-      break;
-    case 0xda:
-      printf("JC\t$%02x%02x", opcode[2], opcode[1]);
-      opbytes = 3;
-      break;
-    case 0xdb:
-      printf("IN\t#$%02x", opcode[1]);
-      opbytes = 2;
-      break;
-    case 0xdc:
-      printf("CC\t$%02x%02x", opcode[2], opcode[1]);
-      opbytes = 3;
-      break;
-    case 0xdd:
-      printf("CALL\t$%02x%02x", opcode[2], opcode[1]);
-      opbytes = 3;
-      break;
-    case 0xde:
-      printf("SBI\t#$%02x", opcode[1]);
-      opbytes = 2;
-      break;
-    case 0xdf:
-      printf("RST\t3");
-      break;
+  state->debug->quiet = true;
+  const uint8_t byte = read_byte(state, address);
+  state->debug->quiet = false;
 
-    case 0xe0:
-      printf("RPO");
-      break;
-    case 0xe1:
-      printf("POP\tH");
-      break;
-    case 0xe2:
-      printf("JPO\t$%02x%02x", opcode[2], opcode[1]);
-      opbytes = 3;
-      break;
-    case 0xe3:
-      printf("XTHL");
-      break;
-    case 0xe4:
-      printf("CPO\t$%02x%02x", opcode[2], opcode[1]);
-      opbytes = 3;
-      break;
-    case 0xe5:
-      printf("PUSH\tH");
-      break;
-    case 0xe6:
-      printf("ANI\t#$%02x", opcode[1]);
-      opbytes = 2;
-      break;
-    case 0xe7:
-      printf("RST\t4");
-      break;
-    case 0xe8:
-      printf("RPE");
-      break;
-    case 0xe9:
-      printf("PCHL");
-      break;
-    case 0xea:
-      printf("JPE\t$%02x%02x", opcode[2], opcode[1]);
-      opbytes = 3;
-      break;
-    case 0xeb:
-      printf("XCHG");
-      break;
-    case 0xec:
-      printf("CPE\t$%02x%02x", opcode[2], opcode[1]);
-      opbytes = 3;
-      break;
-    case 0xed:
-      printf("CALL\t$%02x%02x", opcode[2], opcode[1]);
-      opbytes = 3;
-      break;
-    case 0xee:
-      printf("XRI\t#$%02x", opcode[1]);
-      opbytes = 2;
-      break;
-    case 0xef:
-      printf("RST\t5");
-      break;
+  return byte;
+}
 
-    case 0xf0:
-      printf("RP");
-      break;
-    case 0xf1:
-      printf("POP\t");
-      break;
-    case 0xf2:
-      printf("JP\t$%02x%02x", opcode[2], opcode[1]);
-      opbytes = 3;
-      break;
-    case 0xf3:
-      printf("DI");
-      break;
-    case 0xf4:
-      printf("CP\t$%02x%02x", opcode[2], opcode[1]);
-      opbytes = 3;
-      break;
-    case 0xf5:
-      printf("PUSH\t");
-      break;
-    case 0xf6:
-      printf("ORI\t#$%02x", opcode[1]);
-      opbytes = 2;
-      break;
-    case 0xf7:
-      printf("RST\t6");
-      break;
-    case 0xf8:
-      printf("RM");
-      break;
-    case 0xf9:
-      printf("SPHL");
-      break;
-    case 0xfa:
-      printf("JM\t$%02x%02x", opcode[2], opcode[1]);
-      opbytes = 3;
-      break;
-    case 0xfb:
-      printf("EI");
-      break;
-    case 0xfc:
-      printf("CM\t$%02x%02x", opcode[2], opcode[1]);
-      opbytes = 3;
-      break;
-    case 0xfd:
-      printf("CALL\t$%02x%02x", opcode[2], opcode[1]);
-      opbytes = 3;
-      break;
-    case 0xfe:
-      printf("CPI\t#$%02x", opcode[1]);
-      opbytes = 2;
+void i8080_debug_write(i8080_t* state,
+                       const uint16_t address,
+                       const uint8_t byte) {
+  if (!state->debug) {
+    write_byte(state, address, byte);
+    return;
+  }
+
+  state->debug->quiet = true;
+  write_byte(state, address, byte);
+  state->debug->quiet = false;
+}
+
+// mnemonic and the operands before the immediate of each instruction, the
+// immediate (OPCODE_LENGTHS says whether there is one) is printed after it
+static const char* const MNEMONICS[] = {
+    // 0
+    "NOP", "LXI\tB,#$", "STAX\tB", "INX\tB", "INR\tB", "DCR\tB", "MVI\tB,#$",
+    "RLC", "NOP", "DAD\tB", "LDAX\tB", "DCX\tB", "INR\tC", "DCR\tC",
+    "MVI\tC,#$", "RRC",
+    // 1
+    "NOP", "LXI\tD,#$", "STAX\tD", "INX\tD", "INR\tD", "DCR\tD", "MVI\tD,#$",
+    "RAL", "NOP", "DAD\tD", "LDAX\tD", "DCX\tD", "INR\tE", "DCR\tE",
+    "MVI\tE,#$", "RAR",
+    // 2
+    "NOP", "LXI\tH,#$", "SHLD\t$", "INX\tH", "INR\tH", "DCR\tH", "MVI\tH,#$",
+    "DAA", "NOP", "DAD\tH", "LHLD\t$", "DCX\tH", "INR\tL", "DCR\tL",
+    "MVI\tL,#$", "CMA",
+    // 3
+    "NOP", "LXI\tSP,#$", "STA\t$", "INX\tSP", "INR\tM", "DCR\tM", "MVI\tM,#$",
+    "STC", "NOP", "DAD\tSP", "LDA\t$", "DCX\tSP", "INR\tA", "DCR\tA",
+    "MVI\tA,#$", "CMC",
+    // 4
+    "MOV\tB,B", "MOV\tB,C", "MOV\tB,D", "MOV\tB,E", "MOV\tB,H", "MOV\tB,L",
+    "MOV\tB,M", "MOV\tB,A", "MOV\tC,B", "MOV\tC,C", "MOV\tC,D", "MOV\tC,E",
+    "MOV\tC,H", "MOV\tC,L", "MOV\tC,M", "MOV\tC,A",
+    // 5
+    "MOV\tD,B", "MOV\tD,C", "MOV\tD,D", "MOV\tD,E", "MOV\tD,H", "MOV\tD,L",
+    "MOV\tD,M", "MOV\tD,A", "MOV\tE,B", "MOV\tE,C", "MOV\tE,D", "MOV\tE,E",
+    "MOV\tE,H", "MOV\tE,L", "MOV\tE,M", "MOV\tE,A",
+    // 6
+    "MOV\tH,B", "MOV\tH,C", "MOV\tH,D", "MOV\tH,E", "MOV\tH,H", "MOV\tH,L",
+    "MOV\tH,M", "MOV\tH,A", "MOV\tL,B", "MOV\tL,C", "MOV\tL,D", "MOV\tL,E",
+    "MOV\tL,H", "MOV\tL,L", "MOV\tL,M", "MOV\tL,A",
+    // 7
+    "MOV\tM,B", "MOV\tM,C", "MOV\tM,D", "MOV\tM,E", "MOV\tM,H", "MOV\tM,L",
+    "HLT", "MOV\tM,A", "MOV\tA,B", "MOV\tA,C", "MOV\tA,D", "MOV\tA,E",
+    "MOV\tA,H", "MOV\tA,L", "MOV\tA,M", "MOV\tA,A",
+    // 8
+    "ADD\tB", "ADD\tC", "ADD\tD", "ADD\tE", "ADD\tH", "ADD\tL", "ADD\tM",
+    "ADD\tA", "ADC\tB", "ADC\tC", "ADC\tD", "ADC\tE", "ADC\tH", "ADC\tL",
+    "ADC\tM", "ADC\tA",
+    // 9
+    "SUB\tB", "SUB\tC", "SUB\tD", "SUB\tE", "SUB\tH", "SUB\tL", "SUB\tM",
+    "SUB\tA", "SBB\tB", "SBB\tC", "SBB\tD", "SBB\tE", "SBB\tH", "SBB\tL",
+    "SBB\tM", "SBB\tA",
+    // a
+    "ANA\tB", "ANA\tC", "ANA\tD", "ANA\tE", "ANA\tH", "ANA\tL", "ANA\tM",
+    "ANA\tA", "XRA\tB", "XRA\tC", "XRA\tD", "XRA\tE", "XRA\tH", "XRA\tL",
+    "XRA\tM", "XRA\tA",
+    // b
+    "ORA\tB", "ORA\tC", "ORA\tD", "ORA\tE", "ORA\tH", "ORA\tL", "ORA\tM",
+    "ORA\tA", "CMP\tB", "CMP\tC", "CMP\tD", "CMP\tE", "CMP\tH", "CMP\tL",
+    "CMP\tM", "CMP\tA",
+    // c
+    "RNZ", "POP\tB", "JNZ\t$", "JMP\t$", "CNZ\t$", "PUSH\tB", "ADI\t#$",
+    "RST\t0", "RZ", "RET", "JZ\t$", "JMP\t$", "CZ\t$", "CALL\t$", "ACI\t#$",
+    "RST\t1",
+    // d
+    "RNC", "POP\tD", "JNC\t$", "OUT\t#$", "CNC\t$", "PUSH\tD", "SUI\t#$",
+    "RST\t2", "RC", "RET", "JC\t$", "IN\t#$", "CC\t$", "CALL\t$", "SBI\t#$",
+    "RST\t3",
+    // e
+    "RPO", "POP\tH", "JPO\t$", "XTHL", "CPO\t$", "PUSH\tH", "ANI\t#$", "RST\t4",
+    "RPE", "PCHL", "JPE\t$", "XCHG", "CPE\t$", "CALL\t$", "XRI\t#$", "RST\t5",
+    // f
+    "RP", "POP\tPSW", "JP\t$", "DI", "CP\t$", "PUSH\tPSW", "ORI\t#$", "RST\t6",
+    "RM", "SPHL", "JM\t$", "EI", "CM\t$", "CALL\t$", "CPI\t#$", "RST\t7",
+};
+
+static const char HEX_DIGITS[] = "0123456789abcdef";
+
+static char* hex_byte(char* out, const uint8_t byte) {
+  out[0] = HEX_DIGITS[byte >> 4];
+  out[1] = HEX_DIGITS[byte & 0xf];
+  return out + 2;
+}
+
+void i8080_decode(const uint8_t* bytes,
+                  const uint16_t pc,
+                  i8080_instruction_t* instruction) {
+  const uint8_t length = OPCODE_LENGTHS[bytes[0]];
+
+  instruction->pc = pc;
+  instruction->opcode = bytes[0];
+  instruction->length = length;
+  instruction->immediate = length == 3   ? bytes[1] | bytes[2] << 8
+                           : length == 2 ? bytes[1]
+                                         : 0;
+  instruction->text = MNEMONICS[bytes[0]];
+}
+
+// writes the line without a terminator, returns the end of it
+static char* disassemble_into(char* out,
+                              const uint8_t* bytes,
+                              const uint16_t pc) {
+  out = hex_byte(hex_byte(out, pc >> 8), pc & 0xff);
+  *out++ = ' ';
+  for (const char* text = MNEMONICS[bytes[0]]; *text; text++)
+    *out++ = *text;
+
+  switch (OPCODE_LENGTHS[bytes[0]]) {
+    case 3:
+      out = hex_byte(hex_byte(out, bytes[2]), bytes[1]);
       break;
-    case 0xff:
-      printf("RST\t7");
+    case 2:
+      out = hex_byte(out, bytes[1]);
       break;
   }
 
-  printf("\n");
+  return out;
+}
+
+uint8_t i8080_disassemble_line(const uint8_t* bytes,
+                               const uint16_t pc,
+                               char* line) {
+  *disassemble_into(line, bytes, pc) = '\0';
+
+  return OPCODE_LENGTHS[bytes[0]];
+}
+
+uint32_t i8080_disassemble_memory(const uint8_t* memory,
+                                  uint32_t address,
+                                  const uint32_t end,
+                                  char* text,
+                                  const size_t size,
+                                  size_t* written) {
+  char* out = text;
+
+  while (address < end &&
+         (size_t)(out - text) + I8080_DISASSEMBLY_LINE <= size) {
+    // an instruction at the top of memory takes its operands from the bottom
+    const uint8_t bytes[3] = {memory[address & 0xffff],
+                              memory[(address + 1) & 0xffff],
+                              memory[(address + 2) & 0xffff]};
+    out = disassemble_into(out, bytes, address);
+    *out++ = '\n';
+    address += OPCODE_LENGTHS[bytes[0]];
+  }
 
-  return opbytes;
+  *written = out - text;
+
+  return address;
+}
+
+// returns bytes of operation at pc
+uint8_t i8080_disassemble(const unsigned char* buffer, const uint16_t pc) {
+  char line[I8080_DISASSEMBLY_LINE];
+  const uint8_t length = i8080_disassemble_line(&buffer[pc], pc, line);
+
+  puts(line);
+
+  return length;
 }
 
 void i8080_print(i8080_t* state) {
+  flags_sync(state);
+
   printf("a\tbc\tde\thl\tpc\tsp\tz s p c (ac)\tcycles\n");
-  printf("%02x\t%02x%02x\t%02x%02x\t%02x%02x\t%04x\t%04x\t%i %i %i %i %i\t%i\n",
-         state->a, state->b, state->c,  // registers
-         state->d, state->e, state->h, state->l, state->pc, state->sp,
-         state->cb.flags.z, state->cb.flags.s,  // flags
-         state->cb.flags.p, state->cb.flags.c, state->cb.flags.ac,
-         state->cycles  // cycles
+  printf(
+      "%02x\t%02x%02x\t%02x%02x\t%02x%02x\t%04x\t%04x\t%i %i %i %i %i\t%llu\n",
+      state->a, state->b, state->c,  // registers
+      state->d, state->e, state->h, state->l, state->pc, state->sp,
+      state->cb.flags.z, state->cb.flags.s,  // flags
+      state->cb.flags.p, state->cb.flags.c, state->cb.flags.ac,
+      (unsigned long long)state->cycles  // cycles
   );
   printf("\n");
 }
@@ -0,0 +1,44 @@
+#ifndef I8080_BATCH_H
+#define I8080_BATCH_H
+
+#include "i8080/i8080.h"
+
+// one program to run: rom is loaded at entry and executed from there, cp/m
+// style. bdos calls at 0x0005 return right away, jumping to 0x0000 (warm boot)
+// or halting with nothing left to wake the cpu ends the job
+typedef struct {
+  const char* rom;  // file name
+  uint16_t entry;   // load address and initial pc
+  uint64_t max_cycles;
+} i8080_job_t;
+
+typedef struct {
+  uint64_t cycles;
+  uint64_t instructions;
+  uint16_t pc;     // where the job stopped
+  bool loaded;     // rom could be read and fit, nothing ran otherwise
+  bool completed;  // ended before running out of cycles
+} i8080_job_result_t;
+
+// totals of a batch, seconds is wall clock time of the whole batch
+typedef struct {
+  uint64_t cycles;
+  uint64_t instructions;
+  double seconds;
+  int threads;
+  int failed;  // jobs whose rom couldn't be loaded
+} i8080_batch_stats_t;
+
+// runs count jobs on a work-stealing pool of threads workers, 0 means one per
+// online cpu. results[i] belongs to jobs[i]. each distinct rom is mapped once
+// and shared copy-on-write (see include/i8080/loader.h), everything else
+// (machines, which workers reuse, queues and the rom table) comes out of a
+// single arena. returns false if the arena or threads couldn't be set up, no
+// job ran then
+bool i8080_batch_run(const i8080_job_t* jobs,
+                     int count,
+                     int threads,
+                     i8080_job_result_t* results,
+                     i8080_batch_stats_t* stats);
+
+#endif  // I8080_BATCH_H
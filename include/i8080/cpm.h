@@ -0,0 +1,70 @@
+#ifndef I8080_CPM_H
+#define I8080_CPM_H
+
+#include <dirent.h>
+
+#include "i8080/i8080.h"
+
+// cp/m 2.2 memory layout. 0x0000 jumps to the bios warm boot and 0x0005 to the
+// bdos, whose address in 0x0006 is the top of the tpa for programs
+#define I8080_CPM_TPA 0x100   // transient programs are loaded and run here
+#define I8080_CPM_BDOS 0xfe06
+#define I8080_CPM_BIOS 0xff00  // jump table, BOOT to SECTRAN
+#define I8080_CPM_DMA 0x80     // default dma buffer, holds the command tail
+
+// the bdos entry and every bios entry are "OUT I8080_CPM_PORT; RET". the port
+// handler only acts on OUTs at those addresses, so the calls cost nothing while
+// the program runs and nothing else polls the pc
+#define I8080_CPM_PORT 0xff
+
+#define I8080_CPM_BUFFER 4096   // console output kept until a flush
+#define I8080_CPM_MAX_FILES 16  // host files open at once
+
+typedef struct {
+  FILE* file;         // NULL if the slot is free
+  uint8_t name[11];   // as in the fcb, attribute bits cleared
+} i8080_cpm_file_t;
+
+// bdos and bios of one machine. files are looked up in directory without
+// regard to case, every drive is that directory. console input comes from
+// input, output is collected in buffer and written to output in one go
+typedef struct {
+  i8080_t* state;
+  const char* directory;
+  FILE* input;
+  FILE* output;
+
+  uint16_t dma;
+  uint8_t drive;
+  uint8_t user;
+  bool exited;  // warm boot or system reset, i8080_cpm_run returned for it
+
+  i8080_cpm_file_t files[I8080_CPM_MAX_FILES];
+
+  // search first / search next
+  DIR* search;
+  uint8_t search_pattern[11];
+
+  size_t buffered;
+  char buffer[I8080_CPM_BUFFER];
+} i8080_cpm_t;
+
+// takes over I8080_CPM_PORT and writes page zero, the bdos and bios entries,
+// an empty command tail and the stack cp/m gives a program: just below the
+// bdos, with 0x0000 to return to. pc is left to the caller, usually
+// I8080_CPM_TPA after loading a .com. input is made unbuffered, so this
+// comes before anything reads from it
+void i8080_cpm_init(i8080_cpm_t* cpm,
+                    i8080_t* state,
+                    const char* directory,
+                    FILE* input,
+                    FILE* output);
+// flushes the console and closes any files the program left open
+void i8080_cpm_close(i8080_cpm_t* cpm);
+void i8080_cpm_flush(i8080_cpm_t* cpm);
+
+// runs until the program ends (exited is set), halts or max_cycles have
+// elapsed, then flushes the console
+i8080_run_result_t i8080_cpm_run(i8080_cpm_t* cpm, uint64_t max_cycles);
+
+#endif  // I8080_CPM_H
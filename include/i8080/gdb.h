@@ -0,0 +1,25 @@
+#ifndef I8080_GDB_H
+#define I8080_GDB_H
+
+#include "i8080/i8080.h"
+
+// gdb remote serial protocol stub on the debugger core (i8080_debug_start).
+// registers are numbered as by gdb's z80 target: af, bc, de, hl, sp and pc,
+// 16 bits each. breakpoints (Z0, Z1) and watchpoints (Z2 to Z4) map onto
+// i8080_break_set and i8080_watch_set, continuing runs i8080_debug_run in
+// slices of I8080_GDB_SLICE cycles with a look for ^C in between
+#define I8080_GDB_SLICE 1000000
+
+// called whenever the machine stopped, before gdb hears of it, e.g. to flush a
+// console
+typedef void (*i8080_gdb_stop_handler_t)(void* context);
+
+// listens on port of the loopback interface and serves the first gdb that
+// connects until it detaches or kills the target, then drops all breakpoints
+// and watches. stopped may be NULL. false if the socket can't be set up
+bool i8080_gdb_serve(i8080_t* state,
+                     uint16_t port,
+                     i8080_gdb_stop_handler_t stopped,
+                     void* context);
+
+#endif  // I8080_GDB_H
@@ -9,29 +9,151 @@
   65536  // i8080's stack pointer holds 2 bytes; 2^16 (65536) is the largest
          // number which can be represented by 16 bits
 
-// structured according to PSW format
+// address space is split into pages, each mapped to host memory or handlers
+#define I8080_PAGE_SIZE 256
+#define I8080_PAGE_COUNT (I8080_MAX_MEMORY / I8080_PAGE_SIZE)
+
+// callbacks of pages that are not plain host memory (mmio, banking, ...)
+typedef uint8_t (*i8080_read_handler_t)(void* context, uint16_t address);
+typedef void (*i8080_write_handler_t)(void* context,
+                                      uint16_t address,
+                                      uint8_t byte);
+
+typedef struct {
+  i8080_read_handler_t read;    // NULL if reads go to host memory
+  i8080_write_handler_t write;  // NULL if writes go to host memory
+  void* context;                // passed to read and write
+} i8080_page_handler_t;
+
+#define I8080_PORT_COUNT 256  // IN/OUT take an 8 bit port number
+
+// callbacks of a device attached to an i/o port
+typedef uint8_t (*i8080_in_handler_t)(void* context, uint8_t port);
+typedef void (*i8080_out_handler_t)(void* context, uint8_t port, uint8_t byte);
+
+typedef struct {
+  i8080_in_handler_t in;    // NULL reads 0xff
+  i8080_out_handler_t out;  // NULL ignores writes
+  void* context;            // passed to in and out
+} i8080_port_handler_t;
+
+#define I8080_MAX_EVENTS 64  // timed events pending at once
+
+struct i8080_t;
+
+// device callback run once the cycle count reaches the scheduled time
+typedef void (*i8080_event_handler_t)(struct i8080_t* state, void* context);
+
+typedef struct {
+  uint64_t time;  // cycle count at which handler runs
+  i8080_event_handler_t handler;
+  void* context;  // passed to handler
+} i8080_event_t;
+
+#define I8080_MAX_DEVICES 16  // devices with state kept in snapshots
+
+// callbacks of device state saved with snapshots, save copies size bytes of it
+// into buffer and restore puts them back
+typedef void (*i8080_save_handler_t)(void* context, void* buffer);
+typedef void (*i8080_restore_handler_t)(void* context, const void* buffer);
+
+typedef struct {
+  size_t size;
+  i8080_save_handler_t save;
+  i8080_restore_handler_t restore;
+  void* context;  // passed to save and restore
+} i8080_device_state_t;
+
+// structured according to PSW format, byte holds the flags exactly as pushed
+// by PUSH PSW. bits are declared least significant first, which is how gcc
+// allocates bitfields
 typedef union {
   struct {
-    uint8_t s : 1;     // sign
-    uint8_t z : 1;     // zero
-    uint8_t bit5 : 1;  // always 0
-    uint8_t ac : 1;    // auxiliary carry
-    uint8_t bit3 : 1;  // always 0
-    uint8_t p : 1;     // parity, 1=even; 0=odd
-    uint8_t bit1 : 1;  // always 1
     uint8_t c : 1;     // carry
+    uint8_t bit1 : 1;  // always 1
+    uint8_t p : 1;     // parity, 1=even; 0=odd
+    uint8_t bit3 : 1;  // always 0
+    uint8_t ac : 1;    // auxiliary carry
+    uint8_t bit5 : 1;  // always 0
+    uint8_t z : 1;     // zero
+    uint8_t s : 1;     // sign
   } flags;
   uint8_t byte;
 } conditionbits_t;
 
+// alu operation whose flags are not yet written to cb, only used when built
+// with I8080_LAZY_FLAGS
+typedef struct {
+  uint8_t kind;  // 0 when cb is up to date, all of it 0 then
+  uint8_t lhs, rhs;
+  uint8_t result;
+  uint8_t carry;  // out of bit 7, or the borrow
+} lazyflags_t;
+
+// translation and decoding caches and breakpoints, private to i8080.c
+struct i8080_jit_t;
+struct i8080_block_cache_t;
+struct i8080_debug_t;
+
+// saved machine, see i8080_snapshot
+typedef struct i8080_snapshot_t i8080_snapshot_t;
+
 typedef struct i8080_t {
+  // everything up to external_memory is cpu state, saved as is by snapshots
   uint8_t a, b, c, d, e, h, l;  // 7 registers. pairs: PSW, BC, DE, HL
   uint16_t pc, sp;              // program counter, stack pointer
-  uint32_t cycles;              // Hz
+  uint64_t cycles;              // total cycles executed, never wraps
+  uint64_t instructions;        // total instructions executed
   conditionbits_t cb;
+  lazyflags_t lazy;  // cb is up to date whenever i8080_step/i8080_run return
   uint8_t ie;  // interrupts enabled
+  uint8_t ei_delay;     // set by EI, interrupts wait for the next instruction
+  uint8_t halted;       // set by HLT, cleared when an interrupt is accepted
+  uint8_t irq_pending;  // interrupt request latch, see i8080_interrupt
+  uint16_t irq_vector;  // address the pending interrupt restarts at
 
-  uint8_t* external_memory;
+  uint8_t* external_memory;  // flat 64 KiB memory, see i8080_attach_memory
+  uint8_t memory_mirrored;   // external_memory is from i8080_alloc_memory
+
+  // memory page table, indexed by address / I8080_PAGE_SIZE. a non-NULL entry
+  // points at the host memory of that page and is accessed directly, NULL
+  // entries go through page_handlers. pages without any mapping fall back to
+  // external_memory. the entry load and NULL check make direct pages ~3%
+  // (switch) to ~5% (table) slower than a flat array on the test roms at -O2,
+  // an accepted cost: callbacks, watchpoints and the write traps of the jit
+  // and block cache all work by leaving entries NULL
+  uint8_t* read_pages[I8080_PAGE_COUNT];
+  uint8_t* write_pages[I8080_PAGE_COUNT];
+  i8080_page_handler_t page_handlers[I8080_PAGE_COUNT];
+  // read_pages of those followed in host memory by the next page, instructions
+  // are fetched from them without looking at where they end. kept by the map
+  // functions
+  const uint8_t* fetch_pages[I8080_PAGE_COUNT];
+
+  i8080_port_handler_t ports[I8080_PORT_COUNT];  // indexed by port number
+
+  // timed events, min-heap on time, see i8080_schedule
+  i8080_event_t events[I8080_MAX_EVENTS];
+  int event_count;
+  uint64_t run_deadline;  // cycle count where the batch run loop next stops
+  uint8_t stop;  // reason set by i8080_stop or a watchpoint, cleared when the
+                 // loop returns
+
+  struct i8080_jit_t* jit;  // NULL unless enabled, see i8080_jit_enable
+  struct i8080_block_cache_t* block_cache;  // see i8080_block_cache_enable
+  struct i8080_trace_t* trace;  // NULL unless recording, see i8080_trace_start
+  struct i8080_profile_t* profile;  // see i8080_profile_start
+  struct i8080_debug_t* debug;      // see i8080_debug_start
+  struct i8080_replay_t* replay;    // see i8080_replay_record
+  struct i8080_check_hooks_t* check_hooks;  // see i8080_check_hooks
+
+  // memory matches snapshot except for the pages marked in dirty_pages, which
+  // the guest wrote or which were mapped again since it was taken or restored
+  i8080_snapshot_t* snapshot;
+  uint8_t dirty_pages[I8080_PAGE_COUNT];
+
+  i8080_device_state_t devices[I8080_MAX_DEVICES];  // see i8080_attach_device
+  int device_count;
 } i8080_t;
 
 typedef struct {
@@ -39,26 +161,286 @@ typedef struct {
   uint8_t* second;
 } regpair_t;
 
+// why a batch run returned
+typedef enum {
+  I8080_STOP_BUDGET,       // max_cycles have elapsed
+  I8080_STOP_PC,           // in front of the pc of i8080_run_until
+  I8080_STOP_HALTED,       // halted, no event pending could wake it
+  I8080_STOP_REQUESTED,    // i8080_stop
+  I8080_STOP_BREAKPOINT,   // in front of a breakpoint, see i8080_debug_run
+  I8080_STOP_WATCH_READ,   // after an instruction read a watched address
+  I8080_STOP_WATCH_WRITE,  // after an instruction wrote one
+  I8080_STOP_DIVERGED,     // replay left its log, see i8080_replay_play
+} i8080_stop_reason_t;
+
+// totals returned by the batch run functions
+typedef struct {
+  uint64_t cycles;
+  uint64_t instructions;
+  i8080_stop_reason_t reason;
+} i8080_run_result_t;
+
 void init_conditionbits(
     conditionbits_t* cb);  // inits members to 0 except bit1 which is always 1
+// call i8080_jit_disable/i8080_block_cache_disable/i8080_snapshot_forget,
+// i8080_trace_stop, i8080_profile_stop and i8080_debug_stop first when
+// reinitializing
 void init_i8080(i8080_t* state);
 
-void i8080_step(i8080_t* state);  // executes one instruction at current pc
-void i8080_interrupt(
-    i8080_t* state,
-    uint8_t low,
-    uint8_t high);  // pushes current pc onto stack and jumps to address
+// executes one instruction at current pc, or accepts a pending interrupt. when
+// halted, advances cycles to the next event instead
+void i8080_step(i8080_t* state);
+
+// batch execution, runs instructions until at least max_cycles have elapsed.
+// while halted, cycles skip ahead to the next event. returns early when halted
+// with no event pending and no cycle budget (max_cycles of UINT64_MAX)
+i8080_run_result_t i8080_run(i8080_t* state, uint64_t max_cycles);
+// as i8080_run but also stops before executing the instruction at pc
+i8080_run_result_t i8080_run_until(i8080_t* state,
+                                   uint16_t pc,
+                                   uint64_t max_cycles);
+
+// makes the running i8080_run/i8080_run_until return after the current
+// instruction with I8080_STOP_REQUESTED, for handlers (a port trap) to end a
+// run early
+void i8080_stop(i8080_t* state);
+
+// execution counters since init_i8080, for exact rates over any interval
+uint64_t i8080_cycles(const i8080_t* state);
+uint64_t i8080_instructions(const i8080_t* state);
+
+// opcode table lookups: size in bytes and cycles as counted by i8080_step,
+// without the extra cycles of a taken conditional call or return
+uint8_t i8080_opcode_length(uint8_t opcode);
+uint8_t i8080_opcode_cycles(uint8_t opcode);
+
+// timed events. handler runs after the instruction during which cycles reached
+// time, from i8080_step and the batch run loops. returns false when
+// I8080_MAX_EVENTS events are already pending
+bool i8080_schedule(i8080_t* state,
+                    uint64_t time,
+                    i8080_event_handler_t handler,
+                    void* context);
+// removes pending events matching handler and context, returns how many
+int i8080_cancel(i8080_t* state, i8080_event_handler_t handler, void* context);
+// time of the next pending event, UINT64_MAX if there is none
+uint64_t i8080_next_event(const i8080_t* state);
+// x86-64 translation of basic blocks, used by i8080_run and i8080_run_until.
+// only available when built with I8080_JIT (make JIT=1), otherwise enable
+// returns false. guest writes into translated code are caught through the page
+// table, host code writing guest memory directly must call i8080_jit_flush
+bool i8080_jit_enable(i8080_t* state);
+void i8080_jit_disable(i8080_t* state);
+void i8080_jit_flush(i8080_t* state);
+
+// pre-decoded basic blocks for i8080_run and i8080_run_until, the interpreter
+// counterpart of the jit. only available when built with I8080_BLOCK_CACHE
+// (make BLOCK_CACHE=1), same rules for direct host writes
+bool i8080_block_cache_enable(i8080_t* state);
+void i8080_block_cache_disable(i8080_t* state);
+void i8080_block_cache_flush(i8080_t* state);
+// superinstruction profile of the block cache: returns the name of fused pair
+// index (e.g. "DCR C/JNZ") and stores how many times it ran since enabling,
+// NULL once index is past the last pair
+const char* i8080_block_cache_fusion(const i8080_t* state,
+                                     int index,
+                                     uint64_t* executed);
 
+// execution trace, a record per instruction with its pc, opcode, the registers
+// it changed and the memory it wrote, in the format of include/i8080/trace.h.
+// recording goes through a ring buffer streamed to file_name by a background
+// thread. only available when built with I8080_TRACE (make TRACE=1), otherwise
+// start returns false. the jit and block cache are bypassed while recording
+bool i8080_trace_start(i8080_t* state, const char* file_name);
+// writes out the rest of the trace, false if any of it couldn't be written
+bool i8080_trace_stop(i8080_t* state);
+
+// profiling, counts and cycles of every instruction by opcode and address and
+// cycles by function, found by following calls and returns. the counters are
+// in state->profile (include/i8080/profile.h). only available when built with
+// I8080_PROFILE (make PROFILE=1), otherwise start returns false. the jit and
+// block cache are bypassed while profiling
+bool i8080_profile_start(i8080_t* state);
+// writes the counters so far for profile_report, profiling goes on
+bool i8080_profile_save(const i8080_t* state, const char* file_name);
+void i8080_profile_stop(i8080_t* state);
+
+// hooks for checking one engine against another, see difftest.c. every write
+// of the guest is logged, and block_exit is called whenever the jit or block
+// cache leaves a block or runs an instruction outside of one, with the machine
+// as the block left it. only available when built with I8080_CHECK_HOOKS,
+// otherwise attaching returns false. NULL detaches, hooks stay with the caller
+#define I8080_CHECK_WRITES 256  // writes kept until the checker empties the log
+
+typedef struct i8080_check_hooks_t {
+  void (*block_exit)(i8080_t* state, void* context);  // may be NULL
+  void* context;  // passed to block_exit
+
+  // in the order they were made. write_count goes on past I8080_CHECK_WRITES,
+  // the writes beyond aren't kept
+  struct {
+    uint16_t address;
+    uint8_t byte;
+  } writes[I8080_CHECK_WRITES];
+  uint32_t write_count;
+} i8080_check_hooks_t;
+
+bool i8080_check_hooks(i8080_t* state, i8080_check_hooks_t* hooks);
+
+// debugger core. breakpoints stop i8080_debug_run in front of an address, a
+// bit per page says whether to look any closer, and the jit and block cache
+// only look at it when entering a block. i8080_run and i8080_run_until ignore
+// breakpoints and pay nothing for them. watched pages are taken out of the
+// page table and go through the bus, a watched access ends any batch run after
+// the instruction, instruction fetches from host memory don't count. false
+// when out of memory, see include/i8080/gdb.h for a gdb stub on top
+bool i8080_debug_start(i8080_t* state);
+void i8080_debug_stop(i8080_t* state);  // drops all breakpoints and watches
+// as i8080_run, also stopping at breakpoints. the one at pc is run over, so a
+// run that stopped at a breakpoint goes on from there
+i8080_run_result_t i8080_debug_run(i8080_t* state, uint64_t max_cycles);
+// set returns false when there already was one at address, clear when there
+// wasn't. both return false and the watch functions do nothing unless
+// i8080_debug_start was called
+bool i8080_break_set(i8080_t* state, uint16_t address);
+bool i8080_break_clear(i8080_t* state, uint16_t address);
+// watches size bytes from address for reads and/or writes, clearing takes the
+// given kinds away again
+void i8080_watch_set(i8080_t* state,
+                     uint16_t address,
+                     uint32_t size,
+                     bool reads,
+                     bool writes);
+void i8080_watch_clear(i8080_t* state,
+                       uint16_t address,
+                       uint32_t size,
+                       bool reads,
+                       bool writes);
+// address of the access that last stopped a run at a watchpoint, 0 without
+// i8080_debug_start
+uint16_t i8080_watch_hit(const i8080_t* state);
+// memory access for the debugger's host side, watchpoints don't see it
+uint8_t i8080_debug_read(i8080_t* state, uint16_t address);
+void i8080_debug_write(i8080_t* state, uint16_t address, uint8_t byte);
+
+// snapshots hold registers, flags, counters, pending events and interrupt,
+// device state and the contents of all ram. memory is kept in pages shared
+// between snapshots, taking one copies only the pages written since the
+// machine's last snapshot or restore and restoring copies back only the pages
+// that differ from it, so both are O(dirty pages). page and port maps are
+// configuration and aren't part of a snapshot. returns NULL when out of memory
+i8080_snapshot_t* i8080_snapshot(i8080_t* state);
+// puts the machine back to the snapshot, which stays valid and can be restored
+// any number of times. restoring into another machine (a fork) needs the same
+// memory layout and devices, every page is copied then
+void i8080_restore(i8080_t* state, i8080_snapshot_t* snapshot);
+// drops a snapshot, pages it shares with others stay with those
+void i8080_snapshot_free(i8080_snapshot_t* snapshot);
+// lets go of the snapshot the machine's memory is tracked against, the next
+// restore copies every page
+void i8080_snapshot_forget(i8080_t* state);
+// adds device state to every snapshot from now on. returns false when
+// I8080_MAX_DEVICES devices are attached already
+bool i8080_attach_device(i8080_t* state, i8080_device_state_t device);
+// host code writing guest memory directly (not through i8080_write_byte) must
+// report it, for snapshots and the jit and block cache
+void i8080_memory_written(i8080_t* state, uint16_t address, uint32_t size);
+
+// record/replay of device input, for reruns of long runs that come out the
+// same. recording appends every value IN reads and every interrupt request to
+// replay (include/i8080/replay.h) with the cycle count it happened at.
+// replaying hands IN the logged values instead of asking the devices and
+// raises the logged interrupts at their cycle counts through the event
+// scheduler, the devices' own requests are dropped. port output still reaches
+// the devices. restoring a snapshot moves a replay to the entries after its
+// cycle count and cuts a recording off there, so snapshots taken along the way
+// seek: restore the latest one before a cycle count and run up to it. host
+// code raising interrupts between runs does so after snapshots of that cycle
+// count. replay stays with the caller
+void i8080_replay_record(i8080_t* state, struct i8080_replay_t* replay);
+// replays from the start of the log, on a machine as it was when recording
+// started or through a snapshot restored after this
+void i8080_replay_play(i8080_t* state, struct i8080_replay_t* replay);
+void i8080_replay_stop(i8080_t* state);
+
+// raises the interrupt request line with the restart address on the bus,
+// usually that of an RST (n * 8). the request is latched and accepted before
+// the next instruction once ie is set and the instruction after EI has run.
+// accepting pushes pc, jumps to the address, clears ie and ends a halt. a
+// newer request replaces a pending one
+void i8080_interrupt(i8080_t* state, uint8_t low, uint8_t high);
+
+// disassembly. none of these use stdio but i8080_disassemble, and all of them
+// only read their arguments, any thread can call them
+typedef struct {
+  uint16_t pc;
+  uint8_t opcode;
+  uint8_t length;      // opcode included
+  uint16_t immediate;  // byte or word after the opcode, 0 if there's none
+  const char* text;    // up to the immediate, "MVI\tB,#$"
+} i8080_instruction_t;
+
+// room for any line of disassembly, newline and terminator included
+#define I8080_DISASSEMBLY_LINE 24
+
+// bytes is the instruction, as many bytes as its length
+void i8080_decode(const uint8_t* bytes,
+                  uint16_t pc,
+                  i8080_instruction_t* instruction);
+// writes "pc mnemonic\toperands" with a terminator to line (at least
+// I8080_DISASSEMBLY_LINE), returns the length of the instruction
+uint8_t i8080_disassemble_line(const uint8_t* bytes, uint16_t pc, char* line);
+// disassembles the instructions starting from address up to end out of a whole
+// address space (I8080_MAX_MEMORY bytes), a line each. stops early when text
+// can't take another line. returns where it stopped, *written is how much of
+// text it filled, no terminator
+uint32_t i8080_disassemble_memory(const uint8_t* memory,
+                                  uint32_t address,
+                                  uint32_t end,
+                                  char* text,
+                                  size_t size,
+                                  size_t* written);
 uint8_t i8080_disassemble(const unsigned char* buffer,
                           const uint16_t pc);  // prints assembly from hex
 void i8080_print(i8080_t* state);              // prints state of cpu
 
-// memory handling, works on external memory
+// memory handling, goes through the memory page table
 void i8080_write_byte(i8080_t* state,
                       const uint16_t address,
                       const uint8_t byte);
 uint8_t i8080_read_byte(i8080_t* state, const uint16_t address);
 
+// memory mapping, address and size are in whole pages (I8080_PAGE_SIZE).
+// maps host memory directly, writes are ignored unless writable (rom)
+void i8080_map_memory(i8080_t* state,
+                      uint16_t address,
+                      uint32_t size,
+                      uint8_t* memory,
+                      bool writable);
+// maps read-only host memory copy-on-write: reads go to image, the first guest
+// write to a page copies it into external_memory at the same address and maps
+// that as ram. image is never written, any number of machines can share it
+void i8080_map_image(i8080_t* state,
+                     uint16_t address,
+                     uint32_t size,
+                     const uint8_t* image);
+// maps pages to read/write callbacks
+void i8080_map_handler(i8080_t* state,
+                       uint16_t address,
+                       uint32_t size,
+                       i8080_page_handler_t handler);
+// sets external_memory and maps all 64 KiB of it as writable host memory
+void i8080_attach_memory(i8080_t* state, uint8_t* memory);
+// allocates and attaches zeroed memory. where the host can alias memory (a
+// memfd), the host page after its end maps its start again, so instructions
+// at 0xfffe and 0xffff are fetched as directly as any other instead of through
+// the bus. false when out of memory, release with i8080_free_memory
+bool i8080_alloc_memory(i8080_t* state);
+void i8080_free_memory(i8080_t* state);
+
+// attaches a device to an i/o port, replacing any previous one
+void i8080_map_port(i8080_t* state, uint8_t port, i8080_port_handler_t handler);
+
 // carry bit instructions
 void i8080_stc(i8080_t* state);
 void i8080_cmc(i8080_t* state);
@@ -71,6 +453,7 @@ void i8080_cma(i8080_t* state);
 void i8080_daa(i8080_t* state);
 
 void i8080_nop(i8080_t* state);
+void i8080_hlt(i8080_t* state);  // stops until an interrupt is accepted
 
 // data transfer instructions, transfers data between registers or between
 // memory and registers
@@ -173,6 +556,10 @@ void i8080_rpo(i8080_t* state);
 // restart instruction
 void i8080_rst(i8080_t* state, uint8_t rst_num);
 
+// input/output instructions, accumulator from/to the device on port
+void i8080_in(i8080_t* state, uint8_t port);
+void i8080_out(i8080_t* state, uint8_t port);
+
 // interrupt flip-flop instructions
 void i8080_ei(i8080_t* state);
 void i8080_di(i8080_t* state);
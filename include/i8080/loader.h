@@ -0,0 +1,38 @@
+#ifndef I8080_LOADER_H
+#define I8080_LOADER_H
+
+#include "i8080/i8080.h"
+
+typedef enum {
+  I8080_IMAGE_COM,     // cp/m program, loaded at 0x100
+  I8080_IMAGE_BINARY,  // raw bytes at any address
+  I8080_IMAGE_HEX,     // intel hex records, each with its own address
+} i8080_image_format_t;
+
+// program image opened once and shared read-only by any number of machines,
+// across threads too. binary files are mmap'd, never copied, so all machines
+// running one rom share a single physical copy of it
+typedef struct i8080_image_t i8080_image_t;
+
+// format by file name extension: .com, .hex or .ihx, anything else is binary
+i8080_image_format_t i8080_image_format(const char* file_name);
+
+// opens file_name as an image of format. address is where a binary image goes,
+// the other formats carry their own. NULL if it can't be read or parsed, or
+// doesn't fit in the address space
+i8080_image_t* i8080_image_open(const char* file_name,
+                                i8080_image_format_t format,
+                                uint16_t address);
+// the image must not be mapped in any machine any more
+void i8080_image_close(i8080_image_t* image);
+
+// loads image into state. pages it covers entirely are mapped copy-on-write
+// (i8080_map_image), the bytes of pages it covers in part are written through
+// the page table. the image must outlive the mapping
+void i8080_image_load(i8080_t* state, const i8080_image_t* image);
+
+// where execution starts: 0x100 for .com, the load address of a binary image,
+// the start address record of a hex file or else its lowest address
+uint16_t i8080_image_entry(const i8080_image_t* image);
+
+#endif  // I8080_LOADER_H
@@ -0,0 +1,38 @@
+#ifndef I8080_LOCKSTEP_H
+#define I8080_LOCKSTEP_H
+
+#include "i8080/i8080.h"
+
+// machines stepped together, one per vector lane: 8, 16 or 32. build with
+// -mavx2 or -mavx512bw (make lockstep.o SIMD=avx2) for wide vectors
+#ifndef I8080_LANES
+#define I8080_LANES 16
+#endif
+
+// usually the same rom with different inputs. lanes keep their registers in
+// structure-of-arrays form and every step runs one instruction for all lanes
+// whose pc is the lowest, which is how diverged lanes reconverge. those lanes
+// run it in vectors when it only touches registers and is the same in all of
+// them (a register op, immediate or jump), the others go through i8080_step.
+// lanes that stay together over code that is the same in every lane keep
+// running vector instructions back to back
+typedef struct {
+  i8080_t* machines[I8080_LANES];
+  int count;  // lanes in use
+
+  // profile of the last i8080_lockstep_run
+  uint64_t vector_steps;         // instructions run for a group of lanes
+  uint64_t vector_instructions;  // lane instructions run by those steps
+  uint64_t scalar_instructions;  // lane instructions run by i8080_step
+} i8080_lockstep_t;
+
+// takes count (at most I8080_LANES) initialized machines, each with its own
+// memory and cb up to date. the machines stay owned by the caller
+void i8080_lockstep_init(i8080_lockstep_t* lockstep,
+                         i8080_t* const* machines,
+                         int count);
+// runs steps instructions on every lane, each machine ends up exactly as if it
+// had been given steps calls of i8080_step on its own
+void i8080_lockstep_run(i8080_lockstep_t* lockstep, uint64_t steps);
+
+#endif  // I8080_LOCKSTEP_H
@@ -0,0 +1,62 @@
+#ifndef I8080_PROFILE_H
+#define I8080_PROFILE_H
+
+#include "i8080/i8080.h"
+
+// profiles, collected by i8080_profile_start. i8080_profile_save writes
+// I8080_PROFILE_MAGIC, I8080_PROFILE_VERSION (1 byte) and then the struct as
+// it is in memory, so a profile is read back by builds for the same host
+#define I8080_PROFILE_MAGIC "i8080prf"
+#define I8080_PROFILE_VERSION 1
+
+#define I8080_PROFILE_DEPTH 256   // calls followed, deeper ones aren't
+#define I8080_PROFILE_EDGES 4096  // caller and callee pairs, power of two
+
+// calls from the function at caller to the one at callee, cycles includes
+// everything the callee called in turn
+typedef struct {
+  uint16_t caller;
+  uint16_t callee;
+  uint64_t calls;  // 0 for an unused slot
+  uint64_t cycles;
+} i8080_profile_edge_t;
+
+typedef struct {
+  uint16_t function;
+  uint16_t sp;     // after the return address was pushed
+  int32_t edge;    // index into edges, -1 if it didn't fit
+  uint64_t start;  // cycles when it was entered
+} i8080_profile_frame_t;
+
+// a function is the target of a CALL, an RST or an interrupt, identified by
+// its entry address. cycles are the instruction's own, events fired after it
+// and the idle cycles of a halt aren't counted
+typedef struct i8080_profile_t {
+  uint64_t opcode_count[256];
+  uint64_t opcode_cycles[256];
+
+  // by address of the instruction. code holds the bytes last run at each
+  // address (as the report disassembles them) and runs 2 bytes past 0xffff
+  uint64_t pc_count[I8080_MAX_MEMORY];
+  uint64_t pc_cycles[I8080_MAX_MEMORY];
+  uint8_t code[I8080_MAX_MEMORY + 2];
+
+  // by entry address. self is spent in the function itself, total adds its
+  // callees. a recursive function's total counts each cycle once
+  uint64_t calls[I8080_MAX_MEMORY];
+  uint64_t self_cycles[I8080_MAX_MEMORY];
+  uint64_t total_cycles[I8080_MAX_MEMORY];
+
+  // open addressing on caller and callee
+  i8080_profile_edge_t edges[I8080_PROFILE_EDGES];
+  int edge_count;
+  uint64_t lost_calls;  // calls whose edge didn't fit
+
+  // shadow call stack, frames popped when a return takes sp above them.
+  // stack[0] is what ran when profiling started and is never popped
+  i8080_profile_frame_t stack[I8080_PROFILE_DEPTH];
+  int depth;
+  uint16_t active[I8080_MAX_MEMORY];  // frames open in each function
+} i8080_profile_t;
+
+#endif  // I8080_PROFILE_H
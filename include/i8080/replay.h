@@ -0,0 +1,50 @@
+#ifndef I8080_REPLAY_H
+#define I8080_REPLAY_H
+
+#include "i8080/i8080.h"
+
+// replay logs, recorded by i8080_replay_record. i8080_replay_save writes
+// I8080_REPLAY_MAGIC, I8080_REPLAY_VERSION (1 byte) and then an entry after
+// another, little endian: cycles (8), kind (1), then port and value for
+// I8080_REPLAY_IN or the restart address (2) for I8080_REPLAY_INTERRUPT
+#define I8080_REPLAY_MAGIC "i8080rpl"
+#define I8080_REPLAY_VERSION 1
+
+#define I8080_REPLAY_IN 0
+#define I8080_REPLAY_INTERRUPT 1
+
+// cycles is the cycle count when it happened: that of an IN already holds the
+// instruction's own cycles, an interrupt request was raised after the
+// instruction which took the count there, or between runs
+typedef struct {
+  uint64_t cycles;
+  uint8_t kind;
+  uint8_t port;     // I8080_REPLAY_IN
+  uint8_t value;    // I8080_REPLAY_IN, what the device put on the bus
+  uint16_t vector;  // I8080_REPLAY_INTERRUPT, see i8080_interrupt
+} i8080_replay_entry_t;
+
+// a log in time order. a zeroed log is empty, release with i8080_replay_free
+typedef struct i8080_replay_t {
+  i8080_replay_entry_t* entries;
+  size_t count, capacity;
+  bool failed;  // out of memory while recording, the log is cut short
+
+  // replay position, the next IN and next interrupt to look at
+  bool replaying;
+  size_t next_in, next_interrupt;
+
+  // an IN the log doesn't have at that cycle count or port, or an interrupt
+  // that couldn't be scheduled. the run stops with I8080_STOP_DIVERGED and the
+  // devices answer from there on
+  bool diverged;
+  uint64_t divergence;  // cycle count where it happened
+} i8080_replay_t;
+
+// false if the file can't be written or read, or isn't a replay log. loading
+// replaces what the log held
+bool i8080_replay_save(const i8080_replay_t* replay, const char* file_name);
+bool i8080_replay_load(i8080_replay_t* replay, const char* file_name);
+void i8080_replay_free(i8080_replay_t* replay);
+
+#endif  // I8080_REPLAY_H
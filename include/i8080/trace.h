@@ -0,0 +1,70 @@
+#ifndef I8080_TRACE_H
+#define I8080_TRACE_H
+
+#include "i8080/i8080.h"
+
+// trace files, recorded by i8080_trace_start. little endian throughout.
+//
+// header: I8080_TRACE_MAGIC (8 bytes), I8080_TRACE_VERSION (1 byte), then the
+// registers before the first record: pc, sp (2 bytes each), a, b, c, d, e, h,
+// l, flags.
+//
+// then a record per instruction in execution order, a tag byte of
+// I8080_TRACE_* bits followed by what they say is there, in this order:
+//   pc (2)            I8080_TRACE_PC, otherwise the previous record's pc plus
+//                     its length (0 for an interrupt)
+//   opcode (1-3)      unless I8080_TRACE_INTERRUPT, length by its first byte
+//   mask (1)          I8080_TRACE_REGISTERS, a bit per changed register in the
+//                     order b, c, d, e, h, l, a, flags from bit 0, each
+//                     followed by its new value
+//   sp (2)            I8080_TRACE_SP
+//   count (2)         I8080_TRACE_WRITES, then count times address (2) and
+//                     byte, in the order they were written
+#define I8080_TRACE_MAGIC "i8080trc"
+#define I8080_TRACE_VERSION 1
+
+#define I8080_TRACE_PC 0x01
+#define I8080_TRACE_INTERRUPT 0x02  // accepted interrupt, restarting at pc
+#define I8080_TRACE_REGISTERS 0x04
+#define I8080_TRACE_SP 0x08
+#define I8080_TRACE_WRITES 0x10
+
+// writes kept per record, any after those aren't recorded. only port and page
+// handlers (a cp/m trap) write that much in one instruction
+#define I8080_TRACE_MAX_WRITES 1024
+
+typedef struct {
+  uint16_t address;
+  uint8_t byte;
+} i8080_trace_write_t;
+
+// an instruction as read back, registers are those after it
+typedef struct {
+  uint16_t pc;  // of the instruction, or where an interrupt restarted
+  bool interrupt;
+  uint8_t opcode[3];
+  uint8_t length;  // of opcode, 0 for an interrupt
+
+  uint8_t a, b, c, d, e, h, l, flags;
+  uint16_t sp;
+  uint8_t changed;  // I8080_TRACE_REGISTERS mask, bit 8 would be sp
+  bool sp_changed;
+
+  int write_count;
+  i8080_trace_write_t writes[I8080_TRACE_MAX_WRITES];
+} i8080_trace_record_t;
+
+typedef struct {
+  FILE* file;
+  i8080_trace_record_t last;  // registers carried into the next record
+} i8080_trace_reader_t;
+
+// false if the file can't be read or isn't a trace
+bool i8080_trace_open(i8080_trace_reader_t* reader, const char* file_name);
+// decodes the next record, false at the end of the trace. a record cut short
+// (a recorder that didn't stop) ends it too
+bool i8080_trace_next(i8080_trace_reader_t* reader,
+                      i8080_trace_record_t* record);
+void i8080_trace_close(i8080_trace_reader_t* reader);
+
+#endif  // I8080_TRACE_H
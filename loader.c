@@ -0,0 +1,250 @@
+#include "i8080/loader.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define COM_ADDRESS 0x100  // cp/m transient program area
+
+struct i8080_image_t {
+  const uint8_t* bytes;  // bytes[i] goes to address + i
+  uint16_t address;
+  uint32_t size;
+  uint16_t entry;
+
+  // hex images are a whole address space with the bytes the file sets marked,
+  // one bit each. NULL for the others, which cover all of their range
+  uint8_t* covered;
+
+  size_t mapped;  // length of the mmap'd file, 0 if bytes is malloc'd
+};
+
+i8080_image_format_t i8080_image_format(const char* file_name) {
+  const char* extension = strrchr(file_name, '.');
+
+  if (extension && strcasecmp(extension, ".com") == 0)
+    return I8080_IMAGE_COM;
+  if (extension && (strcasecmp(extension, ".hex") == 0 ||
+                    strcasecmp(extension, ".ihx") == 0))
+    return I8080_IMAGE_HEX;
+
+  return I8080_IMAGE_BINARY;
+}
+
+// maps the whole file read-only. private, the guest's writes never get to it
+// anyway since the pages are copied before they're written
+static bool map_file(i8080_image_t* image, const char* file_name) {
+  const int fd = open(file_name, O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return false;
+  }
+
+  image->size = st.st_size;
+  if (st.st_size > 0) {
+    void* bytes = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (bytes == MAP_FAILED) {
+      close(fd);
+      return false;
+    }
+    image->bytes = bytes;
+    image->mapped = st.st_size;
+  }
+
+  close(fd);  // the mapping keeps the file
+
+  return true;
+}
+
+static int hex_digit(const char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+// parses the record of a line, ":LLAAAATT" then data and checksum. false if
+// it isn't one or the checksum is off
+static bool hex_record(const char* line, uint8_t* record, int* length) {
+  if (line[0] != ':')
+    return false;
+
+  int count = 0;
+  uint8_t sum = 0;
+  for (const char* c = line + 1; hex_digit(c[0]) >= 0; c += 2) {
+    const int high = hex_digit(c[0]), low = hex_digit(c[1]);
+    if (low < 0 || count == 5 + 255)
+      return false;
+
+    record[count] = (high << 4) | low;
+    sum += record[count++];
+  }
+
+  *length = count;
+  return count >= 5 && count == 5 + record[0] && sum == 0;
+}
+
+// reads the records into a 64 KiB buffer. addresses past 0xffff (extended
+// address records other than 0, or data running over the end) are errors
+static bool parse_hex(i8080_image_t* image, const char* file_name) {
+  FILE* file = fopen(file_name, "r");
+  if (!file)
+    return false;
+
+  uint8_t* bytes = calloc(1, I8080_MAX_MEMORY);
+  image->covered = calloc(1, I8080_MAX_MEMORY / 8);
+  image->bytes = bytes;
+  image->size = I8080_MAX_MEMORY;
+
+  char line[1024];
+  bool ok = bytes && image->covered, start = false, end = false;
+  uint32_t lowest = I8080_MAX_MEMORY;
+
+  while (ok && !end && fgets(line, sizeof(line), file)) {
+    uint8_t record[5 + 255];
+    int length;
+
+    if (line[strspn(line, " \t\r\n")] == '\0')
+      continue;  // blank line
+    if (!hex_record(line + strspn(line, " \t"), record, &length)) {
+      ok = false;
+      break;
+    }
+
+    const uint32_t address = (record[1] << 8) | record[2];
+    const uint8_t* data = &record[4];
+
+    switch (record[3]) {
+      case 0x00:
+        if (address + record[0] > I8080_MAX_MEMORY) {
+          ok = false;
+          break;
+        }
+        for (int i = 0; i < record[0]; i++) {
+          bytes[address + i] = data[i];
+          image->covered[(address + i) / 8] |= 1 << ((address + i) % 8);
+        }
+        if (record[0] && address < lowest)
+          lowest = address;
+        break;
+      case 0x01:
+        end = true;
+        break;
+      case 0x02:  // extended segment, extended linear address
+      case 0x04:
+        ok = record[0] == 2 && data[0] == 0 && data[1] == 0;
+        break;
+      case 0x03:  // start segment, cs:ip
+        ok = record[0] == 4;
+        image->entry = (data[0] << 8 | data[1]) * 16 + (data[2] << 8 | data[3]);
+        start = true;
+        break;
+      case 0x05:  // start linear
+        ok = record[0] == 4;
+        image->entry = (data[2] << 8) | data[3];
+        start = true;
+        break;
+      default:
+        ok = false;
+        break;
+    }
+  }
+
+  fclose(file);
+
+  if (!start)
+    image->entry = lowest < I8080_MAX_MEMORY ? lowest : 0;
+
+  return ok;
+}
+
+i8080_image_t* i8080_image_open(const char* file_name,
+                                const i8080_image_format_t format,
+                                const uint16_t address) {
+  i8080_image_t* image = calloc(1, sizeof(i8080_image_t));
+  if (!image)
+    return NULL;
+
+  bool ok;
+  switch (format) {
+    case I8080_IMAGE_COM:
+      image->address = COM_ADDRESS;
+      image->entry = COM_ADDRESS;
+      ok = map_file(image, file_name);
+      break;
+    case I8080_IMAGE_BINARY:
+      image->address = address;
+      image->entry = address;
+      ok = map_file(image, file_name);
+      break;
+    default:
+      ok = parse_hex(image, file_name);
+      break;
+  }
+
+  if (!ok || image->address + image->size > I8080_MAX_MEMORY) {
+    i8080_image_close(image);
+    return NULL;
+  }
+
+  return image;
+}
+
+void i8080_image_close(i8080_image_t* image) {
+  if (!image)
+    return;
+
+  if (image->mapped)
+    munmap((void*)image->bytes, image->mapped);
+  else
+    free((void*)image->bytes);
+  free(image->covered);
+  free(image);
+}
+
+static bool covered(const i8080_image_t* image, const uint32_t address) {
+  if (address < image->address || address >= image->address + image->size)
+    return false;
+
+  return !image->covered ||
+         (image->covered[address / 8] >> (address % 8)) & 1;
+}
+
+void i8080_image_load(i8080_t* state, const i8080_image_t* image) {
+  const uint32_t end = image->address + image->size;
+
+  for (uint32_t page = image->address / I8080_PAGE_SIZE * I8080_PAGE_SIZE;
+       page < end; page += I8080_PAGE_SIZE) {
+    int count = 0;
+    for (int i = 0; i < I8080_PAGE_SIZE; i++)
+      count += covered(image, page + i);
+
+    if (count == I8080_PAGE_SIZE) {
+      i8080_map_image(state, page, I8080_PAGE_SIZE,
+                      &image->bytes[page - image->address]);
+    } else if (count) {
+      // the rest of the page keeps whatever it held
+      for (int i = 0; i < I8080_PAGE_SIZE; i++) {
+        if (covered(image, page + i))
+          i8080_write_byte(state, page + i,
+                           image->bytes[page + i - image->address]);
+      }
+    }
+  }
+}
+
+uint16_t i8080_image_entry(const i8080_image_t* image) {
+  return image->entry;
+}
@@ -0,0 +1,545 @@
+#include "i8080/lockstep.h"
+
+#include <string.h>
+
+#if I8080_LANES != 8 && I8080_LANES != 16 && I8080_LANES != 32
+#error "I8080_LANES must be 8, 16 or 32"
+#endif
+
+// one element per lane, gcc lowers the operations to whatever vector unit the
+// build targets (sse2 by default, avx2/avx-512 with -mavx2/-mavx512bw)
+typedef uint8_t lane8_t __attribute__((vector_size(I8080_LANES)));
+typedef uint16_t lane16_t __attribute__((vector_size(2 * I8080_LANES)));
+// lane masks, all ones in the lanes taking part. comparisons yield these
+typedef int8_t mask8_t __attribute__((vector_size(I8080_LANES)));
+typedef int16_t mask16_t __attribute__((vector_size(2 * I8080_LANES)));
+
+// same bits as conditionbits_t
+#define FLAG_S 0x80
+#define FLAG_Z 0x40
+#define FLAG_AC 0x10
+#define FLAG_P 0x04
+#define FLAG_BIT1 0x02
+#define FLAG_C 0x01
+
+// register numbers as encoded in opcodes, 6 is M
+enum { REG_B, REG_C, REG_D, REG_E, REG_H, REG_L, REG_M, REG_A };
+
+// alu operations as encoded in opcodes 0x80-0xbf and the immediates
+enum { ALU_ADD, ALU_ADC, ALU_SUB, ALU_SBB, ALU_ANA, ALU_XRA, ALU_ORA, ALU_CMP };
+
+// flag tested by conditional jumps, indexed by condition / 2
+static const uint8_t CONDITION_FLAGS[] = {FLAG_Z, FLAG_C, FLAG_P, FLAG_S};
+
+// registers of all lanes, regs is indexed by register number (M unused)
+typedef struct {
+  lane8_t regs[8];
+  lane8_t psw;  // cb.byte
+  lane16_t pc, sp;
+} lanes_t;
+
+static inline lane8_t select8(const mask8_t mask,
+                              const lane8_t yes,
+                              const lane8_t no) {
+  return (yes & (lane8_t)mask) | (no & ~(lane8_t)mask);
+}
+
+static inline lane16_t select16(const mask16_t mask,
+                                const lane16_t yes,
+                                const lane16_t no) {
+  return (yes & (lane16_t)mask) | (no & ~(lane16_t)mask);
+}
+
+static inline lane16_t widen(const lane8_t bytes) {
+  return __builtin_convertvector(bytes, lane16_t);
+}
+
+static inline lane8_t narrow(const lane16_t words) {
+  return __builtin_convertvector(words, lane8_t);
+}
+
+static inline lane16_t pair(const lanes_t* v, const int high) {
+  return (widen(v->regs[high]) << 8) | widen(v->regs[high + 1]);
+}
+
+// flags of an 8-bit result except c and ac, parity folded down to bit 0
+static inline lane8_t zsp_flags(const lane8_t result) {
+  lane8_t parity = result ^ (result >> 4);
+  parity ^= parity >> 2;
+  parity ^= parity >> 1;
+
+  return (result & FLAG_S) | ((lane8_t)(result == 0) & FLAG_Z) |
+         ((~parity & 1) << 2) | FLAG_BIT1;
+}
+
+static void lane_load(lanes_t* v, const i8080_t* state, const int lane) {
+  v->regs[REG_B][lane] = state->b;
+  v->regs[REG_C][lane] = state->c;
+  v->regs[REG_D][lane] = state->d;
+  v->regs[REG_E][lane] = state->e;
+  v->regs[REG_H][lane] = state->h;
+  v->regs[REG_L][lane] = state->l;
+  v->regs[REG_A][lane] = state->a;
+  v->psw[lane] = state->cb.byte;
+  v->pc[lane] = state->pc;
+  v->sp[lane] = state->sp;
+}
+
+static void lane_store(const lanes_t* v, i8080_t* state, const int lane) {
+  state->b = v->regs[REG_B][lane];
+  state->c = v->regs[REG_C][lane];
+  state->d = v->regs[REG_D][lane];
+  state->e = v->regs[REG_E][lane];
+  state->h = v->regs[REG_H][lane];
+  state->l = v->regs[REG_L][lane];
+  state->a = v->regs[REG_A][lane];
+  state->cb.byte = v->psw[lane];
+  state->lazy = (lazyflags_t){0};  // cb holds the flags
+  state->pc = v->pc[lane];
+  state->sp = v->sp[lane];
+}
+
+// instructions that only read and write registers, the ones run in vectors
+static bool vectorizable(const uint8_t op) {
+  const int dst = (op >> 3) & 7;
+  const int src = op & 7;
+
+  switch (op >> 6) {
+    case 0:
+      switch (op & 0x0f) {
+        case 0x01:  // lxi
+        case 0x03:  // inx
+        case 0x0b:  // dcx
+          return true;
+      }
+      if (src >= 4 && src <= 6)  // inr, dcr, mvi
+        return dst != REG_M;
+      return op == 0x00 || op == 0x2f || op == 0x37 || op == 0x3f;
+    case 1:
+      return dst != REG_M && src != REG_M;  // mov, 0x76 is hlt
+    case 2:
+      return src != REG_M;
+    default:
+      return op == 0xc3 || op == 0xeb || src == 2 || src == 6;  // jmp, xchg,
+                                                                // jcc, alu imm
+  }
+}
+
+// a, flags of an alu operation on all masked lanes
+static void vector_alu(lanes_t* v,
+                       const mask8_t mask,
+                       const int operation,
+                       const lane8_t rhs) {
+  const lane8_t lhs = v->regs[REG_A];
+  lane8_t result, flags;
+
+  switch (operation) {
+    case ALU_ADD:
+    case ALU_ADC: {
+      lane16_t sum = widen(lhs) + widen(rhs);
+      if (operation == ALU_ADC)
+        sum += widen(v->psw & FLAG_C);
+      result = narrow(sum);
+      flags = zsp_flags(result) | (narrow(sum >> 8) & FLAG_C) |
+              ((lhs ^ result ^ rhs) & FLAG_AC);
+      break;
+    }
+    case ALU_SUB:
+    case ALU_SBB:
+    case ALU_CMP: {
+      lane16_t difference = widen(lhs) - widen(rhs);
+      if (operation == ALU_SBB)
+        difference -= widen(v->psw & FLAG_C);
+      result = narrow(difference);
+      flags = zsp_flags(result) | (narrow(difference >> 8) & FLAG_C) |
+              (~(lhs ^ result ^ rhs) & FLAG_AC);
+      if (operation == ALU_CMP)
+        result = lhs;
+      break;
+    }
+    case ALU_ANA:
+      result = lhs & rhs;
+      flags = zsp_flags(result) | (((lhs | rhs) << 1) & FLAG_AC);
+      break;
+    case ALU_XRA:
+      result = lhs ^ rhs;
+      flags = zsp_flags(result);
+      break;
+    default:
+      result = lhs | rhs;
+      flags = zsp_flags(result);
+      break;
+  }
+
+  v->regs[REG_A] = select8(mask, result, lhs);
+  v->psw = select8(mask, flags, v->psw);
+}
+
+// runs a vectorizable instruction on the masked lanes, all at the same pc
+static void vector_execute(lanes_t* v,
+                           const uint8_t* opcode,
+                           const int length,
+                           const mask8_t mask) {
+  const mask16_t mask16 = __builtin_convertvector(mask, mask16_t);
+  const uint8_t op = opcode[0];
+  const int dst = (op >> 3) & 7;
+  const int src = op & 7;
+  const uint16_t address = (opcode[2] << 8) | opcode[1];
+  lane16_t pc = v->pc + (uint16_t)length;
+
+  if (op >= 0x40 && op < 0x80) {
+    v->regs[dst] = select8(mask, v->regs[src], v->regs[dst]);
+  } else if (op >= 0x80 && op < 0xc0) {
+    vector_alu(v, mask, dst, v->regs[src]);
+  } else if (op >= 0xc0) {
+    if (src == 6) {
+      vector_alu(v, mask, dst, (lane8_t){0} + opcode[1]);
+    } else if (op == 0xeb) {
+      const lane8_t h = v->regs[REG_H], l = v->regs[REG_L];
+      v->regs[REG_H] = select8(mask, v->regs[REG_D], h);
+      v->regs[REG_L] = select8(mask, v->regs[REG_E], l);
+      v->regs[REG_D] = select8(mask, h, v->regs[REG_D]);
+      v->regs[REG_E] = select8(mask, l, v->regs[REG_E]);
+    } else if (op == 0xc3) {
+      pc = (lane16_t){0} + address;
+    } else {
+      // odd conditions jump when the flag is set
+      const lane8_t flag = v->psw & CONDITION_FLAGS[dst >> 1];
+      const mask8_t taken = dst & 1 ? (flag != 0) : (flag == 0);
+      pc = select16(__builtin_convertvector(taken, mask16_t),
+                    (lane16_t){0} + address, pc);
+    }
+  } else if ((op & 0x0f) == 0x01 || (op & 0x0f) == 0x03 ||
+             (op & 0x0f) == 0x0b) {
+    const int rp = op >> 4;  // bc, de, hl, sp
+    lane16_t word = rp == 3 ? v->sp : pair(v, rp * 2);
+
+    if ((op & 0x0f) == 0x01)
+      word = (lane16_t){0} + address;
+    else if ((op & 0x0f) == 0x03)
+      word += 1;
+    else
+      word -= 1;
+
+    if (rp == 3) {
+      v->sp = select16(mask16, word, v->sp);
+    } else {
+      v->regs[rp * 2] = select8(mask, narrow(word >> 8), v->regs[rp * 2]);
+      v->regs[rp * 2 + 1] = select8(mask, narrow(word), v->regs[rp * 2 + 1]);
+    }
+  } else if (src == 4 || src == 5) {
+    // inr, dcr. carry survives
+    const lane8_t reg = v->regs[dst];
+    const lane8_t result = src == 4 ? reg + 1 : reg - 1;
+    const lane8_t ac = src == 4 ? (lane8_t)((result & 0x0f) == 0)
+                                : (lane8_t)((result & 0x0f) != 0x0f);
+
+    v->regs[dst] = select8(mask, result, reg);
+    v->psw = select8(
+        mask, zsp_flags(result) | (v->psw & FLAG_C) | (ac & FLAG_AC), v->psw);
+  } else if (src == 6) {
+    v->regs[dst] = select8(mask, (lane8_t){0} + opcode[1], v->regs[dst]);
+  } else if (op == 0x2f) {
+    v->regs[REG_A] = select8(mask, ~v->regs[REG_A], v->regs[REG_A]);
+  } else if (op == 0x37) {
+    v->psw |= (lane8_t)mask & FLAG_C;
+  } else if (op == 0x3f) {
+    v->psw ^= (lane8_t)mask & FLAG_C;
+  }
+
+  v->pc = select16(mask16, pc, v->pc);
+}
+
+// copies the instruction at pc without going through the bus, so mmio reads
+// can't fire twice. false unless all of it lies in directly mapped pages
+static bool peek(const i8080_t* state, const uint16_t pc, uint8_t* opcode) {
+  int length = 1;
+
+  for (int i = 0; i < length; i++) {
+    const uint16_t address = pc + i;
+    const uint8_t* page = state->read_pages[address / I8080_PAGE_SIZE];
+    if (!page)
+      return false;
+
+    opcode[i] = page[address % I8080_PAGE_SIZE];
+    if (i == 0)
+      length = i8080_opcode_length(opcode[0]);
+  }
+
+  return true;
+}
+
+// whether the instruction at pc is opcode, peeked the same way. word and mask
+// hold opcode as it's laid out in memory, the usual case is a single load
+static bool same_instruction(const i8080_t* state,
+                             const uint16_t pc,
+                             const uint8_t* opcode,
+                             const uint32_t word,
+                             const uint32_t mask,
+                             const int length) {
+  const uint8_t* page = state->read_pages[pc / I8080_PAGE_SIZE];
+  const int offset = pc % I8080_PAGE_SIZE;
+
+  if (__builtin_expect(page && offset <= I8080_PAGE_SIZE - 4, 1)) {
+    uint32_t bytes;
+    memcpy(&bytes, &page[offset], sizeof(bytes));
+    return ((bytes ^ word) & mask) == 0;
+  }
+
+  uint8_t bytes[3];
+  return peek(state, pc, bytes) && memcmp(bytes, opcode, length) == 0;
+}
+
+// nothing but the instruction itself happens in the next i8080_step
+static bool plain_step(const i8080_t* state) {
+  return !state->event_count && !(state->irq_pending && state->ie) &&
+         !state->halted && !state->ei_delay;
+}
+
+static bool any16(const mask16_t mask) {
+  uint64_t words[sizeof(mask) / sizeof(uint64_t)];
+  uint64_t any = 0;
+
+  memcpy(words, &mask, sizeof(mask));
+  for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); i++)
+    any |= words[i];
+
+  return any != 0;
+}
+
+// state of one i8080_lockstep_run
+typedef struct {
+  lanes_t v;
+  i8080_t* const* machines;
+  int count;
+  uint64_t remaining[I8080_LANES];  // steps left in each lane
+  bool plain[I8080_LANES];          // lanes that may join vector steps
+
+  // pages directly mapped and identical in every lane, and pages compared so
+  // far. only scalar steps write memory during a run, they clear both
+  uint64_t same_pages[I8080_PAGE_COUNT / 64];
+  uint64_t compared_pages[I8080_PAGE_COUNT / 64];
+
+  i8080_lockstep_t* lockstep;
+} run_t;
+
+static bool page_bit(const uint64_t* bits, const int page) {
+  return (bits[page / 64] >> (page % 64)) & 1;
+}
+
+// whether page holds the same bytes in every lane, compares it the first time
+// it's asked about since the last scalar step
+static bool same_page(run_t* run, const int page) {
+  if (page_bit(run->same_pages, page))
+    return true;
+  if (page_bit(run->compared_pages, page))
+    return false;
+
+  run->compared_pages[page / 64] |= 1ULL << (page % 64);
+
+  const uint8_t* first = run->machines[0]->read_pages[page];
+  for (int i = 0; i < run->count; i++) {
+    const uint8_t* bytes = run->machines[i]->read_pages[page];
+    if (!bytes || memcmp(bytes, first, I8080_PAGE_SIZE) != 0)
+      return false;
+  }
+
+  run->same_pages[page / 64] |= 1ULL << (page % 64);
+
+  return true;
+}
+
+// whether every lane at pc is known to hold the instruction without checking
+// them one by one. pages are only compared once all lanes run together,
+// diverged lanes would have them compared again after every scalar step
+static bool known_instruction(run_t* run,
+                              const uint16_t pc,
+                              const int length,
+                              const bool together) {
+  const int first = pc / I8080_PAGE_SIZE;
+  const int last = (uint16_t)(pc + length - 1) / I8080_PAGE_SIZE;
+
+  if (!together) {
+    return page_bit(run->same_pages, first) &&
+           page_bit(run->same_pages, last);
+  }
+
+  return same_page(run, first) && same_page(run, last);
+}
+
+static void scalar_step(run_t* run, const int lane) {
+  i8080_t* state = run->machines[lane];
+
+  lane_store(&run->v, state, lane);
+  i8080_step(state);
+  lane_load(&run->v, state, lane);
+  run->plain[lane] = plain_step(state);
+  run->remaining[lane]--;
+  run->lockstep->scalar_instructions++;
+
+  memset(run->same_pages, 0, sizeof(run->same_pages));
+  memset(run->compared_pages, 0, sizeof(run->compared_pages));
+}
+
+// keeps running the lanes of a vector step while they stay together and their
+// code is known to be the same, without going through the lane scheduling.
+// stops before catching up with the lowest pc of any other lane so they merge
+static void vector_run(run_t* run,
+                       const mask8_t lanes,
+                       const int leader,
+                       const uint64_t budget,
+                       const uint32_t others) {
+  const mask16_t lanes16 = __builtin_convertvector(lanes, mask16_t);
+  const i8080_t* state = run->machines[leader];
+  uint64_t steps = 0, cycles = 0;
+
+  while (steps < budget && run->v.pc[leader] < others) {
+    const uint16_t pc = run->v.pc[leader];
+    uint8_t opcode[4] = {0};
+    if (!peek(state, pc, opcode) || !vectorizable(opcode[0]))
+      break;
+
+    const int length = i8080_opcode_length(opcode[0]);
+    if (!known_instruction(run, pc, length, true))
+      break;
+
+    vector_execute(&run->v, opcode, length, lanes);
+    steps++;
+    cycles += i8080_opcode_cycles(opcode[0]);
+
+    // a conditional jump may part them
+    if ((opcode[0] & 0xc7) == 0xc2 &&
+        any16((run->v.pc != run->v.pc[leader]) & lanes16))
+      break;
+  }
+
+  int lane_count = 0;
+  for (int i = 0; i < run->count; i++) {
+    if (lanes[i]) {
+      run->remaining[i] -= steps;
+      run->machines[i]->cycles += cycles;
+      run->machines[i]->instructions += steps;
+      lane_count++;
+    }
+  }
+
+  run->lockstep->vector_steps += steps;
+  run->lockstep->vector_instructions += steps * lane_count;
+}
+
+void i8080_lockstep_init(i8080_lockstep_t* lockstep,
+                         i8080_t* const* machines,
+                         int count) {
+  if (count > I8080_LANES)
+    count = I8080_LANES;
+
+  memset(lockstep, 0, sizeof(*lockstep));
+  for (int i = 0; i < count; i++)
+    lockstep->machines[i] = machines[i];
+  lockstep->count = count;
+}
+
+void i8080_lockstep_run(i8080_lockstep_t* lockstep, const uint64_t steps) {
+  run_t run;
+  memset(&run, 0, sizeof(run));
+  run.machines = lockstep->machines;
+  run.count = lockstep->count;
+  run.lockstep = lockstep;
+
+  for (int i = 0; i < run.count; i++) {
+    lane_load(&run.v, run.machines[i], i);
+    run.remaining[i] = steps;
+    run.plain[i] = plain_step(run.machines[i]);
+  }
+
+  lockstep->vector_steps = 0;
+  lockstep->vector_instructions = 0;
+  lockstep->scalar_instructions = 0;
+
+  for (;;) {
+    // lanes with the lowest pc go first, so lanes that took different
+    // branches wait for each other where the paths meet again
+    int leader = -1;
+    bool together = true;
+    for (int i = 0; i < run.count; i++) {
+      if (!run.remaining[i])
+        continue;
+      if (leader >= 0 && run.v.pc[i] != run.v.pc[leader])
+        together = false;
+      if (leader < 0 || run.v.pc[i] < run.v.pc[leader])
+        leader = i;
+    }
+    if (leader < 0)
+      break;
+
+    // lanes at pc holding the same instruction as the leader join the vector
+    // step, the rest are stepped one by one
+    const uint16_t pc = run.v.pc[leader];
+    uint8_t opcode[4] = {0};
+    const bool vector =
+        peek(run.machines[leader], pc, opcode) && vectorizable(opcode[0]);
+    const int length = i8080_opcode_length(opcode[0]);
+    const bool known =
+        vector && known_instruction(&run, pc, length, together);
+
+    const uint8_t length_bytes[4] = {0xff, length > 1 ? 0xff : 0,
+                                     length > 2 ? 0xff : 0, 0};
+    uint32_t word, mask;
+    memcpy(&word, opcode, sizeof(word));
+    memcpy(&mask, length_bytes, sizeof(mask));
+
+    uint8_t group[I8080_LANES] = {0};  // 0xff vector step, 1 scalar step
+    int group_size = 0;
+    bool singles = false;
+
+    for (int i = leader; i < run.count; i++) {
+      if (!run.remaining[i] || run.v.pc[i] != pc)
+        continue;
+
+      if (vector && run.plain[i] &&
+          (known || same_instruction(run.machines[i], pc, opcode, word, mask,
+                                     length))) {
+        group[i] = 0xff;
+        group_size++;
+      } else {
+        group[i] = 1;
+        singles = true;
+      }
+    }
+
+    for (int i = leader; singles && i < run.count; i++) {
+      if (group[i] == 1)
+        scalar_step(&run, i);
+    }
+
+    if (!group_size)
+      continue;
+
+    mask8_t lanes;
+    memcpy(&lanes, group, sizeof(lanes));
+    lanes = lanes < 0;
+    vector_execute(&run.v, opcode, length, lanes);
+
+    const uint8_t cycles = i8080_opcode_cycles(opcode[0]);
+    uint64_t budget = UINT64_MAX;
+    uint32_t others = 0x10000;  // lowest pc outside the group
+    for (int i = 0; i < run.count; i++) {
+      if (group[i] == 0xff) {
+        run.remaining[i]--;
+        run.machines[i]->cycles += cycles;
+        run.machines[i]->instructions++;
+        budget = run.remaining[i] < budget ? run.remaining[i] : budget;
+      } else if (run.remaining[i] && run.v.pc[i] < others) {
+        others = run.v.pc[i];
+      }
+    }
+    lockstep->vector_steps++;
+    lockstep->vector_instructions += group_size;
+
+    if (known)
+      vector_run(&run, lanes, leader, budget, others);
+  }
+
+  for (int i = 0; i < run.count; i++)
+    lane_store(&run.v, run.machines[i], i);
+}
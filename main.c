@@ -1,84 +1,955 @@
+#include "i8080/cpm.h"
+#include "i8080/gdb.h"
 #include "i8080/i8080.h"
+#include "i8080/loader.h"
+#include "i8080/lockstep.h"
+#include "i8080/replay.h"
 
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
-void file_to_mem(uint8_t* memory, const char* file_name, uint16_t offset) {
-  // try open file
-  FILE* file = fopen(file_name, "rb");
-  if (!file) {
+// maps the rom copy-on-write, exits if it can't be read
+i8080_image_t* load_rom(i8080_t* state, const char* file_name) {
+  i8080_image_t* image =
+      i8080_image_open(file_name, i8080_image_format(file_name), 0);
+  if (!image) {
     printf("Could not read file: %s\n", file_name);
     exit(0);
   }
 
-  // get file size
-  fseek(file, 0L, SEEK_END);
-  int file_size = ftell(file);
-  fseek(file, 0L, SEEK_SET);
+  i8080_image_load(state, image);
 
-  // read file contents into state memory
-  uint8_t* buffer = &memory[offset];
-  fread(buffer, file_size, 1, file);
-
-  memory[368] = 0x7;
-  fclose(file);
+  return image;
 }
 
+// bdos calls go through the cp/m layer, which ends the run on warm boot
 void run_testrom(i8080_t* state) {
-  state->pc = 0x100;  // tests starting point
+  i8080_cpm_t cpm;
+  i8080_cpm_init(&cpm, state, "tests", stdin, stdout);
+  state->pc = I8080_CPM_TPA;  // tests starting point
 
-  i8080_write_byte(state, 5, 0xc9);
+  i8080_write_byte(state, 368, 0x7);  // the expected output depends on it
 
   printf("*******************\n");
 
-  while (1) {
-    const uint16_t current_pc = state->pc;
+  i8080_cpm_run(&cpm, UINT64_MAX);
+  if (cpm.exited)
+    printf("\nJumped to 0x0000\n\n");
+  else if (state->halted)
+    printf("HLT at %04X\n", (uint16_t)(state->pc - 1));
+
+  i8080_cpm_close(&cpm);
+}
+
+// an instruction placed at address, its bytes running past 0xffff into page 0,
+// and the registers it leaves
+typedef struct {
+  uint16_t address;
+  uint8_t bytes[3];
+  uint16_t pc, bc;
+  uint8_t a;
+} wrap_test_t;
+
+static const wrap_test_t WRAP_TESTS[] = {
+    {0xffff, {0x01, 0x34, 0x12}, 0x0002, 0x1234, 0x00},  // LXI B,$1234
+    {0xfffe, {0x01, 0x78, 0x56}, 0x0001, 0x5678, 0x00},  // LXI B,$5678
+    {0xfffe, {0xc3, 0x00, 0x20}, 0x2000, 0x0000, 0x00},  // JMP $2000
+    {0xffff, {0x3e, 0x5a, 0x00}, 0x0001, 0x0000, 0x5a},  // MVI A,$5a
+};
+
+#define WRAP_RUNS 32  // enough entries for the jit to translate the NOP
+
+static void put_wrap_byte(i8080_t* state,
+                          uint8_t* image,
+                          const uint16_t address,
+                          const uint8_t byte) {
+  if (image && address < I8080_PAGE_SIZE)
+    image[address] = byte;
+  else
+    i8080_write_byte(state, address, byte);
+}
+
+// runs the tests on state. with image, page 0 is mapped copy-on-write from it
+// and the bytes there are put into the image instead. with run, each test goes
+// through i8080_run WRAP_RUNS times instead of one i8080_step, between a NOP,
+// which the jit translates as a block ending at the test, and a HLT
+static bool run_wrap_tests(i8080_t* state, uint8_t* image, const bool run) {
+  for (int i = 0; i < sizeof(WRAP_TESTS) / sizeof(WRAP_TESTS[0]); i++) {
+    const wrap_test_t* test = &WRAP_TESTS[i];
+
+    for (int j = 0; j < 3; j++)
+      put_wrap_byte(state, image, test->address + j, test->bytes[j]);
+    if (run) {
+      put_wrap_byte(state, image, test->address - 1, 0x00);  // NOP
+      put_wrap_byte(state, image, test->pc, 0x76);           // HLT
+    }
+    if (image)
+      i8080_map_image(state, 0x0000, I8080_PAGE_SIZE, image);
+
+    for (int j = 0; j < (run ? WRAP_RUNS : 1); j++) {
+      state->pc = test->address - run;
+      state->a = state->b = state->c = 0;
+      state->halted = 0;
+      if (run)
+        i8080_run(state, 1000);
+      else
+        i8080_step(state);
+
+      if (state->pc != (uint16_t)(test->pc + run) ||
+          ((state->b << 8) | state->c) != test->bc || state->a != test->a)
+        return false;
+    }
+  }
+
+  return true;
+}
+
+// instruction fetch across 0xffff, on mirrored memory, plain memory and with
+// page 0 copy-on-write. stepped, then run with the jit or block cache where
+// built in
+static void test_wrap(void) {
+  static uint8_t image[I8080_PAGE_SIZE];
+  const char* names[] = {"mirrored memory", "plain memory", "rom at 0x0000"};
+
+  for (int i = 0; i < 6; i++) {
+    const bool run = i >= 3;
+    i8080_t state;
+    init_i8080(&state);
+    if (i % 3 == 1)
+      i8080_attach_memory(&state, calloc(1, I8080_MAX_MEMORY));
+    else
+      i8080_alloc_memory(&state);
+    if (run) {
+      i8080_jit_enable(&state);
+      i8080_block_cache_enable(&state);
+    }
+
+    if (!run_wrap_tests(&state, i % 3 == 2 ? image : NULL, run))
+      printf("Fetch across 0xffff failed: %s%s\n", names[i % 3],
+             run ? ", i8080_run" : "");
+
+    i8080_jit_disable(&state);
+    i8080_block_cache_disable(&state);
+    i8080_free_memory(&state);
+  }
+}
+
+// stores to 0x2000, reads it back and counts c up in a loop until b runs out
+static const uint8_t DEBUG_PROGRAM[] = {
+    0x21, 0x00, 0x20,  // 0000 LXI H,$2000
+    0x36, 0x42,        // 0003 MVI M,$42
+    0x7e,              // 0005 MOV A,M
+    0x06, 0x40,        // 0006 MVI B,$40
+    0x0c,              // 0008 INR C
+    0x05,              // 0009 DCR B
+    0xc2, 0x08, 0x00,  // 000a JNZ $0008
+    0x76,              // 000d HLT
+};
+
+static bool expect_stop(i8080_t* state,
+                        const i8080_run_result_t run,
+                        const i8080_stop_reason_t reason,
+                        const uint16_t pc) {
+  return run.reason == reason && state->pc == pc;
+}
+
+static void restart_at_zero(i8080_t* state) {
+  state->pc = 0x0000;
+  state->c = 0;
+  state->halted = 0;
+}
+
+// breakpoints and watchpoints, with the jit or block cache where built in. the
+// second breakpoint sits inside the loop's block once it is hot
+static void test_debugger(void) {
+  i8080_t state;
+  init_i8080(&state);
+  i8080_alloc_memory(&state);
+  i8080_jit_enable(&state);
+  i8080_block_cache_enable(&state);
+  i8080_debug_start(&state);
+
+  for (int i = 0; i < sizeof(DEBUG_PROGRAM); i++)
+    i8080_write_byte(&state, i, DEBUG_PROGRAM[i]);
+
+  const char* failed = NULL;
+
+  i8080_break_set(&state, 0x0005);
+  if (!expect_stop(&state, i8080_debug_run(&state, UINT64_MAX),
+                   I8080_STOP_BREAKPOINT, 0x0005))
+    failed = "breakpoint";
+  else if (!expect_stop(&state, i8080_debug_run(&state, UINT64_MAX),
+                        I8080_STOP_HALTED, 0x000e) ||
+           state.c != 0x40)
+    failed = "continue from a breakpoint";
 
-    if (i8080_read_byte(state, state->pc) == 0x76)
-      printf("HLT at %04X\n", state->pc);
+  i8080_break_clear(&state, 0x0005);
+  i8080_break_set(&state, 0x0009);
+  restart_at_zero(&state);
+  if (!failed &&
+      (!expect_stop(&state, i8080_debug_run(&state, UINT64_MAX),
+                    I8080_STOP_BREAKPOINT, 0x0009) ||
+       state.c != 1 ||
+       !expect_stop(&state, i8080_debug_run(&state, UINT64_MAX),
+                    I8080_STOP_BREAKPOINT, 0x0009) ||
+       state.c != 2))
+    failed = "breakpoint inside a block";
 
-    if (state->pc == 5) {
-      if (state->c == 9) {
-        for (uint16_t i = (state->d << 8 | state->e);
-             i8080_read_byte(state, i) != '$'; i++)
-          printf("%c", i8080_read_byte(state, i));
-      }
+  i8080_break_clear(&state, 0x0009);
+  i8080_watch_set(&state, 0x2000, 1, false, true);
+  restart_at_zero(&state);
+  if (!failed &&
+      (!expect_stop(&state, i8080_debug_run(&state, UINT64_MAX),
+                    I8080_STOP_WATCH_WRITE, 0x0005) ||
+       i8080_watch_hit(&state) != 0x2000 ||
+       i8080_debug_read(&state, 0x2000) != 0x42))
+    failed = "write watchpoint";
 
-      if (state->c == 2)
-        printf("%c", state->e);
+  i8080_watch_clear(&state, 0x2000, 1, false, true);
+  i8080_watch_set(&state, 0x2000, 1, true, false);
+  restart_at_zero(&state);
+  if (!failed && (!expect_stop(&state, i8080_run(&state, UINT64_MAX),
+                               I8080_STOP_WATCH_READ, 0x0006) ||
+                  state.a != 0x42))
+    failed = "read watchpoint";
+
+  // the operand bytes of an instruction running into a watched page are
+  // fetched, not read
+  i8080_watch_clear(&state, 0x2000, 1, true, false);
+  const uint8_t crossing[] = {0x01, 0x34, 0x12, 0x76};  // LXI B,$1234; HLT
+  for (int i = 0; i < sizeof(crossing); i++)
+    i8080_write_byte(&state, 0x01ff + i, crossing[i]);
+  i8080_watch_set(&state, 0x0200, 3, true, false);
+  state.pc = 0x01ff;
+  if (!failed && (!expect_stop(&state, i8080_run(&state, UINT64_MAX),
+                               I8080_STOP_HALTED, 0x0203) ||
+                  state.b != 0x12 || state.c != 0x34))
+    failed = "fetch from a watched page";
+
+  // breakpoints and watches set without the debugger are ignored
+  i8080_debug_stop(&state);
+  i8080_watch_set(&state, 0x2000, 1, true, true);
+  if (!failed &&
+      (i8080_break_set(&state, 0x0005) || i8080_watch_hit(&state) != 0))
+    failed = "breakpoint without the debugger";
+
+  restart_at_zero(&state);
+  if (!failed && !expect_stop(&state, i8080_run(&state, UINT64_MAX),
+                              I8080_STOP_HALTED, 0x000e))
+    failed = "run after the debugger";
+
+  if (failed)
+    printf("Debugger test failed: %s\n", failed);
+
+  i8080_jit_disable(&state);
+  i8080_block_cache_disable(&state);
+  i8080_free_memory(&state);
+}
+
+// requests of a gdb session and the replies expected, the program is
+// DEBUG_PROGRAM. registers go low byte first: af, bc, de, hl, sp, pc
+static const char* const GDB_SESSION[][2] = {
+    {"?", "S05"},
+    {"g", "020000000000000000000000"},
+    {"m0,3", "210020"},
+    {"Z0,9,1", "OK"},
+    {"c", "S05"},
+    {"g", "024201400000002000000900"},  // at the breakpoint, c counted to 1
+};
+
+// sends a request to the stub as a packet and reads the reply into reply,
+// acknowledging it. false when the connection fails
+static bool gdb_request(const int connection,
+                        const char* request,
+                        char* reply,
+                        const size_t size) {
+  char packet[64];
+  uint8_t checksum = 0;
+  for (const char* c = request; *c; c++)
+    checksum += *c;
+  const int length =
+      snprintf(packet, sizeof(packet), "$%s#%02x", request, checksum);
+  if (send(connection, packet, length, 0) != length)
+    return false;
+
+  // '+' for the request, then $reply#xx
+  size_t used = 0;
+  char c;
+  bool in_packet = false;
+  while (recv(connection, &c, 1, 0) == 1) {
+    if (c == '$') {
+      in_packet = true;
+    } else if (in_packet && c == '#') {
+      char digits[2];
+      reply[used] = '\0';
+      return recv(connection, digits, 2, MSG_WAITALL) == 2 &&
+             send(connection, "+", 1, 0) == 1;
+    } else if (in_packet && used + 1 < size) {
+      reply[used++] = c;
     }
+  }
+
+  return false;
+}
+
+// connects to the stub on port of the loopback interface, waiting for it to
+// listen. -1 if it never does
+static int gdb_connect(const uint16_t port) {
+  struct sockaddr_in address = {0};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  for (int i = 0; i < 100; i++) {
+    const int connection = socket(AF_INET, SOCK_STREAM, 0);
+    if (connection < 0)
+      return -1;
+    if (connect(connection, (struct sockaddr*)&address, sizeof(address)) == 0)
+      return connection;
+
+    close(connection);
+    usleep(10000);
+  }
+
+  return -1;
+}
+
+// a gdb session over loopback with the stub serving a child process, and a
+// stub that can't listen, which has to leave the debugger stopped
+static void test_gdb(void) {
+  const uint16_t port = 20000 + getpid() % 20000;
+  const char* failed = NULL;
+
+  fflush(stdout);  // or the child prints it again
+  const pid_t child = fork();
+  if (child == 0) {
+    i8080_t state;
+    init_i8080(&state);
+    i8080_alloc_memory(&state);
+    for (int i = 0; i < sizeof(DEBUG_PROGRAM); i++)
+      i8080_write_byte(&state, i, DEBUG_PROGRAM[i]);
+    _exit(i8080_gdb_serve(&state, port, NULL, NULL) && !state.debug ? 0 : 1);
+  }
+
+  const int connection = child > 0 ? gdb_connect(port) : -1;
+  if (connection < 0)
+    failed = "connect";
+
+  char reply[64];
+  for (int i = 0; i < sizeof(GDB_SESSION) / sizeof(GDB_SESSION[0]); i++) {
+    if (!failed &&
+        (!gdb_request(connection, GDB_SESSION[i][0], reply, sizeof(reply)) ||
+         strcmp(reply, GDB_SESSION[i][1]) != 0))
+      failed = GDB_SESSION[i][0];
+  }
+
+  if (connection >= 0) {
+    send(connection, "$k#6b", 5, 0);
+    close(connection);
+  }
+  if (child > 0) {
+    if (failed)
+      kill(child, SIGKILL);
+    int status;
+    if (waitpid(child, &status, 0) != child ||
+        (!failed && (!WIFEXITED(status) || WEXITSTATUS(status) != 0)))
+      failed = "k";
+  }
+
+  // the port is taken by a listener of our own
+  const int listener = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in address = {0};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (listener >= 0 &&
+      bind(listener, (struct sockaddr*)&address, sizeof(address)) == 0 &&
+      listen(listener, 1) == 0) {
+    i8080_t state;
+    init_i8080(&state);
+    if (!failed &&
+        (i8080_gdb_serve(&state, port, NULL, NULL) || state.debug))
+      failed = "port in use";
+  }
+  if (listener >= 0)
+    close(listener);
+
+  if (failed)
+    printf("Gdb stub test failed: %s\n", failed);
+}
+
+// adds IN 1 to 0x2000 in a loop, RST 1 counts interrupts in 0x2001
+static const uint8_t REPLAY_PROGRAM[] = {
+    0xc3, 0x40, 0x00,  // 0000 JMP $0040
+    0x00, 0x00, 0x00, 0x00, 0x00,
+    0xf5,              // 0008 PUSH PSW
+    0x3a, 0x01, 0x20,  // 0009 LDA $2001
+    0x3c,              // 000c INR A
+    0x32, 0x01, 0x20,  // 000d STA $2001
+    0xf1,              // 0010 POP PSW
+    0xfb,              // 0011 EI
+    0xc9,              // 0012 RET
+};
+static const uint8_t REPLAY_LOOP[] = {
+    0x31, 0x00, 0x10,  // 0040 LXI SP,$1000
+    0x21, 0x00, 0x20,  // 0043 LXI H,$2000
+    0xfb,              // 0046 EI
+    0xdb, 0x01,        // 0047 IN 1
+    0x86,              // 0049 ADD M
+    0x77,              // 004a MOV M,A
+    0xc3, 0x47, 0x00,  // 004b JMP $0047
+};
+
+#define REPLAY_CYCLES 200000
+#define REPLAY_SNAPSHOTS 4
+
+// noise on port 1 and a timer raising RST 1 at uneven intervals. neither is
+// part of snapshots, so only the log makes a rerun come out the same
+static uint32_t noise = 1;
+
+static uint32_t next_noise(void) {
+  noise ^= noise << 13;
+  noise ^= noise >> 17;
+  noise ^= noise << 5;
+  return noise;
+}
+
+static uint8_t noise_in(void* context, const uint8_t port) {
+  return next_noise();
+}
+
+static void timer(i8080_t* state, void* context) {
+  i8080_interrupt(state, 0x08, 0x00);
+  i8080_schedule(state, state->cycles + 1000 + next_noise() % 500, timer, NULL);
+}
+
+// machine state a rerun has to reproduce
+static bool same_run(i8080_t* state,
+                     const uint64_t cycles,
+                     const uint16_t pc,
+                     const uint8_t sum,
+                     const uint8_t interrupts) {
+  return state->cycles == cycles && state->pc == pc &&
+         i8080_read_byte(state, 0x2000) == sum &&
+         i8080_read_byte(state, 0x2001) == interrupts &&
+         !state->replay->diverged;
+}
+
+// records a run, then replays it from the start, from a snapshot taken along
+// the way with the log saved and loaded again, and with a program changed
+// under the log
+static void test_replay(void) {
+  i8080_t state;
+  init_i8080(&state);
+  i8080_alloc_memory(&state);
+  i8080_map_port(&state, 1, (i8080_port_handler_t){noise_in, NULL, NULL});
+  i8080_jit_enable(&state);
+  i8080_block_cache_enable(&state);
+
+  for (int i = 0; i < sizeof(REPLAY_PROGRAM); i++)
+    i8080_write_byte(&state, i, REPLAY_PROGRAM[i]);
+  for (int i = 0; i < sizeof(REPLAY_LOOP); i++)
+    i8080_write_byte(&state, 0x40 + i, REPLAY_LOOP[i]);
+  i8080_schedule(&state, 1000, timer, NULL);
+
+  i8080_replay_t log = {0};
+  i8080_snapshot_t* snapshots[REPLAY_SNAPSHOTS];
+  i8080_replay_record(&state, &log);
+  for (int i = 0; i < REPLAY_SNAPSHOTS; i++) {
+    snapshots[i] = i8080_snapshot(&state);
+    i8080_run(&state, REPLAY_CYCLES / REPLAY_SNAPSHOTS);
+  }
+
+  const uint64_t cycles = state.cycles;
+  const uint16_t pc = state.pc;
+  const uint8_t sum = i8080_read_byte(&state, 0x2000);
+  const uint8_t interrupts = i8080_read_byte(&state, 0x2001);
+  const char* failed = NULL;
+
+  i8080_replay_play(&state, &log);
+  i8080_restore(&state, snapshots[0]);
+  i8080_run(&state, cycles - state.cycles);
+  if (!interrupts || !same_run(&state, cycles, pc, sum, interrupts))
+    failed = "from the start";
+
+  i8080_replay_t loaded = {0};
+  if (!failed && (!i8080_replay_save(&log, "replay_test.log") ||
+                  !i8080_replay_load(&loaded, "replay_test.log") ||
+                  loaded.count != log.count))
+    failed = "saving and loading";
+  remove("replay_test.log");
+
+  i8080_replay_play(&state, &loaded);
+  i8080_restore(&state, snapshots[2]);
+  i8080_run(&state, cycles - state.cycles);
+  if (!failed && !same_run(&state, cycles, pc, sum, interrupts))
+    failed = "from a snapshot";
+
+  i8080_restore(&state, snapshots[1]);
+  i8080_write_byte(&state, 0x0048, 0x02);  // IN 2
+  const i8080_run_result_t run = i8080_run(&state, cycles - state.cycles);
+  if (!failed && (run.reason != I8080_STOP_DIVERGED || !loaded.diverged))
+    failed = "divergence";
+
+  if (failed)
+    printf("Replay test failed: %s\n", failed);
+
+  i8080_replay_stop(&state);
+  i8080_replay_free(&log);
+  i8080_replay_free(&loaded);
+  for (int i = 0; i < REPLAY_SNAPSHOTS; i++)
+    i8080_snapshot_free(snapshots[i]);
+  i8080_snapshot_forget(&state);
+  i8080_jit_disable(&state);
+  i8080_block_cache_disable(&state);
+  i8080_free_memory(&state);
+}
 
-    // i8080_disassemble(state->external_memory, state->pc);
-    i8080_step(state);
-    // i8080_print(state);
+// counts up from 0x3000 and latches the low byte of each address on port 1
+static const uint8_t SNAPSHOT_PROGRAM[] = {
+    0x21, 0x00, 0x30,  // 0000 LXI H,$3000
+    0x34,              // 0003 INR M
+    0x23,              // 0004 INX H
+    0x7d,              // 0005 MOV A,L
+    0xd3, 0x01,        // 0006 OUT 1
+    0xc3, 0x03, 0x00,  // 0008 JMP $0003
+};
 
-    if (state->pc == 0) {
-      printf("\nJumped to 0x0000 from 0x%04X\n\n", current_pc);
-      break;
+#define SNAPSHOT_CYCLES 20000  // a few pages a run
+
+static void latch_out(void* context, const uint8_t port, const uint8_t byte) {
+  *(uint8_t*)context = byte;
+}
+
+static void latch_save(void* context, void* buffer) {
+  memcpy(buffer, context, 1);
+}
+
+static void latch_restore(void* context, const void* buffer) {
+  memcpy(context, buffer, 1);
+}
+
+// a machine with the snapshot program loaded and its latch attached as a
+// device
+static void snapshot_machine(i8080_t* state, uint8_t* latch) {
+  init_i8080(state);
+  i8080_alloc_memory(state);
+  i8080_map_port(state, 1, (i8080_port_handler_t){NULL, latch_out, latch});
+  i8080_attach_device(state, (i8080_device_state_t){1, latch_save,
+                                                    latch_restore, latch});
+  i8080_jit_enable(state);
+  i8080_block_cache_enable(state);
+
+  for (int i = 0; i < sizeof(SNAPSHOT_PROGRAM); i++)
+    i8080_write_byte(state, i, SNAPSHOT_PROGRAM[i]);
+}
+
+// restores two snapshots sharing most pages, one of them after the other is
+// freed, and forks a second machine off one of them
+static void test_snapshot(void) {
+  static uint8_t memory[2][I8080_MAX_MEMORY];
+  uint8_t latches[2];
+  i8080_t cpus[2];
+  i8080_t state, fork;
+  uint8_t latch = 0, fork_latch = 0;
+  const char* failed = NULL;
+
+  snapshot_machine(&state, &latch);
+  i8080_snapshot_t* snapshots[2];
+  for (int i = 0; i < 2; i++) {
+    i8080_run(&state, SNAPSHOT_CYCLES);
+    snapshots[i] = i8080_snapshot(&state);
+    memcpy(memory[i], state.external_memory, I8080_MAX_MEMORY);
+    latches[i] = latch;
+    cpus[i] = state;
+  }
+  i8080_run(&state, SNAPSHOT_CYCLES);
+
+  for (int i = 0; i < 2 && !failed; i++) {
+    i8080_restore(&state, snapshots[i]);
+    if (memcmp(&state, &cpus[i], offsetof(i8080_t, external_memory)) ||
+        memcmp(state.external_memory, memory[i], I8080_MAX_MEMORY) ||
+        latch != latches[i])
+      failed = "restoring";
+    i8080_run(&state, SNAPSHOT_CYCLES);
+  }
+
+  // the second snapshot's untouched pages are the first one's
+  i8080_snapshot_free(snapshots[0]);
+  i8080_restore(&state, snapshots[1]);
+  if (!failed && memcmp(state.external_memory, memory[1], I8080_MAX_MEMORY))
+    failed = "sharing pages";
+
+  snapshot_machine(&fork, &fork_latch);
+  i8080_restore(&fork, snapshots[1]);
+  i8080_run(&state, SNAPSHOT_CYCLES);
+  i8080_run(&fork, SNAPSHOT_CYCLES);
+  if (!failed &&
+      (memcmp(&state, &fork, offsetof(i8080_t, external_memory)) ||
+       memcmp(state.external_memory, fork.external_memory,
+              I8080_MAX_MEMORY) ||
+       fork_latch != latch))
+    failed = "forking";
+
+  if (failed)
+    printf("Snapshot test failed: %s\n", failed);
+
+  i8080_snapshot_free(snapshots[1]);
+  i8080_t* const machines[] = {&state, &fork};
+  for (int i = 0; i < 2; i++) {
+    i8080_snapshot_forget(machines[i]);
+    i8080_jit_disable(machines[i]);
+    i8080_block_cache_disable(machines[i]);
+    i8080_free_memory(machines[i]);
+  }
+}
+
+// five instructions and 32 cycles a round: three NOPs, OUT 1 and a jump back
+static const uint8_t COUNT_PROGRAM[] = {
+    0x00, 0x00, 0x00,  // 0000 NOP, NOP, NOP
+    0xd3, 0x01,        // 0003 OUT 1
+    0xc3, 0x00, 0x00,  // 0005 JMP $0000
+};
+
+#define COUNT_PERIOD 7  // cycles between events
+
+static bool count_failed;
+
+// OUT 1 is the fourth instruction of a round
+static void count_out(void* context, uint8_t port, uint8_t byte) {
+  if (i8080_instructions(context) % 5 != 3)
+    count_failed = true;
+}
+
+// events fire between instructions, whose ends are 0, 4, 8, 12 and 22 cycles
+// into a round
+static void count_event(i8080_t* state, void* context) {
+  const uint64_t cycles = i8080_cycles(state);
+  const int ends[] = {0, 4, 8, 12, 22};
+  int done = -1;
+  for (int i = 0; i < 5; i++)
+    if (cycles % 32 == ends[i])
+      done = i;
+
+  if (done < 0 || i8080_instructions(state) != cycles / 32 * 5 + done)
+    count_failed = true;
+
+  i8080_schedule(state, cycles + COUNT_PERIOD, count_event, NULL);
+}
+
+// the instruction count seen by port devices and event handlers in the middle
+// of a run, with the jit or block cache where built in
+static void test_instruction_count(void) {
+  i8080_t state;
+  init_i8080(&state);
+  i8080_alloc_memory(&state);
+  i8080_map_port(&state, 1, (i8080_port_handler_t){NULL, count_out, &state});
+  i8080_jit_enable(&state);
+  i8080_block_cache_enable(&state);
+
+  for (int i = 0; i < sizeof(COUNT_PROGRAM); i++)
+    i8080_write_byte(&state, i, COUNT_PROGRAM[i]);
+  i8080_schedule(&state, COUNT_PERIOD, count_event, NULL);
+
+  count_failed = false;
+  const i8080_run_result_t run = i8080_run(&state, 20000);
+  if (count_failed || run.instructions != state.instructions)
+    printf("Instruction count test failed\n");
+
+  i8080_jit_disable(&state);
+  i8080_block_cache_disable(&state);
+  i8080_free_memory(&state);
+}
+
+// scrambles b for 64 rounds, storing each value from 0x2000. the branches
+// depend on b and d, which differ from lane to lane
+static const uint8_t LOCKSTEP_PROGRAM[] = {
+    0x21, 0x00, 0x20,  // 0000 LXI H,$2000
+    0x0e, 0x40,        // 0003 MVI C,$40
+    0x78,              // 0005 MOV A,B
+    0x87,              // 0006 ADD A
+    0xd2, 0x0c, 0x00,  // 0007 JNC $000c
+    0xee, 0x1d,        // 000a XRI $1d
+    0x47,              // 000c MOV B,A
+    0x77,              // 000d MOV M,A
+    0x23,              // 000e INX H
+    0xe6, 0x03,        // 000f ANI $03
+    0xca, 0x17, 0x00,  // 0011 JZ $0017
+    0x3d,              // 0014 DCR A
+    0x82,              // 0015 ADD D
+    0x57,              // 0016 MOV D,A
+    0x0d,              // 0017 DCR C
+    0xc2, 0x05, 0x00,  // 0018 JNZ $0005
+    0x76,              // 001b HLT
+};
+
+#define LOCKSTEP_STEPS 2000  // past the HLT in every lane
+
+// every lane of the lockstep engine against a machine of its own stepped by
+// i8080_step
+static void test_lockstep(void) {
+  static i8080_t machines[I8080_LANES], scalar[I8080_LANES];
+  i8080_t* lanes[I8080_LANES];
+
+  for (int i = 0; i < I8080_LANES; i++) {
+    i8080_t* const pair[] = {&machines[i], &scalar[i]};
+    for (int j = 0; j < 2; j++) {
+      init_i8080(pair[j]);
+      i8080_attach_memory(pair[j], calloc(1, I8080_MAX_MEMORY));
+      memcpy(pair[j]->external_memory, LOCKSTEP_PROGRAM,
+             sizeof(LOCKSTEP_PROGRAM));
+      pair[j]->b = i * 37 + 1;
+      pair[j]->d = i * 11;
     }
+    lanes[i] = &machines[i];
   }
+
+  i8080_lockstep_t lockstep;
+  i8080_lockstep_init(&lockstep, lanes, I8080_LANES);
+  i8080_lockstep_run(&lockstep, LOCKSTEP_STEPS);
+
+  for (int i = 0; i < I8080_LANES; i++) {
+    for (int j = 0; j < LOCKSTEP_STEPS; j++)
+      i8080_step(&scalar[i]);
+
+    // everything up to external_memory is cpu state
+    if (memcmp(&machines[i], &scalar[i], offsetof(i8080_t, external_memory)) ||
+        memcmp(machines[i].external_memory, scalar[i].external_memory,
+               I8080_MAX_MEMORY))
+      printf("Lockstep test failed: lane %d\n", i);
+
+    free(machines[i].external_memory);
+    free(scalar[i].external_memory);
+  }
+
+  if (!lockstep.vector_instructions)
+    printf("Lockstep test failed: nothing ran in vectors\n");
 }
 
-int main() {
+#define CPM_FCB 0x5c         // default fcb, the new name of a rename follows
+#define CPM_RETURN 0x0200    // bdos calls return to a HLT here
+#define CPM_TEST_RECORDS 3   // written sequentially, then a random one
+#define CPM_RANDOM_RECORD 10
+
+// bdos function with de, as a program calls it. returns a
+static uint8_t cpm_call(i8080_t* state,
+                        const uint8_t function,
+                        const uint16_t de) {
+  state->c = function;
+  state->d = de >> 8;
+  state->e = de & 0xff;
+  state->sp = I8080_CPM_BDOS - 2;
+  i8080_write_byte(state, state->sp, CPM_RETURN & 0xff);
+  i8080_write_byte(state, state->sp + 1, CPM_RETURN >> 8);
+  state->pc = 0x0005;
+  state->halted = 0;
+  i8080_run(state, 100000);
+
+  return state->a;
+}
+
+// fcb on drive a with an 11 character name, at the start of the file
+static void cpm_fcb(i8080_t* state, const char* name, const uint32_t random) {
+  for (int i = 0; i < 36; i++)
+    i8080_write_byte(state, CPM_FCB + i, 0);
+  for (int i = 0; i < 11; i++)
+    i8080_write_byte(state, CPM_FCB + 1 + i, name[i]);
+  for (int i = 0; i < 3; i++)
+    i8080_write_byte(state, CPM_FCB + 33 + i, random >> (i * 8));
+}
+
+static void cpm_fill_dma(i8080_t* state, const uint8_t byte) {
+  for (int i = 0; i < 128; i++)
+    i8080_write_byte(state, I8080_CPM_DMA + i, byte);
+}
+
+// whether the record at the dma address is all byte
+static bool cpm_dma_holds(i8080_t* state, const uint8_t byte) {
+  for (int i = 0; i < 128; i++) {
+    if (i8080_read_byte(state, I8080_CPM_DMA + i) != byte)
+      return false;
+  }
+
+  return true;
+}
+
+// bdos file functions on the host directory: make, sequential and random
+// access, open, search, rename and delete, in a temporary directory
+static void test_cpm_files(void) {
+  char directory[] = "/tmp/i8080-cpm-XXXXXX";
+  if (!mkdtemp(directory)) {
+    printf("Cp/m file test failed: no temporary directory\n");
+    return;
+  }
+
   i8080_t state;
   init_i8080(&state);
-  state.external_memory = malloc(I8080_MAX_MEMORY);
-  int mem_length = sizeof(state.external_memory);
+  i8080_alloc_memory(&state);
+  i8080_cpm_t cpm;
+  i8080_cpm_init(&cpm, &state, directory, stdin, stdout);
+  i8080_write_byte(&state, CPM_RETURN, 0x76);  // HLT
+  const char* failed = NULL;
+
+  cpm_fcb(&state, "TEST    DAT", 0);
+  if (cpm_call(&state, 22, CPM_FCB))
+    failed = "make";
+  for (int i = 0; i < CPM_TEST_RECORDS && !failed; i++) {
+    cpm_fill_dma(&state, i + 1);
+    if (cpm_call(&state, 21, CPM_FCB))
+      failed = "sequential write";
+  }
+  cpm_fill_dma(&state, 0xaa);
+  i8080_write_byte(&state, CPM_FCB + 33, CPM_RANDOM_RECORD);
+  if (!failed && cpm_call(&state, 34, CPM_FCB))
+    failed = "random write";
+  cpm_call(&state, 16, CPM_FCB);
 
-  memset(state.external_memory, 0, mem_length);
-  file_to_mem(state.external_memory, "tests/TST8080.COM", 0x100);
-  run_testrom(&state);
+  cpm_fcb(&state, "TEST    DAT", 0);
+  if (!failed && cpm_call(&state, 15, CPM_FCB))
+    failed = "open";
+  for (int i = 0; i < CPM_TEST_RECORDS && !failed; i++) {
+    if (cpm_call(&state, 20, CPM_FCB) || !cpm_dma_holds(&state, i + 1))
+      failed = "sequential read";
+  }
 
-  memset(state.external_memory, 0, mem_length);
-  file_to_mem(state.external_memory, "tests/CPUTEST.COM", 0x100);
-  run_testrom(&state);
+  // the gap before the random record reads back as zeros
+  const uint8_t random[][2] = {{1, 2}, {CPM_RANDOM_RECORD, 0xaa}, {5, 0}};
+  for (int i = 0; i < 3 && !failed; i++) {
+    i8080_write_byte(&state, CPM_FCB + 33, random[i][0]);
+    if (cpm_call(&state, 33, CPM_FCB) || !cpm_dma_holds(&state, random[i][1]))
+      failed = "random read";
+  }
+  cpm_call(&state, 35, CPM_FCB);
+  if (!failed &&
+      i8080_read_byte(&state, CPM_FCB + 33) != CPM_RANDOM_RECORD + 1)
+    failed = "file size";
+  cpm_call(&state, 16, CPM_FCB);
+
+  cpm_fcb(&state, "OTHER   TXT", 0);
+  if (!failed && cpm_call(&state, 22, CPM_FCB))
+    failed = "make";
+  cpm_call(&state, 16, CPM_FCB);
+
+  // TEST.DAT is the only match, found whatever the order of the directory
+  cpm_fcb(&state, "????????DAT", 0);
+  if (!failed &&
+      (cpm_call(&state, 17, CPM_FCB) ||
+       memcmp(&state.external_memory[I8080_CPM_DMA + 1], "TEST    DAT", 11) ||
+       cpm_call(&state, 18, CPM_FCB) != 0xff))
+    failed = "search";
+  cpm_fcb(&state, "???????????", 0);
+  if (!failed &&
+      (cpm_call(&state, 17, CPM_FCB) || cpm_call(&state, 18, CPM_FCB) ||
+       cpm_call(&state, 18, CPM_FCB) != 0xff))
+    failed = "search";
+
+  cpm_fcb(&state, "TEST    DAT", 0);
+  for (int i = 0; i < 11; i++)
+    i8080_write_byte(&state, CPM_FCB + 17 + i, "MOVED   DAT"[i]);
+  if (!failed && cpm_call(&state, 23, CPM_FCB))
+    failed = "rename";
+  cpm_fcb(&state, "TEST    DAT", 0);
+  if (!failed && cpm_call(&state, 15, CPM_FCB) != 0xff)
+    failed = "rename";
+
+  const char* names[] = {"MOVED   DAT", "OTHER   TXT"};
+  for (int i = 0; i < 2; i++) {
+    cpm_fcb(&state, names[i], 0);
+    if (!failed && (cpm_call(&state, 19, CPM_FCB) ||
+                    cpm_call(&state, 15, CPM_FCB) != 0xff))
+      failed = "delete";
+  }
 
-  memset(state.external_memory, 0, mem_length);
-  file_to_mem(state.external_memory, "tests/8080PRE.COM", 0x100);
-  run_testrom(&state);
+  if (failed)
+    printf("Cp/m file test failed: %s\n", failed);
+
+  i8080_cpm_close(&cpm);
+  const char* files[] = {"test.dat", "moved.dat", "other.txt"};
+  for (int i = 0; i < 3; i++) {
+    char path[sizeof(directory) + 16];
+    snprintf(path, sizeof(path), "%s/%s", directory, files[i]);
+    remove(path);
+  }
+  rmdir(directory);
+
+  i8080_free_memory(&state);
+}
+
+// run_tests [-t tracefile] [-p profile] records every instruction into
+// tracefile (include/i8080/trace.h, needs a build with TRACE=1) and saves a
+// profile of the run for profile_report (PROFILE=1)
+int main(int argc, char** argv) {
+  i8080_t state;
+  init_i8080(&state);
+  if (!i8080_alloc_memory(&state)) {
+    printf("Out of memory\n");
+    return 1;
+  }
+
+  const char* trace_file = NULL;
+  const char* profile_file = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+      trace_file = argv[++i];
+    } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+      profile_file = argv[++i];
+    } else {
+      printf("usage: %s [-t tracefile] [-p profile]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  if (trace_file && !i8080_trace_start(&state, trace_file)) {
+    printf("Could not trace to: %s\n", trace_file);
+    return 1;
+  }
+  if (profile_file && !i8080_profile_start(&state)) {
+    printf("Could not profile, build with PROFILE=1\n");
+    return 1;
+  }
+
+  test_wrap();
+  test_debugger();
+  test_gdb();
+  test_replay();
+  test_snapshot();
+  test_instruction_count();
+  test_lockstep();
+  test_cpm_files();
+
+  // every rom starts from the same machine, restoring it only copies back the
+  // pages the previous rom wrote
+  i8080_snapshot_t* clean = i8080_snapshot(&state);
+
+  const char* roms[] = {"tests/TST8080.COM", "tests/CPUTEST.COM",
+                        "tests/8080PRE.COM", "tests/8080EXM.COM"};
+
+  for (int i = 0; i < 4; i++) {
+    i8080_image_t* image = load_rom(&state, roms[i]);
+    run_testrom(&state);
+
+    // back to ram on every page, the image isn't mapped any more
+    i8080_restore(&state, clean);
+    i8080_image_close(image);
+  }
+
+  if (state.trace && !i8080_trace_stop(&state))
+    printf("Could not write the whole trace\n");
+  if (state.profile) {
+    if (!i8080_profile_save(&state, profile_file))
+      printf("Could not write the profile: %s\n", profile_file);
+    i8080_profile_stop(&state);
+  }
 
-  memset(state.external_memory, 0, mem_length);
-  file_to_mem(state.external_memory, "tests/8080EXM.COM", 0x100);
-  run_testrom(&state);
+  i8080_snapshot_free(clean);
+  i8080_snapshot_forget(&state);
+  i8080_free_memory(&state);
 }
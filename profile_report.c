@@ -0,0 +1,137 @@
+#include "i8080/profile.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// lists the hot spots of a profile written by i8080_profile_save: the
+// addresses and functions that took the most cycles, who called those
+// functions, and the opcodes
+
+static i8080_profile_t profile;
+
+// indices of the count largest of values, largest first. returns how many
+// there are, only those that aren't 0
+static int top(const uint64_t* values, const int size, int* best,
+               const int count) {
+  int found = 0;
+
+  for (int i = 0; i < size; i++) {
+    if (!values[i] || (found == count && values[i] <= values[best[found - 1]]))
+      continue;
+
+    int at = found < count ? found++ : count - 1;
+    for (; at > 0 && values[best[at - 1]] < values[i]; at--)
+      best[at] = best[at - 1];
+    best[at] = i;
+  }
+
+  return found;
+}
+
+static double percent(const uint64_t part, const uint64_t whole) {
+  return whole ? 100.0 * part / whole : 0;
+}
+
+static bool load(const char* file_name) {
+  FILE* file = fopen(file_name, "rb");
+  if (!file)
+    return false;
+
+  char magic[sizeof(I8080_PROFILE_MAGIC) - 1];
+  uint8_t version;
+  const bool loaded = fread(magic, sizeof(magic), 1, file) == 1 &&
+                      memcmp(magic, I8080_PROFILE_MAGIC, sizeof(magic)) == 0 &&
+                      fread(&version, 1, 1, file) == 1 &&
+                      version == I8080_PROFILE_VERSION &&
+                      fread(&profile, sizeof(profile), 1, file) == 1;
+  fclose(file);
+
+  return loaded;
+}
+
+int main(int argc, char** argv) {
+  if (argc != 2 && argc != 3) {
+    fprintf(stderr, "usage: %s profile [count]\n", argv[0]);
+    return 1;
+  }
+
+  if (!load(argv[1])) {
+    fprintf(stderr, "Could not read profile: %s\n", argv[1]);
+    return 1;
+  }
+
+  const int count = argc == 3 ? atoi(argv[2]) : 20;
+  if (count <= 0) {
+    fprintf(stderr, "count must be positive: %s\n", argv[2]);
+    return 1;
+  }
+
+  int* best = malloc(count * sizeof(int));
+  uint64_t instructions = 0, cycles = 0;
+  for (int i = 0; i < 256; i++) {
+    instructions += profile.opcode_count[i];
+    cycles += profile.opcode_cycles[i];
+  }
+  printf("%llu instructions, %llu cycles\n", (unsigned long long)instructions,
+         (unsigned long long)cycles);
+
+  printf("\nhot addresses\n");
+  printf("%14s %14s %6s  instruction\n", "count", "cycles", "%");
+  int found = top(profile.pc_cycles, I8080_MAX_MEMORY, best, count);
+  for (int i = 0; i < found; i++) {
+    char line[I8080_DISASSEMBLY_LINE];
+    i8080_disassemble_line(&profile.code[best[i]], best[i], line);
+    printf("%14llu %14llu %6.2f  %s\n",
+           (unsigned long long)profile.pc_count[best[i]],
+           (unsigned long long)profile.pc_cycles[best[i]],
+           percent(profile.pc_cycles[best[i]], cycles), line);
+  }
+
+  printf("\nhot functions\n");
+  printf("%5s %12s %14s %6s %14s %6s\n", "entry", "calls", "self", "%", "total",
+         "%");
+  found = top(profile.self_cycles, I8080_MAX_MEMORY, best, count);
+  for (int i = 0; i < found; i++) {
+    const int function = best[i];
+    printf("%04x  %12llu %14llu %6.2f %14llu %6.2f\n", function,
+           (unsigned long long)profile.calls[function],
+           (unsigned long long)profile.self_cycles[function],
+           percent(profile.self_cycles[function], cycles),
+           (unsigned long long)profile.total_cycles[function],
+           percent(profile.total_cycles[function], cycles));
+  }
+
+  // callers of each of the functions above, the cycles they spent in it
+  printf("\ncallers\n");
+  for (int i = 0; i < found; i++) {
+    printf("%04x\n", best[i]);
+    for (int j = 0; j < I8080_PROFILE_EDGES; j++) {
+      const i8080_profile_edge_t* edge = &profile.edges[j];
+      if (edge->calls && edge->callee == best[i])
+        printf("      from %04x %12llu calls %14llu cycles\n", edge->caller,
+               (unsigned long long)edge->calls,
+               (unsigned long long)edge->cycles);
+    }
+  }
+  if (profile.lost_calls)
+    printf("%llu calls past the edge table\n",
+           (unsigned long long)profile.lost_calls);
+
+  printf("\nopcodes\n");
+  printf("%14s %14s %6s  mnemonic\n", "count", "cycles", "%");
+  found = top(profile.opcode_cycles, 256, best, count);
+  for (int i = 0; i < found; i++) {
+    const uint8_t bytes[3] = {best[i], 0, 0};
+    i8080_instruction_t instruction;
+    i8080_decode(bytes, 0, &instruction);
+    printf("%14llu %14llu %6.2f  %02x %s\n",
+           (unsigned long long)profile.opcode_count[best[i]],
+           (unsigned long long)profile.opcode_cycles[best[i]],
+           percent(profile.opcode_cycles[best[i]], cycles), best[i],
+           instruction.text);
+  }
+
+  free(best);
+
+  return 0;
+}
@@ -0,0 +1,51 @@
+#include "i8080/trace.h"
+
+#include <stdio.h>
+
+// renders a trace as text: every instruction disassembled, followed by the
+// registers it changed and the bytes it wrote
+int main(int argc, char** argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s tracefile\n", argv[0]);
+    return 1;
+  }
+
+  i8080_trace_reader_t reader;
+  if (!i8080_trace_open(&reader, argv[1])) {
+    fprintf(stderr, "Could not read trace: %s\n", argv[1]);
+    return 1;
+  }
+
+  static i8080_trace_record_t record;
+  static const char* const NAMES[8] = {"b", "c", "d", "e", "h", "l", "a", "f"};
+  const uint8_t* values[8] = {&record.b, &record.c, &record.d, &record.e,
+                              &record.h, &record.l, &record.a, &record.flags};
+
+  while (i8080_trace_next(&reader, &record)) {
+    if (record.interrupt) {
+      printf("---- interrupt, restart at %04x\n", record.pc);
+    } else {
+      char line[I8080_DISASSEMBLY_LINE];
+      i8080_disassemble_line(record.opcode, record.pc, line);
+      puts(line);
+    }
+
+    if (!record.changed && !record.sp_changed && !record.write_count)
+      continue;
+
+    printf("    ");
+    for (int i = 0; i < 8; i++) {
+      if ((record.changed >> i) & 1)
+        printf(" %s=%02x", NAMES[i], *values[i]);
+    }
+    if (record.sp_changed)
+      printf(" sp=%04x", record.sp);
+    for (int i = 0; i < record.write_count; i++)
+      printf(" [%04x]=%02x", record.writes[i].address, record.writes[i].byte);
+    printf("\n");
+  }
+
+  i8080_trace_close(&reader);
+
+  return 0;
+}
@@ -0,0 +1,104 @@
+#include "i8080/replay.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define ENTRY_SIZE (8 + 1 + 2)  // both kinds: cycles, kind and 2 bytes
+
+static bool read_bytes(FILE* file, uint8_t* bytes, const size_t count) {
+  return fread(bytes, 1, count, file) == count;
+}
+
+bool i8080_replay_save(const i8080_replay_t* replay, const char* file_name) {
+  FILE* file = fopen(file_name, "wb");
+  if (!file)
+    return false;
+
+  bool written =
+      fwrite(I8080_REPLAY_MAGIC, 1, sizeof(I8080_REPLAY_MAGIC) - 1, file) ==
+          sizeof(I8080_REPLAY_MAGIC) - 1 &&
+      fputc(I8080_REPLAY_VERSION, file) != EOF;
+
+  for (size_t i = 0; written && i < replay->count; i++) {
+    const i8080_replay_entry_t* entry = &replay->entries[i];
+    uint8_t bytes[ENTRY_SIZE];
+
+    for (int j = 0; j < 8; j++)
+      bytes[j] = entry->cycles >> j * 8;
+    bytes[8] = entry->kind;
+    if (entry->kind == I8080_REPLAY_IN) {
+      bytes[9] = entry->port;
+      bytes[10] = entry->value;
+    } else {
+      bytes[9] = entry->vector & 0xff;
+      bytes[10] = entry->vector >> 8;
+    }
+
+    written = fwrite(bytes, 1, sizeof(bytes), file) == sizeof(bytes);
+  }
+
+  return fclose(file) == 0 && written;
+}
+
+bool i8080_replay_load(i8080_replay_t* replay, const char* file_name) {
+  uint8_t header[sizeof(I8080_REPLAY_MAGIC) - 1 + 1];
+
+  FILE* file = fopen(file_name, "rb");
+  if (!file)
+    return false;
+
+  if (!read_bytes(file, header, sizeof(header)) ||
+      memcmp(header, I8080_REPLAY_MAGIC, sizeof(I8080_REPLAY_MAGIC) - 1) != 0 ||
+      header[sizeof(header) - 1] != I8080_REPLAY_VERSION) {
+    fclose(file);
+    return false;
+  }
+
+  i8080_replay_free(replay);
+
+  uint8_t bytes[ENTRY_SIZE];
+  bool valid = true;
+  while (valid && read_bytes(file, bytes, sizeof(bytes))) {
+    i8080_replay_entry_t entry = {0};
+
+    for (int j = 0; j < 8; j++)
+      entry.cycles |= (uint64_t)bytes[j] << j * 8;
+    entry.kind = bytes[8];
+    if (entry.kind == I8080_REPLAY_IN) {
+      entry.port = bytes[9];
+      entry.value = bytes[10];
+    } else {
+      entry.vector = bytes[9] | bytes[10] << 8;
+    }
+
+    valid = entry.kind <= I8080_REPLAY_INTERRUPT &&
+            (!replay->count ||
+             entry.cycles >= replay->entries[replay->count - 1].cycles);
+
+    if (valid && replay->count == replay->capacity) {
+      const size_t capacity = replay->capacity ? replay->capacity * 2 : 4096;
+      i8080_replay_entry_t* entries =
+          realloc(replay->entries, capacity * sizeof(i8080_replay_entry_t));
+      valid = entries != NULL;
+      if (valid) {
+        replay->entries = entries;
+        replay->capacity = capacity;
+      }
+    }
+
+    if (valid)
+      replay->entries[replay->count++] = entry;
+  }
+
+  fclose(file);
+
+  if (!valid)
+    i8080_replay_free(replay);
+
+  return valid;
+}
+
+void i8080_replay_free(i8080_replay_t* replay) {
+  free(replay->entries);
+  memset(replay, 0, sizeof(*replay));
+}
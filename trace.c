@@ -0,0 +1,114 @@
+#include "i8080/trace.h"
+
+#include <stddef.h>
+#include <string.h>
+
+static bool read_bytes(FILE* file, uint8_t* bytes, const size_t count) {
+  return fread(bytes, 1, count, file) == count;
+}
+
+static bool read_word(FILE* file, uint16_t* word) {
+  uint8_t bytes[2];
+  if (!read_bytes(file, bytes, 2))
+    return false;
+
+  *word = bytes[0] | bytes[1] << 8;
+
+  return true;
+}
+
+bool i8080_trace_open(i8080_trace_reader_t* reader, const char* file_name) {
+  uint8_t header[sizeof(I8080_TRACE_MAGIC) - 1 + 1 + 12];
+
+  reader->file = fopen(file_name, "rb");
+  if (!reader->file)
+    return false;
+
+  if (!read_bytes(reader->file, header, sizeof(header)) ||
+      memcmp(header, I8080_TRACE_MAGIC, sizeof(I8080_TRACE_MAGIC) - 1) != 0 ||
+      header[8] != I8080_TRACE_VERSION) {
+    fclose(reader->file);
+    return false;
+  }
+
+  const uint8_t* registers = &header[9];
+  i8080_trace_record_t* last = &reader->last;
+  memset(last, 0, sizeof(*last));
+  last->pc = registers[0] | registers[1] << 8;
+  last->sp = registers[2] | registers[3] << 8;
+  last->a = registers[4];
+  last->b = registers[5];
+  last->c = registers[6];
+  last->d = registers[7];
+  last->e = registers[8];
+  last->h = registers[9];
+  last->l = registers[10];
+  last->flags = registers[11];
+
+  return true;
+}
+
+bool i8080_trace_next(i8080_trace_reader_t* reader,
+                      i8080_trace_record_t* record) {
+  FILE* file = reader->file;
+  i8080_trace_record_t* last = &reader->last;
+  uint8_t tag;
+
+  if (!read_bytes(file, &tag, 1))
+    return false;
+
+  record->pc = last->pc + last->length;
+  if ((tag & I8080_TRACE_PC) && !read_word(file, &record->pc))
+    return false;
+
+  record->interrupt = tag & I8080_TRACE_INTERRUPT;
+  record->length = 0;
+  if (!record->interrupt) {
+    if (!read_bytes(file, record->opcode, 1))
+      return false;
+    record->length = i8080_opcode_length(record->opcode[0]);
+    if (!read_bytes(file, &record->opcode[1], record->length - 1))
+      return false;
+  }
+
+  // b, c, d, e, h, l, a, flags
+  uint8_t* registers[8] = {&record->b, &record->c, &record->d, &record->e,
+                           &record->h, &record->l, &record->a, &record->flags};
+  const uint8_t* previous[8] = {&last->b, &last->c, &last->d, &last->e,
+                                &last->h, &last->l, &last->a, &last->flags};
+  record->changed = 0;
+  if ((tag & I8080_TRACE_REGISTERS) && !read_bytes(file, &record->changed, 1))
+    return false;
+  for (int i = 0; i < 8; i++) {
+    *registers[i] = *previous[i];
+    if ((record->changed >> i) & 1 && !read_bytes(file, registers[i], 1))
+      return false;
+  }
+
+  record->sp = last->sp;
+  record->sp_changed = tag & I8080_TRACE_SP;
+  if (record->sp_changed && !read_word(file, &record->sp))
+    return false;
+
+  uint16_t count = 0;
+  if ((tag & I8080_TRACE_WRITES) &&
+      (!read_word(file, &count) || count > I8080_TRACE_MAX_WRITES))
+    return false;
+  record->write_count = count;
+  for (int i = 0; i < count; i++) {
+    uint8_t bytes[3];
+    if (!read_bytes(file, bytes, 3))
+      return false;
+    record->writes[i] = (i8080_trace_write_t){bytes[0] | bytes[1] << 8,
+                                              bytes[2]};
+  }
+
+  // only what the next record is decoded against, not the writes
+  memcpy(last, record, offsetof(i8080_trace_record_t, write_count));
+
+  return true;
+}
+
+void i8080_trace_close(i8080_trace_reader_t* reader) {
+  fclose(reader->file);
+}